@@ -0,0 +1,23 @@
+#pragma once
+
+#include <sysinfo.h>
+
+// sysinfo counters benchreport can print, see bench.c
+#define BENCH_BLOCK_READS 0x01   // bread()s, hits included
+#define BENCH_BLOCK_MISSES 0x02  // bread()s that went to the disk
+#define BENCH_DISK_WRITES 0x04   // blocks written to the disk
+#define BENCH_DISK_COMMANDS 0x08 // commands sent to the disk
+#define BENCH_COMMITS 0x10       // log commits
+#define BENCH_PCACHE_HITS 0x20   // page cache hits
+#define BENCH_DCACHE_HITS 0x40   // name cache hits
+
+// One measurement: set name, call benchstart, do the work, call
+// benchreport.
+struct bench {
+  char *name;             // program, printed first on every report
+  int start;              // uptime() at benchstart
+  struct sys_info before; // counters at benchstart
+};
+
+void benchstart(struct bench *);
+void benchreport(struct bench *, char *what, int n, char *unit, int counters);
@@ -5,10 +5,14 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uint used;          // referenced since the clock hand last passed
+  struct buf *next;   // clock ring of all buffers
+  struct buf *hnext;  // hash chain
+  struct buf *qnext;  // disk queue
+  uint qtime;         // ticks when it was queued
+  uchar *data;        // BSIZE bytes, aligned to BSIZE
 };
 #define B_VALID 0x2 // buffer has been read from disk
 #define B_DIRTY 0x4 // buffer needs to be written to disk
+#define B_ASYNC 0x8 // disk driver releases the buffer when the read is done
+#define B_READAHEAD 0x10 // read ahead and not yet asked for
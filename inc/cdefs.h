@@ -95,6 +95,7 @@
 #define SZ_2G UINT64_C(0x80000000)
 #define SZ_3G UINT64_C(0xc0000000)
 #define SZ_4G UINT64_C(0x0000000100000000)
+#define SZ_64G UINT64_C(0x0000001000000000)
 #define SZ_512G UINT64_C(0x0000008000000000)
 #define SZ_1T UINT64_C(0x0000010000000000)
 #define SZ_256T UINT64_C(0x0001000000000000)
@@ -148,3 +148,4 @@ enum {
 };
 
 void cpuid_print(void);
+int cpuid_feature(unsigned int bit);
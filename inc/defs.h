@@ -5,6 +5,7 @@ struct buf;
 struct context;
 struct extent;
 struct inode;
+struct pcidev;
 struct proc;
 struct rtcdate;
 struct spinlock;
@@ -19,12 +20,24 @@ struct file;
 struct pipe;
 struct syscall_message;
 
-extern int npages;
+extern uint64_t npages;
+extern struct core_map_entry *core_map;
 extern int pages_in_use;
 extern int pages_in_swap;
 extern int free_pages;
 extern int num_page_faults;
 extern int num_disk_reads;
+extern int num_bcache_hits;
+extern int num_disk_writes;
+extern int num_log_commits;
+extern int num_readahead_blocks;
+extern int num_readahead_hits;
+extern int num_disk_requests;
+extern int num_hypercalls;
+extern int guest_pages;
+extern int balloon_inflated;
+extern int balloon_deflated;
+extern int num_mem_pressure;
 
 extern int crashn_enable;
 extern int crashn;
@@ -48,8 +61,16 @@ extern int crashn;
 // bio.c
 void binit(void);
 struct buf *bread(uint, uint);
+void breadn(uint, uint, int, struct buf **);
 void brelse(struct buf *);
 void bwrite(struct buf *);
+void bwritesync(struct buf *);
+void bpin(struct buf *);
+void bunpin(struct buf *);
+void bprefetch(uint, uint, uint);
+void bflush(uint, uint, uint);
+void bsync(void);
+void bflusher(void);
 
 // console.c
 void consoleinit(void);
@@ -68,6 +89,7 @@ void            fileclose(struct file *);
 int             filestat(struct file *, struct stat *);
 int             fileread(struct file *, char *, int);
 int             filewrite(struct file *, char *, int);
+int             filesync(struct file *);
 
 // fs.c
 void readsb(int dev, struct superblock *sb);
@@ -81,20 +103,40 @@ struct inode *namei(char *);
 struct inode *nameiparent(char *, char *);
 int readi(struct inode *, char *, uint, uint);
 void stati(struct inode *, struct stat *);
+void isync(struct inode *);
 int writei(struct inode *, char *, uint, uint);
 void udiskinit(int);
 void udiskcopy(int, int);
-uint findBlocks(uint, uint);
+uint bmap(struct inode*, uint, uint*);
 void updateInodeFile(struct inode *);
 void createInode(char *);
+void dcdrop(int);
+extern int num_dcache_hits;
 
 // guest.c
-void insert_syscall(struct syscall_message*, int);
+void insert_syscall(struct syscall_message*, struct proc *);
+int leaseframe(struct proc *);
+void guest_app_exit(struct proc *);
+void guest_exit(struct proc *);
+void guest_balloon_check(void);
+void guest_timer_tick(void);
+int guest_cow_fault(struct vpage_info *, uint64_t);
+
+// image.c
+void imageinit(void);
+uint64_t imagemap(struct vspace *, struct inode *, uint64_t *);
+void imageadd(struct vspace *, struct inode *, uint64_t, uint64_t);
+uint64_t imagegetpage(int, struct inode *, uint64_t);
+int imageputpage(int, struct inode *, uint64_t, uint64_t);
+void imagedrop(int, struct inode *);
+extern int num_image_hits;
 
 // ide.c
 void ideinit(void);
 void ideintr(void);
 void iderw(struct buf *);
+void iderwasync(struct buf *);
+void iderwv(struct buf **, int);
 
 // ioapic.c
 void ioapicenable(int irq, int cpu);
@@ -105,8 +147,10 @@ void ioapicinit(void);
 struct core_map_entry *pa2page(uint64_t pa);
 void detect_memory(void);
 char *kalloc(void);
+char *kallochuge(void);
 void kfree(char *);
 void mem_init(void *);
+void mem_init_high(void);
 void mark_user_mem(uint64_t, uint64_t);
 void mark_kernel_mem(uint64_t);
 void kincref(uint64_t);
@@ -123,10 +167,22 @@ void lapicinit(void);
 void lapicstartap(uchar, uint);
 void microdelay(int);
 
+// log.c
+void initlog(int dev);
+void log_write(struct buf *);
+void begin_op(void);
+void end_op(void);
+void logsync(void);
+
 // mp.c
 extern int ismp;
 void mpinit(void);
 
+// virtio.c
+int virtioinit(void);
+void virtiorw(struct buf **, int);
+int virtiointr(int);
+
 // vspace.c
 void                vspacebootinit(void);
 int                 vspaceinit(struct vspace *);
@@ -147,6 +203,36 @@ int                 vregionaddmap(struct vregion *, uint64_t, uint64_t, short, s
 int                 vregiondelmap(struct vregion *, uint64_t, uint64_t);
 
 int                 cow_vspacecopy(struct vspace *, struct vspace *);
+int                 vspacecowcopy(struct vspace *, uint64_t);
+int                 vspacedemandload(struct vspace *, uint64_t);
+int                 vspaceloadrange(struct vspace *, uint64_t, uint64_t);
+int                 vspacezerofill(struct vspace *, uint64_t, int);
+int                 vspacefilefault(struct vspace *, uint64_t, int);
+uint64_t            vspacemmap(struct vspace *, uint64_t, int, struct inode *, uint64_t, int, int);
+int                 vspacemunmap(struct vspace *, uint64_t, uint64_t);
+int                 vspacemprotect(struct vspace *, uint64_t, uint64_t, int);
+void                vspacemsync(struct vspace *, uint64_t, uint64_t);
+extern int          num_demand_pages;
+extern int          num_lazy_pages;
+extern int          num_zero_maps;
+extern int          num_file_maps;
+extern int          num_huge_pages;
+
+// pagecache.c
+void pcinit(void);
+int pcread(struct inode *, char *, uint, uint);
+int pcwrite(struct inode *, char *, uint, uint);
+uint64_t pcmap(struct inode *, uint);
+void pcdirty(struct inode *, uint);
+int pccached(struct inode *, uint);
+void pcsync(struct inode *, uint);
+void pcdrop(uint, uint);
+extern int num_pcache_hits;
+
+// pci.c
+uint pciread(struct pcidev *, int);
+void pciwrite(struct pcidev *, int, uint);
+int pcifind(int, uint, uint, struct pcidev *);
 
 // picirq.c
 void picenable(int);
@@ -165,6 +251,7 @@ void sleep(void *, struct spinlock *);
 void sleep_process(void *);
 void sleep_process2(void *);
 void userinit(void);
+void kthread(void (*)(void), char *);
 int wait(void);
 void wakeup(void *);
 void wakeup1(void *);
@@ -176,6 +263,7 @@ void wakeup_children(void);
 int fork_guest(int num_pages);
 struct proc *allocproc(int cid);
 struct proc *get_proc_arr(void);
+int procslot(struct proc *);
 void unlock_ptable(void);
 void lock_ptable(void);
 void wakeup_apps(void);
@@ -200,6 +288,7 @@ void popcli(void);
 
 // sleeplock.c
 void acquiresleep(struct sleeplock *);
+int tryacquiresleep(struct sleeplock *);
 void releasesleep(struct sleeplock *);
 int holdingsleep(struct sleeplock *);
 void initsleeplock(struct sleeplock *, char *);
@@ -2,6 +2,7 @@
 
 #include <sleeplock.h>
 #include <extent.h>
+#include <fs.h>
 
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
@@ -23,7 +24,13 @@ struct inode {
   short type;         // copy of disk inode
   short devid;
   uint size;
-  struct extent data;
+  uint overflow;
+  struct extent extents[NEXTENT];
+  uint dirindex;
+
+  uint ra_next;       // offset a sequential reader reads next
+  uint ra_window;     // blocks to read ahead, 0 until reads look sequential
+  uint ra_end;        // first block of the file not read ahead yet
 };
 
 // table mapping device ID (devid) to device functions
@@ -7,12 +7,15 @@
 
 #define INODEFILEINO 0 // inode file inum
 #define ROOTINO 1      // root i-number
-#define BSIZE 512      // block size
+#ifndef BSIZE
+#define BSIZE 512      // block size, 512 or 4096 (make BSIZE=4096)
+#endif
 #define NDISK 9        // number of user disks
+#define PGBLOCKS (4096 / BSIZE) // blocks per page; extents are whole pages
 
 // Disk layout:
 // [ boot block | super block | free bit map |
-//                                          inode file | data blocks]
+//                          inode file | data blocks | ... | log ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -26,15 +29,26 @@ struct superblock {
   uint bmapstart;  // Block number of first free map block
   uint inodestart; // Block number of the start of inode file
   uint freeblock;  // Block number of the first free block
+  uint logstart;   // Block number of the log header
+  uint nlog;       // Number of log blocks, header included
+  uint bsize;      // Block size the file system was made with
 };
 
+#define NEXTENT 6 // extents in the inode
+
+// Extents in an overflow block
+#define NOVERFLOW (BSIZE / sizeof(struct extent))
+
 // On-disk inode structure
 struct dinode {
-  short type;         // File type
-  short devid;        // Device number (T_DEV only)
-  uint size;          // Size of file (bytes)
-  struct extent data; // Data blocks of file on disk
-  char pad[46];       // So disk inodes fit contiguosly in a block
+  short type;                     // File type
+  short devid;                    // Device number (T_DEV only)
+  uint size;                      // Size of file (bytes)
+  uint overflow;                  // Block of NOVERFLOW more extents, or 0
+  struct extent extents[NEXTENT]; // Data blocks of file on disk, in file
+                                  // order; the first empty one ends them
+  uint dirindex;                  // Inum of the hash index of a large
+                                  // directory, or 0
 };
 
 // offset of inode in inodefile
@@ -53,3 +67,31 @@ struct dirent {
   ushort inum;
   char name[DIRSIZ];
 };
+
+// A directory of DIRHASH_MIN entries or more gets a hash index, a file
+// of its own. Its first block holds a bucket head for each of NDIRHASH
+// buckets; each other block holds entries of one bucket and the offset
+// of the bucket's next block. The entries [0, upto) of the directory
+// are indexed, a few more each time an entry is added; lookups scan the
+// ones after upto.
+#define DIRHASH_MIN 64
+#define NDIRHASH (BSIZE / sizeof(uint) - 1)
+
+struct dirhashhead {
+  uint upto;            // bytes of the directory indexed
+  uint heads[NDIRHASH]; // offset of each bucket's first block, or 0
+};
+
+struct dirhashent {
+  uint hash;            // of the name
+  uint off;             // of the dirent in the directory
+};
+
+// Entries in a block of the index
+#define NDIRHASHENT ((BSIZE - 2 * sizeof(uint)) / sizeof(struct dirhashent))
+
+struct dirhashblock {
+  uint next;            // offset of the bucket's next block, or 0
+  uint n;               // entries used
+  struct dirhashent ents[NDIRHASHENT];
+};
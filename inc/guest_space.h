@@ -15,7 +15,14 @@ struct guest_entry {
 // replace proc bitmap value with this struct
 struct app_va_segment {
 	short owned;
+	int pid;
 	uint64_t bound;
 	uint64_t midpoint;
 	uint64_t base;
 };
+
+// a frame xkvisor leases to a guest os, as gquery_user_pages reports it
+struct guest_frame {
+	int ppn;
+	int maps; // 1 owned and available, 2 and up mapped by that many apps plus one
+};
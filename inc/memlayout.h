@@ -27,10 +27,19 @@
 #define KERNBASE 0xFFFFFFFF80000000
 #define DEVBASE 0xFFFFFFFF40000000
 #define KERNLINK (KERNBASE + EXTMEM) // Address where kernel is linked
-
-#define V2P(a) (((uint64_t)(a)) - KERNBASE)
-#define P2V(a) (((void *)(a)) + KERNBASE)
+#define USERTOP 0x0000800000000000  // User addresses are below
+
+// All of physical memory is mapped at DIRECTMAP, with the largest pages
+// that fit. The kernel image is also mapped at KERNBASE, where it is linked.
+#define DIRECTMAP 0xFFFF888000000000
+#define MAXPHYSMEM SZ_64G           // physical memory beyond is not used
+#define BOOTMAPPED SZ_1G            // mapped by the boot page table
+
+#define V2P(a)                                                                 \
+  ((uint64_t)(a) >= KERNBASE ? ((uint64_t)(a)) - KERNBASE                      \
+                             : ((uint64_t)(a)) - DIRECTMAP)
+#define P2V(a) (((void *)(a)) + DIRECTMAP)
 #define IO2V(a) (((void *)(a)) + 0xFFFFFFFF00000000)
 
-#define V2P_WO(x) ((x)-KERNBASE)   // same as V2P, but without casts
-#define P2V_WO(x) ((x) + KERNBASE) // same as P2V, but without casts
+#define V2P_WO(x) ((x)-KERNBASE)   // kernel image only, without casts
+#define P2V_WO(x) ((x) + KERNBASE) // kernel image only, without casts
@@ -0,0 +1,21 @@
+#pragma once
+
+// mmap and mprotect protections
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+// mmap flags; anonymous mappings must be private
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+#define MAP_NOHUGE 0x80000  // xk: never back the area with 2MB pages
+
+// msync flags; every msync writes back synchronously
+#define MS_ASYNC 0x1
+#define MS_INVALIDATE 0x2
+#define MS_SYNC 0x4
+
+#define MAP_FAILED ((void *) -1)
+
+#define MMAP_BASE SZ_1G           // mmap areas go in [MMAP_BASE, MMAP_TOP),
+#define MMAP_TOP (SZ_2G - SZ_1M)  // between the heap and the stack
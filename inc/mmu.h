@@ -109,6 +109,11 @@
 #define PGROUNDUP(sz) (((sz) + PGSIZE - 1) & ~(PGSIZE - 1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE - 1))
 
+#define HPGSIZE PD_SIZE                // bytes mapped by a PTE_PS page directory entry
+#define HPGPAGES (HPGSIZE / PGSIZE)    // 4KB pages in it
+#define HPGROUNDDOWN(a) (((a)) & ~(HPGSIZE - 1))
+#define HPDE_ADDR(pde) ((physaddr_t)(pde)&BITMASK64(51, 21))
+
 // various segment selectors.
 #define SEG_KCODE 1 // kernel code
 #define SEG_KDATA 2 // kernel data+stack
@@ -151,10 +156,14 @@ struct segdesc {
   }
 
 struct core_map_entry {
-  int available;
-  short user;   // 0 if kernel allocated memory, otherwise is user
-	uint64_t va;  // if it is used by kernel only, this field is 0
+  uint64_t va;      // if it is used by kernel only, this field is 0
   int ref;
+  short available;
+  short user;       // 0 if kernel allocated memory, otherwise is user
+  int lessee;       // pid of the guest os the frame is leased to, 0 if none
+  int maps;         // leased: 1 idle in the guest's pool, 2 and up mapped by that many apps plus one
+  uint next;        // next and previous page (ppn + 1) on the free list, or on
+  uint prev;        // the guest's lease list if leased; 0 at the ends
 };
 
 #endif
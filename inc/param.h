@@ -12,8 +12,8 @@
 #define MAXOPBLOCKS 10 // max # of blocks any FS op writes
 
 #define LOGSIZE (MAXOPBLOCKS * 3) // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)    // size of disk block cache
-#define FSSIZE 100000             // size of file system in blocks
+#define NBUF (MAXOPBLOCKS * 3)    // minimum size of disk block cache
+#define FSSIZE (100000 * 512 / BSIZE) // size of file system in blocks
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
-#define UDISKSIZE 1000            // number of blocks per user disk
+#define UDISKSIZE (8192 * 512 / BSIZE) // number of blocks per user disk, 4MB
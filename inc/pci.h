@@ -0,0 +1,23 @@
+#pragma once
+
+// PCI configuration space registers
+#define PCI_ID 0x00       // device id << 16 | vendor id
+#define PCI_COMMAND 0x04  // status << 16 | command
+#define PCI_CLASS 0x08    // class << 24 | subclass << 16 | prog if << 8 | revision
+#define PCI_BAR0 0x10     // six base address registers follow
+#define PCI_HEADER 0x0c   // header type in bits 16-23
+#define PCI_INTR 0x3c     // interrupt line in the low byte
+
+// PCI_COMMAND bits
+#define PCI_CMD_IO 0x1     // respond to I/O space accesses
+#define PCI_CMD_MEM 0x2    // respond to memory space accesses
+#define PCI_CMD_MASTER 0x4 // may act as bus master (DMA)
+
+// An I/O base address register has bit 0 set.
+#define PCI_BAR_IO 0x1
+
+struct pcidev {
+  uint bus;
+  uint dev;
+  uint func;
+};
@@ -93,10 +93,21 @@ struct proc {
   char name[16];               // Process name (debugging)
   struct file *ofile[NOFILE];
   struct syscall_message *syscall_buffer; // buffer for holding system call and trap messages
-  uint8_t user_pages[MAX_PHYS_PAGES];     // "bit" (actually byte) map from ppn to page status 
-                                          // (0 not owned, 1 owned and available, 2 owned and used in app)
-  struct app_va_segment app_processes[NPROC]; // map of pid to process status (owned vs. not owned) and base/midpoint/bound of va
+  uint leases;                            // guest os: first frame (ppn + 1) of its lease list, see guest.c
+  int nleases;                            // guest os: frames on the lease list
+  struct app_va_segment app_processes[NPROC]; // map of ptable slot to app status (owned vs. not owned) and base/midpoint/bound of va
   int is_guest_os;                        // 1 if guest os, 0 if not
+  int napps;                              // guest os: number of apps it owns
+  int nqueued;                            // guest os: messages waiting in syscall_buffer
+  struct proc *guest;                     // app: guest os that owns it and serves its hypercalls
+  struct proc *awaiting_guest;            // guest os we are blocked on in app_syscall, if any
+  int reply_value;                        // app_syscall return value delivered by gresume
+  struct pvblk_ring *blkring;             // guest os: paravirtual block ring, see pvblk.h
+  uint blk_avail;                         // guest os: next avail index xkvisor will serve
+  uint timer_deadline;                    // guest os: tick of the next virtual timer event, 0 if disarmed
+  uint timer_period;                      // guest os: ticks between events, 0 for one-shot
+  int timer_pending;                      // guest os: a MESSAGE_TIMER is queued and not yet taken
+  int timer_overruns;                     // guest os: deadlines passed while an event was pending
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,42 @@
+#pragma once
+
+// Paravirtual block device shared between a guest os and xkvisor.
+//
+// The guest os owns the ring and registers it once with gblk_setup. To
+// submit I/O it fills descriptors, posts their ids to avail[] and bumps
+// avail_idx, then issues a single gblk_notify for the whole batch.
+// xkvisor runs every posted descriptor against the guest's container disk,
+// writes a used[] entry per descriptor, bumps used_idx, and queues one
+// MESSAGE_BLK_COMPLETE to the guest. Indices are free running; slots are
+// taken modulo PVBLK_RING_SIZE.
+
+#define PVBLK_RING_SIZE 32  // descriptors in flight per guest
+#define PVBLK_MAX_NBLOCKS 8 // contiguous blocks per descriptor
+
+// descriptor types
+#define PVBLK_READ 0
+#define PVBLK_WRITE 1
+
+// used entry status
+#define PVBLK_OK 0
+#define PVBLK_ERR -1
+
+struct pvblk_desc {
+  uint blockno; // first block, relative to the start of the container disk
+  uint nblocks; // number of contiguous blocks, at most PVBLK_MAX_NBLOCKS
+  int type;     // PVBLK_READ or PVBLK_WRITE
+  char *data;   // guest buffer of nblocks * BSIZE bytes
+};
+
+struct pvblk_used {
+  uint id;    // descriptor that completed
+  int status; // PVBLK_OK or PVBLK_ERR
+};
+
+struct pvblk_ring {
+  struct pvblk_desc desc[PVBLK_RING_SIZE];
+  uint avail_idx;                          // written by the guest
+  uint avail[PVBLK_RING_SIZE];             // descriptor ids posted by the guest
+  uint used_idx;                           // written by xkvisor
+  struct pvblk_used used[PVBLK_RING_SIZE]; // completions written by xkvisor
+};
@@ -40,3 +40,20 @@
 
 #define SYS_gdeploy_program 35
 
+#define SYS_ginflate 36
+#define SYS_gdeflate 37
+
+#define SYS_gblk_setup 38
+#define SYS_gblk_notify 39
+#define SYS_gtimer 40
+#define SYS_gcopyout 41
+#define SYS_gfork_app 42
+#define SYS_gcowcopy 43
+#define SYS_gbind_app 44
+#define SYS_mmap 45
+#define SYS_munmap 46
+#define SYS_mprotect 47
+#define SYS_msync 48
+#define SYS_fsync 49
+#define SYS_sync 50
+
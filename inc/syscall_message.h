@@ -4,12 +4,19 @@
 #include <stat.h>
 #include <file.h>
 
-#define SHELL_PID 3
-#define GUEST_PID 2
-
 // memory settings for guest os
-#define MAX_PHYS_PAGES 5000
 #define DEFAULT_USER_PAGES 2000
+#define NGUESTS 2 // guest os instances started by init, sharing DEFAULT_USER_PAGES
+
+// memory ballooning: xkvisor asks guests to return idle frames once
+// free_pages drops below the low watermark, and asks again only after
+// free_pages has recovered above the high watermark. gdeflate never takes
+// free_pages below the low watermark.
+#define BALLOON_LOW_WATERMARK 256
+#define BALLOON_HIGH_WATERMARK 512
+#define BALLOON_MAX_DEFLATE 256 // max pages granted by a single gdeflate
+#define BALLOON_CHUNK 64        // pages a guest asks for when it runs dry
+#define GUEST_RESERVE_PAGES 32  // idle pages a guest keeps when inflating
 
 // memory macros
 #define APP_HEAP 3
@@ -21,6 +28,17 @@
 #define MESSAGE_WRITE 1 // index in guest os syscall table
 #define MESSAGE_INIT_APP 2
 #define MESSAGE_DESTROY_APP 3
+#define MESSAGE_MEM_PRESSURE 4 // sent by xkvisor, args[0] is the number of pages wanted back
+#define MESSAGE_BLK_COMPLETE 5 // sent by xkvisor, args[0] is the number of used ring entries added
+#define MESSAGE_TIMER 6 // sent by xkvisor, args[0] is ticks, args[1] is deadlines missed since the last one
+#define MESSAGE_OPEN 7  // path, mode; returns a guest fd
+#define MESSAGE_READ 8  // fd, buffer, n
+#define MESSAGE_FSTAT 9 // fd, struct stat *
+#define MESSAGE_CLOSE 10 // fd
+#define MESSAGE_SBRK 11 // n; returns the old break
+#define MESSAGE_FORK 12 // returns the child's pid, 0 in the child
+#define MESSAGE_COW_FAULT 13 // sent by xkvisor for an app, args[0] is the page va
+#define MESSAGE_INIT_APP_COLD 14 // MESSAGE_INIT_APP without the guest's zygote pools
 
 #define MAX_ARGS 6  // including argc 
 #define MAX_STRING_SIZE 64 // buggy when size is too big, leave as 64
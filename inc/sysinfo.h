@@ -6,4 +6,23 @@ struct sys_info {
   int free_pages;
   int num_page_faults;
   int num_disk_reads;
+  int num_bcache_hits;     // block reads served by the buffer cache
+  int num_disk_writes;     // blocks written to the disk
+  int num_log_commits;     // groups of transactions committed by the log
+  int num_readahead_blocks; // blocks read ahead of sequential readers
+  int num_readahead_hits;  // read-ahead blocks a later bread found cached
+  int num_disk_requests;   // commands sent to the disk, each for one or more blocks
+  int num_hypercalls;
+  int guest_pages;         // frames currently leased to guest oses
+  int balloon_inflated;    // frames guests returned through ginflate
+  int balloon_deflated;    // frames guests were granted through gdeflate
+  int num_mem_pressure;    // memory pressure notifications sent to guests
+  int num_image_hits;      // program loads served from the exec image cache
+  int num_demand_pages;    // program pages read from disk on first touch
+  int num_lazy_pages;      // heap pages zero-filled on first write
+  int num_zero_maps;       // heap pages first read through the shared zero page
+  int num_file_maps;       // file pages mapped from the page cache on first touch
+  int num_pcache_hits;     // file page lookups served by the page cache
+  int num_huge_pages;      // 2MB blocks of heap or mmap populated at once
+  int num_dcache_hits;     // name lookups served by the name cache
 };
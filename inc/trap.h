@@ -26,6 +26,10 @@
 #define TRAP_VC 29 /* VMM communication */
 #define TRAP_SX 30 /* security */
 
+// page fault error code bits
+#define PF_PRESENT 0x1 // protection violation, not a missing page
+#define PF_WRITE 0x2   // caused by a write
+
 #define TRAP_IRQ0 32
 #define TRAP_SYSCALL 64 // system call
 
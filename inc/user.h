@@ -2,6 +2,7 @@
 #include <cdefs.h>
 #include <syscall_message.h>
 #include <guest_space.h>
+#include <pvblk.h>
 
 #define STDOUT 1
 
@@ -31,6 +32,12 @@ int chdir(char *);
 int dup(int);
 int getpid(void);
 char *sbrk(int);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int mprotect(void *, int, int);
+int msync(void *, int, int);
+int fsync(int);
+int sync(void);
 int sleep(int);
 int uptime(void);
 int sysinfo(struct sys_info *);
@@ -42,14 +49,23 @@ int app_syscall(int, struct arg*);
 // privileged system calls
 int gnum_children(void);
 int gnext_syscall(struct syscall_message *);
-int gresume(int);
-int gquery_user_pages(uint8_t *);
-int grequest_proc(struct app_va_segment *, uint64_t, uint64_t, uint64_t);
+int gresume(int, int);
+int gquery_user_pages(struct guest_frame *, int);
+int grequest_proc(struct app_va_segment *, uint64_t, uint64_t, uint64_t, int);
 int gload_program(int, char *);
 int gdeploy_program(struct syscall_message *);
 int gaddmap(int app_pid, int host_ppn, uint64_t va, int app_present, int app_writeable);
 int gremovemap(int app_pid, uint64_t va);
 int gupdate_flags(int app_pid, uint64_t va, int app_present, int app_writeable);
+int ginflate(int *ppns, int n);
+int gdeflate(int n);
+int gblk_setup(struct pvblk_ring *ring);
+int gblk_notify(void);
+int gtimer(int delay, int period);
+int gcopyout(int app_pid, uint64_t va, void *src, int n);
+int gfork_app(int app_pid, struct app_va_segment *);
+int gcowcopy(int app_pid, uint64_t va, int host_ppn);
+int gbind_app(int app_pid, int parent_pid);
 
 // for starting guest os from shell
 int fork_guest(int);
@@ -68,3 +84,15 @@ void *memset(void *, int, uint);
 void *malloc(uint);
 void free(void *);
 int atoi(const char *);
+void itoa(int, char *);
+
+// afile.c, file system calls served by the guest os
+int aopen(char *, int);
+int aread(int, void *, int);
+int afstat(int, struct stat *);
+int aclose(int);
+char *asbrk(int);
+
+// aproc.c, process calls served by the guest os
+int afork(void);
+void setstrarg(struct arg *, char *);
@@ -0,0 +1,69 @@
+#pragma once
+
+// Legacy virtio over PCI: the device's registers are in the I/O space
+// of BAR0, its queues are split virtqueues in guest memory.
+
+#define VIRTIO_VENDOR 0x1af4
+#define VIRTIO_ID_BLK 0x1001 // transitional virtio-blk
+
+// registers, as offsets from BAR0
+#define VIRTIO_HOST_FEATURES 0x00  // 32 bits
+#define VIRTIO_GUEST_FEATURES 0x04 // 32 bits
+#define VIRTIO_QUEUE_PFN 0x08      // 32 bits, page of the selected queue
+#define VIRTIO_QUEUE_NUM 0x0c      // 16 bits, size of the selected queue
+#define VIRTIO_QUEUE_SEL 0x0e      // 16 bits
+#define VIRTIO_QUEUE_NOTIFY 0x10   // 16 bits
+#define VIRTIO_STATUS 0x12         // 8 bits
+#define VIRTIO_ISR 0x13            // 8 bits, reading clears the interrupt
+#define VIRTIO_CONFIG 0x14         // device specific, without MSI-X
+
+// VIRTIO_STATUS bits
+#define VIRTIO_STATUS_ACK 0x1
+#define VIRTIO_STATUS_DRIVER 0x2
+#define VIRTIO_STATUS_DRIVER_OK 0x4
+#define VIRTIO_STATUS_FAILED 0x80
+
+// feature bits
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+
+// virtio-blk request types and status
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK 0
+
+// A legacy queue is aligned to, and its used ring starts on, a page
+#define VIRTIO_PGSIZE 4096
+
+struct vring_desc {
+  uint64_t addr;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VRING_DESC_F_NEXT 0x1
+#define VRING_DESC_F_WRITE 0x2    // device writes the buffer
+#define VRING_DESC_F_INDIRECT 0x4 // addr holds a table of descriptors
+
+struct vring_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vring_used_elem {
+  uint id;
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;
+  struct vring_used_elem ring[];
+};
+
+// Header of a virtio-blk request.
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  uint64_t sector;
+};
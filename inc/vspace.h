@@ -1,6 +1,7 @@
 #pragma once
 
 #include <defs.h>
+#include <mman.h>
 #include <mmu.h>
 
 #define NREGIONS 5
@@ -47,10 +48,42 @@ struct vregion {
   uint64_t va_base;       // base of the region
   uint64_t size;          // size of region in bytes
   struct vpi_page *pages;  // pointer to array of page_infos
+  short readonly;         // writes fault, even to copy-on-write pages
+  short nohuge;           // never populated with 2MB pages
+  // file mmap areas: pages come from the page cache, read from ip at off
+  // for va_base on. Writes to a shared area go to the cached pages, writes
+  // to a private one to copies.
+  struct inode *ip;
+  uint64_t off;
+  short shared;
+};
+
+#define NVSEGMENTS 4   // program segments that can be paged in
+#define FAULTAROUND 4  // program pages read per demand fault
+
+// A program segment in the code region. Its pages are read from the
+// program file on first touch; bytes past filesz are zero.
+struct vsegment {
+  uint64_t va;       // page aligned start
+  uint64_t memsz;
+  uint64_t off;      // file offset of the first byte
+  uint64_t filesz;
+  short writable;
 };
 
 struct vspace {
   struct vregion regions[NREGIONS];
   pml4e_t* pgtbl;
+  // program backing the code region, 0 if it is fully loaded
+  struct inode *ip;
+  int cid;           // container that loaded it
+  int nsegs;
+  struct vsegment segs[NVSEGMENTS];
+  // mmap areas, anonymous ones zero-filled and file ones paged in on first
+  // touch: a page of them sorted by address, allocated by the first mmap
+  int nvmas;
+  struct vregion *vmas;
 };
 
+#define NVMAS (PGSIZE / sizeof(struct vregion))
+
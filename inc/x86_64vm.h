@@ -5,6 +5,7 @@ void      seginit(void);
 void      kvmalloc(void);
 pml4e_t*  setupkvm(void);
 int       mappages(pml4e_t *, uint64_t, int, uint64_t, int, int);
+int       maphugepage(pml4e_t *, uint64_t, uint64_t, int);
 pte_t*		walkpml4(pml4e_t*, const void*, int);
 int       allocuvm(pml4e_t*, char*, uint64_t, uint64_t);
 int       deallocuvm(pml4e_t*, char*, uint64_t, uint64_t);
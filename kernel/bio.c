@@ -1,13 +1,15 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to mark it for the disk,
+//     or log_write inside a file system transaction.
+// * To wait until buffers are on the disk, call bflush.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -17,78 +19,234 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Writes are delayed: bwrite only marks the buffer dirty, so a block
+// written many times goes to the disk once. Dirty buffers are written
+// back, sorted by block number, by the flusher thread every FLUSH_TICKS
+// ticks or as soon as half the cache is dirty, by bflush on fsync and
+// sync, and by bget when it recycles one.
+//
+// The number of buffers is picked at boot from the free memory. Buffers
+// are found through a hash table on (dev, blockno); each chain has its own
+// lock, so lookups of different blocks do not contend. A miss recycles a
+// buffer with the CLOCK algorithm. A buffer comes in with its used bit
+// clear and a hit sets it, so blocks read once, as by a scan, are recycled
+// before blocks that are used again.
+//
+// Lock order: bcache.lock, which serializes recycling, before the chain
+// locks. Only one chain lock is held at a time, and neither is held while
+// waiting for a buffer's sleeplock.
 
 #include <cdefs.h>
 #include <defs.h>
 #include <fs.h>
+#include <mmu.h>
 #include <param.h>
 #include <sleeplock.h>
 #include <spinlock.h>
 
 #include <buf.h>
 
+static_assert(PGSIZE % BSIZE == 0, "a page must hold whole blocks");
+
 int crashn_enable = 0;
 int crashn = 0;
 
 int num_disk_reads = 0;
+int num_bcache_hits = 0;
+int num_disk_writes = 0;
+int num_readahead_blocks = 0;
+int num_readahead_hits = 0;
+int num_disk_requests = 0;
 
-struct {
+#define NBHASH 61       // hash chains
+#define BCACHE_FRAC 32  // share of the free pages used for buffers
+#define NODEV (~0U)     // dev of a buffer that never held a block
+#define FLUSH_TICKS 100 // longest a write stays in memory
+#define NFLUSH 128      // buffers written per batch
+#define NBREADN 16      // most buffers one breadn returns
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock; // held while a buffer is recycled
+  struct buf *hand;     // clock hand, into the ring of all buffers
+  struct buf *ring;     // first buffer of the ring
+  int nbuf;
+  int ndirty;           // buffers waiting for the disk
+  struct sleeplock flushlock; // one bflush at a time, it owns batch
+  struct buf *batch[NFLUSH];
+  struct buf *busy[NFLUSH];   // bufs of the batch someone else held
+  struct bucket hash[NBHASH];
 } bcache;
 
+static struct bucket *bhash(uint dev, uint blockno) {
+  return &bcache.hash[(dev * 31 + blockno) % NBHASH];
+}
+
 void binit(void) {
-  struct buf *b;
+  struct buf *b, *last = 0;
+  char *page, *data = 0;
+  int i, n, want, per = PGSIZE / sizeof(struct buf);
 
   initlock(&bcache.lock, "bcache");
+  initsleeplock(&bcache.flushlock, "bflush");
+  for (i = 0; i < NBHASH; i++)
+    initlock(&bcache.hash[i].lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Allocate the buffer headers a page at a time and link them into the
+  // ring. Their data goes in pages of its own, so it is aligned to
+  // BSIZE and a 4KB block is exactly a page. Each buffer starts out as
+  // a distinct block of no device.
+  want = max(NBUF, free_pages / BCACHE_FRAC * (PGSIZE / BSIZE));
+  while (bcache.nbuf < want && (page = kalloc()) != 0) {
+    memset(page, 0, PGSIZE);
+    for (n = 0; n < per && bcache.nbuf < want; n++) {
+      if (bcache.nbuf % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+        break;
+      b = (struct buf *)page + n;
+      b->data = (uchar *)data + bcache.nbuf % (PGSIZE / BSIZE) * BSIZE;
+      initsleeplock(&b->lock, "buffer");
+      b->dev = NODEV;
+      b->blockno = bcache.nbuf++;
+      b->hnext = bhash(b->dev, b->blockno)->head;
+      bhash(b->dev, b->blockno)->head = b;
+      if (last)
+        last->next = b;
+      else
+        bcache.hand = b;
+      last = b;
+    }
   }
+  if (bcache.nbuf < NBUF)
+    panic("binit: no memory for buffers");
+  last->next = bcache.hand;
+  bcache.ring = bcache.hand;
+  cprintf("bcache: %d buffers\n", bcache.nbuf);
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buf *bget(uint dev, uint blockno) {
+// Returns the buffer of (dev, blockno) with a reference taken, or 0 if it
+// is not cached. The chain lock of bk must be held.
+static struct buf *bfind(struct bucket *bk, uint dev, uint blockno) {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+  for (b = bk->head; b; b = b->hnext) {
     if (b->dev == dev && b->blockno == blockno) {
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      b->used = 1;
       return b;
     }
   }
+  return 0;
+}
+
+// Write the n locked, dirty buffers of bs to the disk together.
+static void bwritebackv(struct buf **bs, int n) {
+  if (crashn_enable) {
+    if (crashn < n) {
+      // the disk gets the writes before the crash point
+      iderwv(bs, crashn);
+      reboot();
+    }
+    crashn -= n;
+  }
+  iderwv(bs, n);
+  num_disk_writes += n;
+  acquire(&bcache.lock);
+  bcache.ndirty -= n;
+  release(&bcache.lock);
+}
+
+// Write locked, dirty buffer b to the disk.
+static void bwriteback(struct buf *b) {
+  bwritebackv(&b, 1);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer. With probe set, return 0 instead
+// of a buffer that is already cached.
+static struct buf *bget(uint dev, uint blockno, int probe) {
+  struct bucket *bk = bhash(dev, blockno), *vk;
+  struct buf *b, **pp;
+  int i;
+
+retry:
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  if (b && probe)
+    b->refcnt--;
+  release(&bk->lock);
+  if (b) {
+    if (probe)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
 
-  // Not cached; recycle some unused buffer and clean buffer
-  // "clean" because B_DIRTY and not locked means log.c
-  // hasn't yet committed the changes to the buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
+  // Not cached. Recycling is serialized, so check again whether someone
+  // else brought the block in while we waited.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  if (b && probe)
+    b->refcnt--;
+  release(&bk->lock);
+  if (b) {
+    release(&bcache.lock);
+    if (probe)
+      return 0;
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  // Advance the clock hand to an unused buffer, clearing used bits on
+  // the way. Two turns clear every used bit.
+  for (i = 0; i < 2 * bcache.nbuf + 1; i++) {
+    b = bcache.hand;
+    bcache.hand = b->next;
+    vk = bhash(b->dev, b->blockno);
+    acquire(&vk->lock);
+    if (b->refcnt != 0) {
+      release(&vk->lock);
+      continue;
+    }
+    if (b->used) {
+      b->used = 0;
+      release(&vk->lock);
+      continue;
+    }
+    if (b->flags & B_DIRTY) {
+      // write the victim back first; the block we want may have
+      // come in while we waited, so look again
+      b->refcnt++;
+      release(&vk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
-      return b;
+      if (b->flags & B_DIRTY)
+        bwriteback(b);
+      brelse(b);
+      goto retry;
     }
+    for (pp = &vk->head; *pp != b; pp = &(*pp)->hnext)
+      ;
+    *pp = b->hnext;
+    release(&vk->lock);
+
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->refcnt = 1;
+    acquire(&bk->lock);
+    b->hnext = bk->head;
+    bk->head = b;
+    release(&bk->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
   panic("bget: no buffers");
 }
@@ -98,45 +256,198 @@ struct buf *bread(uint dev, uint blockno) {
   num_disk_reads += 1;
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if (!(b->flags & B_VALID)) {
     iderw(b);
+  } else {
+    num_bcache_hits += 1;
+    if (b->flags & B_READAHEAD)
+      num_readahead_hits += 1;
   }
+  b->flags &= ~B_READAHEAD;
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
-void bwrite(struct buf *b) {
-  if (crashn_enable) {
-    crashn--;
-    if (crashn < 0)
-      reboot();
+// Return locked buffers with the contents of blocks [blockno, blockno + n)
+// of dev in bs, n at most NBREADN. The blocks that are not cached are
+// read together.
+void breadn(uint dev, uint blockno, int n, struct buf **bs) {
+  struct buf *rd[NBREADN];
+  int i, m = 0;
+
+  if (n > NBREADN)
+    panic("breadn");
+  for (i = 0; i < n; i++) {
+    num_disk_reads += 1;
+    bs[i] = bget(dev, blockno + i, 0);
+    if (!(bs[i]->flags & B_VALID)) {
+      rd[m++] = bs[i];
+    } else {
+      num_bcache_hits += 1;
+      if (bs[i]->flags & B_READAHEAD)
+        num_readahead_hits += 1;
+    }
+    bs[i]->flags &= ~B_READAHEAD;
   }
+  iderwv(rd, m);
+}
+
+// Start reading blocks [blockno, blockno + n) of dev into the cache and
+// return without waiting. Blocks already cached are skipped. The disk
+// driver reads each contiguous run with one request and releases the
+// buffers as they arrive; a bread of one of them waits for its lock.
+void bprefetch(uint dev, uint blockno, uint n) {
+  struct buf *b;
+
+  for (uint i = 0; i < n; i++) {
+    if ((b = bget(dev, blockno + i, 1)) == 0)
+      continue;
+    if (b->flags & B_VALID) {
+      // someone read it while we waited for the lock
+      brelse(b);
+      continue;
+    }
+    b->flags |= B_READAHEAD;
+    num_readahead_blocks += 1;
+    iderwasync(b);
+  }
+}
+
+// Write b's contents to disk now and wait for it.  Must be locked.
+void bwritesync(struct buf *b) {
+  bwrite(b);
+  bwriteback(b);
+}
+
+// Keep b in the cache until bunpin, e.g. until the log commits it.
+void bpin(struct buf *b) {
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  b->refcnt++;
+  release(&bk->lock);
+}
+
+void bunpin(struct buf *b) {
+  struct bucket *bk = bhash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// Mark b's contents to be written to disk.  Must be locked.
+void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock))
     panic("bwrite");
+  if (b->flags & B_DIRTY)
+    return;
   b->flags |= B_DIRTY;
-  iderw(b);
+  acquire(&bcache.lock);
+  bcache.ndirty++;
+  release(&bcache.lock);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
 void brelse(struct buf *b) {
+  struct bucket *bk;
+
   if (!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b cannot be recycled while we hold a reference, so its chain is stable
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+  release(&bk->lock);
+}
 
-  release(&bcache.lock);
+// Write the dirty buffers of blocks [lo, hi) of dev to disk, in block
+// order, and wait for them. dev NODEV means every device.
+//
+// A batch only takes buffers that are free. bget's caller may hold a
+// buffer while it waits on another, so waiting on a buffer while holding
+// the batch could close a cycle. Buffers in use are written afterwards,
+// one at a time, with nothing else held.
+void bflush(uint dev, uint lo, uint hi) {
+  struct buf *b;
+  struct bucket *bk;
+  int i, j, k, n;
+
+  acquiresleep(&bcache.flushlock);
+  do {
+    // Take a reference to each dirty buffer in range. Holding bcache.lock
+    // keeps buffers from being recycled while we look.
+    n = 0;
+    acquire(&bcache.lock);
+    for (b = bcache.ring, i = 0; i < bcache.nbuf && n < NFLUSH; b = b->next, i++) {
+      if (!(b->flags & B_DIRTY) || (dev != NODEV && b->dev != dev) ||
+          b->blockno < lo || b->blockno >= hi)
+        continue;
+      bk = bhash(b->dev, b->blockno);
+      acquire(&bk->lock);
+      b->refcnt++;
+      release(&bk->lock);
+      bcache.batch[n++] = b;
+    }
+    release(&bcache.lock);
+
+    // Sort by block so the disk head sweeps once.
+    for (i = 1; i < n; i++) {
+      b = bcache.batch[i];
+      for (j = i; j > 0 && (bcache.batch[j - 1]->dev > b->dev ||
+                            (bcache.batch[j - 1]->dev == b->dev &&
+                             bcache.batch[j - 1]->blockno > b->blockno)); j--)
+        bcache.batch[j] = bcache.batch[j - 1];
+      bcache.batch[j] = b;
+    }
+
+    // Lock the free ones and hand those still dirty to the disk at
+    // once, so it can merge neighbours into one request.
+    for (i = 0, j = 0, k = 0; i < n; i++) {
+      b = bcache.batch[i];
+      if (!tryacquiresleep(&b->lock))
+        bcache.busy[k++] = b;
+      else if (b->flags & B_DIRTY)
+        bcache.batch[j++] = b;
+      else
+        brelse(b);
+    }
+    bwritebackv(bcache.batch, j);
+    for (i = 0; i < j; i++)
+      brelse(bcache.batch[i]);
+    for (i = 0; i < k; i++) {
+      b = bcache.busy[i];
+      acquiresleep(&b->lock);
+      if (b->flags & B_DIRTY)
+        bwriteback(b);
+      brelse(b);
+    }
+  } while (n == NFLUSH);
+  releasesleep(&bcache.flushlock);
+}
+
+// Write every dirty buffer to disk.
+void bsync(void) {
+  bflush(NODEV, 0, ~0U);
+}
+
+// Body of the flusher thread: write dirty buffers back every FLUSH_TICKS
+// ticks, or sooner when half the cache is dirty.
+void bflusher(void) {
+  uint last;
+
+  acquire(&tickslock);
+  for (;;) {
+    last = ticks;
+    while (ticks - last < FLUSH_TICKS && bcache.ndirty < bcache.nbuf / 2)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+    logsync();
+    if (bcache.ndirty > 0)
+      bsync();
+    acquire(&tickslock);
+  }
 }
@@ -126,6 +126,15 @@ static bool cpuid_has(uint32_t *feature, unsigned int bit) {
   return feature[bit / 32] & BIT32(bit % 32);
 }
 
+int cpuid_feature(unsigned int bit) {
+  uint32_t feature[CPUID_NR_FLAGS] = {0};
+
+  cpuid(1, NULL, NULL, &feature[CPUID_1_ECX], &feature[CPUID_1_EDX]);
+  cpuid(0x80000001, NULL, NULL, &feature[CPUID_80000001_ECX],
+        &feature[CPUID_80000001_EDX]);
+  return cpuid_has(feature, bit);
+}
+
 void cpuid_print(void) {
   uint32_t eax, brand[12], feature[CPUID_NR_FLAGS] = {0};
 
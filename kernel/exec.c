@@ -64,6 +64,7 @@ exec(char *path, char **argv)
   myproc()->tf->rsp = sp;
 
   vspaceinstall(myproc());
+  vspacemsync(&oldva, MMAP_BASE, MMAP_TOP - MMAP_BASE);
   vspacefree(&oldva);
   return 0;
 
@@ -89,6 +89,18 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Write the blocks of file f to disk.
+int
+filesync(struct file *f)
+{
+  if(f->type == FD_INODE){
+    logsync();
+    isync(f->ip);
+    return 0;
+  }
+  return -1;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
@@ -121,11 +133,31 @@ filewrite(struct file *f, char *addr, int n)
   if (f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    acquiresleep(&f->ip->lock);
-    if ((r = writei(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    releasesleep(&f->ip->lock);
-    return r;
+    // write a few blocks at a time to avoid exceeding
+    // the maximum log transaction size, including
+    // the inode, the inode file's own inode, and 2 blocks
+    // of slop for non-aligned writes.
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int i = 0;
+    while(i < n){
+      int n1 = n - i;
+      if(n1 > max)
+        n1 = max;
+
+      begin_op();
+      acquiresleep(&f->ip->lock);
+      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
+        f->off += r;
+      releasesleep(&f->ip->lock);
+      end_op();
+
+      if(r < 0)
+        break;
+      if(r != n1)
+        panic("short filewrite");
+      i += r;
+    }
+    return i == n ? n : -1;
   }
   panic("filewrite");
 }
@@ -34,6 +34,434 @@ void readsb(int dev, struct superblock *sb) {
   brelse(bp);
 }
 
+// Blocks.
+//
+// A file is a list of extents, runs of contiguous blocks, whose lengths
+// are whole pages so that each page of a file is contiguous on disk. The
+// first NEXTENT extents are in the inode and up to NOVERFLOW more in its
+// overflow block. Block numbers are relative to the container disk.
+//
+// The free bitmap is read once at boot, a 64-bit word at a time, into
+// an index of the free extents kept sorted both by start, to find the
+// blocks right after a file, and by length, to find the best fit.
+// Allocation takes from the index and marks the bitmap through the
+// log; the bitmap is only scanned again if the index had to forget
+// extents for lack of room and then runs dry.
+//
+// Block numbers are relative to the container disk, which is UDISKSIZE
+// blocks long, so blocks are handed out only below fmap.limit =
+// UDISKSIZE. A block beyond it would land on the next container's disk
+// and would not be copied by udiskcopy.
+
+#define NFREE 128               // free extents the index holds
+#define GROW_MAX (64 * PGBLOCKS) // most blocks a file grows by ahead of its writes
+#define NOBLOCK (~0U)
+
+static struct {
+  struct sleeplock lock;
+  uint limit;                   // blocks are allocated from [0, limit)
+  int n;                        // free extents in the index
+  int lossy;                    // free extents were forgotten
+  struct extent bystart[NFREE]; // by start
+  struct extent bysize[NFREE];  // by length, then start
+} fmap;
+
+// Position in fmap.bystart of the first extent starting at or after start.
+static int fmapstartpos(uint start) {
+  int lo = 0, hi = fmap.n, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (fmap.bystart[mid].startblkno < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Position in fmap.bysize of the first extent not shorter than nblocks
+// blocks, or as long and starting at or after start.
+static int fmapsizepos(uint nblocks, uint start) {
+  int lo = 0, hi = fmap.n, mid;
+  struct extent *e;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    e = &fmap.bysize[mid];
+    if (e->nblocks < nblocks || (e->nblocks == nblocks && e->startblkno < start))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void fmapdel(struct extent e) {
+  int i;
+
+  i = fmapstartpos(e.startblkno);
+  memmove(&fmap.bystart[i], &fmap.bystart[i + 1], (fmap.n - i - 1) * sizeof(e));
+  i = fmapsizepos(e.nblocks, e.startblkno);
+  memmove(&fmap.bysize[i], &fmap.bysize[i + 1], (fmap.n - i - 1) * sizeof(e));
+  fmap.n--;
+}
+
+static void fmapadd(struct extent e) {
+  int i;
+
+  if (e.nblocks == 0)
+    return;
+  if (fmap.n == NFREE) {
+    // forget the shortest; the bitmap still knows it is free
+    fmap.lossy = 1;
+    if (e.nblocks <= fmap.bysize[0].nblocks)
+      return;
+    fmapdel(fmap.bysize[0]);
+  }
+  i = fmapstartpos(e.startblkno);
+  memmove(&fmap.bystart[i + 1], &fmap.bystart[i], (fmap.n - i) * sizeof(e));
+  fmap.bystart[i] = e;
+  i = fmapsizepos(e.nblocks, e.startblkno);
+  memmove(&fmap.bysize[i + 1], &fmap.bysize[i], (fmap.n - i) * sizeof(e));
+  fmap.bysize[i] = e;
+  fmap.n++;
+}
+
+// Rebuild the index from the bitmap. Words with every block used or
+// every block free are taken whole.
+static void fmapscan(void) {
+  struct buf *bp = 0;
+  uint64_t w;
+  uint b, i, start = NOBLOCK;
+
+  fmap.n = 0;
+  fmap.lossy = 0;
+  for (b = 0; b < fmap.limit; b += 64) {
+    if (bp == 0 || bp->blockno != BBLOCK(b, sb)) {
+      if (bp)
+        brelse(bp);
+      bp = bread(ROOTDEV, BBLOCK(b, sb));
+    }
+    w = ((uint64_t *)bp->data)[(b % BPB) / 64];
+    if (w == 0 || w == ~0ULL) {
+      if (w == 0 && start == NOBLOCK)
+        start = b;
+      if (w != 0 && start != NOBLOCK) {
+        fmapadd((struct extent){start, b - start});
+        start = NOBLOCK;
+      }
+      continue;
+    }
+    for (i = 0; i < 64; i++) {
+      if (!(w >> i & 1) && start == NOBLOCK) {
+        start = b + i;
+      } else if ((w >> i & 1) && start != NOBLOCK) {
+        fmapadd((struct extent){start, b + i - start});
+        start = NOBLOCK;
+      }
+    }
+  }
+  if (bp)
+    brelse(bp);
+  if (start < fmap.limit)
+    fmapadd((struct extent){start, fmap.limit - start});
+}
+
+static void fmapinit(void) {
+  initsleeplock(&fmap.lock, "fmap");
+  if ((NDISK + 1) * UDISKSIZE > sb.logstart)
+    panic("fmapinit: user disks overlap the log");
+  fmap.limit = UDISKSIZE;
+  fmapscan();
+}
+
+// Mark blocks [start, start + n) used in the bitmap.
+static void bmark(uint start, uint n) {
+  struct buf *bp;
+  uint b = start;
+
+  while (b < start + n) {
+    bp = bread(ROOTDEV, BBLOCK(b, sb));
+    for (; b < start + n && BBLOCK(b, sb) == bp->blockno; b++)
+      bp->data[(b % BPB) / 8] |= 1 << (b % 8);
+    log_write(bp);
+    brelse(bp);
+  }
+}
+
+// Allocate whole pages: at least need blocks and up to want, starting
+// at block near if it is free, else from the shortest free extent that
+// holds want or at least need. If none holds need, return what the
+// longest one has. Returns an empty extent if the disk is full.
+static struct extent balloc(uint near, uint need, uint want) {
+  struct extent e, got = {0, 0};
+  int i, scanned = 0;
+
+  acquiresleep(&fmap.lock);
+  for (;;) {
+    i = fmapstartpos(near);
+    if (near && i < fmap.n && fmap.bystart[i].startblkno == near &&
+        fmap.bystart[i].nblocks >= need) {
+      e = fmap.bystart[i];
+    } else if ((i = fmapsizepos(want, 0)) < fmap.n || (i = fmapsizepos(need, 0)) < fmap.n) {
+      e = fmap.bysize[i];
+    } else if (fmap.n > 0) {
+      e = fmap.bysize[fmap.n - 1];
+    } else {
+      e.nblocks = 0;
+    }
+    got.nblocks = min(e.nblocks, want);
+    got.nblocks -= got.nblocks % PGBLOCKS;
+    if (got.nblocks > 0 || !fmap.lossy || scanned)
+      break;
+    fmapscan();
+    scanned = 1;
+  }
+  if (got.nblocks > 0) {
+    got.startblkno = e.startblkno;
+    fmapdel(e);
+    fmapadd((struct extent){e.startblkno + got.nblocks, e.nblocks - got.nblocks});
+    bmark(got.startblkno, got.nblocks);
+  }
+  releasesleep(&fmap.lock);
+  return got;
+}
+
+// Reads extent i of ip into *e. Returns 0 if ip has no extent i.
+static int iextent(struct inode *ip, uint i, struct extent *e) {
+  struct buf *bp;
+
+  if (i < NEXTENT) {
+    *e = ip->extents[i];
+    return e->nblocks != 0;
+  }
+  if (ip->overflow == 0 || i - NEXTENT >= NOVERFLOW)
+    return 0;
+  bp = bread(ip->dev, (myproc()->cid + 1) * UDISKSIZE + ip->overflow);
+  *e = ((struct extent *)bp->data)[i - NEXTENT];
+  brelse(bp);
+  return e->nblocks != 0;
+}
+
+// Sets extent i of ip, which has an overflow block if i needs one.
+static void isetextent(struct inode *ip, uint i, struct extent e) {
+  struct buf *bp;
+
+  if (i < NEXTENT) {
+    ip->extents[i] = e;
+    return;
+  }
+  bp = bread(ip->dev, (myproc()->cid + 1) * UDISKSIZE + ip->overflow);
+  ((struct extent *)bp->data)[i - NEXTENT] = e;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Returns the block holding block fbn of ip, and in *run, if run is not
+// 0, how many blocks of the file are contiguous on disk from there.
+// Returns 0 if ip has no block fbn.
+uint bmap(struct inode *ip, uint fbn, uint *run) {
+  struct extent e;
+
+  for (uint i = 0; iextent(ip, i, &e); i++) {
+    if (fbn < e.nblocks) {
+      if (run)
+        *run = e.nblocks - fbn;
+      return e.startblkno + fbn;
+    }
+    fbn -= e.nblocks;
+  }
+  return 0;
+}
+
+// Give ip at least nblocks blocks. The last extent grows in place where
+// the disk allows, and a file grows ahead of its writes by as many blocks
+// as it has, up to GROW_MAX, so that a file written a bit at a time
+// still ends up in few extents. Returns 0, or -1 if the disk or the
+// extent list is full. The caller is inside a transaction and writes
+// the inode to the inodefile afterwards.
+static int igrow(struct inode *ip, uint nblocks) {
+  struct extent e, last = {0, 0};
+  struct buf *bp;
+  uint i, have = 0, need;
+
+  for (i = 0; iextent(ip, i, &e); i++) {
+    have += e.nblocks;
+    last = e;
+  }
+  while (have < nblocks) {
+    if (i == NEXTENT + NOVERFLOW)
+      return -1;
+    if (i >= NEXTENT && ip->overflow == 0) {
+      if ((e = balloc(0, PGBLOCKS, PGBLOCKS)).nblocks == 0)
+        return -1;
+      ip->overflow = e.startblkno;
+      bp = bread(ip->dev, (myproc()->cid + 1) * UDISKSIZE + ip->overflow);
+      memset(bp->data, 0, BSIZE);
+      log_write(bp);
+      brelse(bp);
+    }
+    need = (nblocks - have + PGBLOCKS - 1) / PGBLOCKS * PGBLOCKS;
+    e = balloc(last.nblocks ? last.startblkno + last.nblocks : 0, need,
+               max(need, min(have, (uint) GROW_MAX)));
+    if (e.nblocks == 0)
+      return -1;
+    if (last.nblocks && e.startblkno == last.startblkno + last.nblocks) {
+      last.nblocks += e.nblocks;
+      isetextent(ip, i - 1, last);
+    } else {
+      last = e;
+      isetextent(ip, i++, last);
+    }
+    have += e.nblocks;
+  }
+  return 0;
+}
+
+// Name cache.
+//
+// Maps a name in a directory to its inum, so that a path looked up
+// before is found again without reading the directory. A name the
+// directory does not have is cached too, with inum 0. Entries are
+// keyed by container like the page cache, since each container has
+// its own disk, and the least recently used one is recycled.
+//
+// Names are only ever added to directories, by createInode, which
+// turns a cached miss into a hit. Writes to a container disk behind
+// the file system's back drop the container's entries (dcdrop).
+
+#define NDCACHE 512 // names cached
+#define NDCHASH 127 // hash chains
+
+struct dentry {
+  int valid;
+  int cid;
+  uint dev;
+  uint dir;              // inum of the directory
+  char name[DIRSIZ];
+  uint inum;             // 0 if dir has no such name
+  uint lastuse;          // for LRU replacement
+  struct dentry *hnext;  // hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  uint clock;
+  struct dentry entries[NDCACHE];
+  struct dentry *hash[NDCHASH];
+} dcache;
+
+int num_dcache_hits = 0;
+
+// FNV-1a hash of a name of up to DIRSIZ characters.
+static uint namehash(char *name) {
+  uint h = 2166136261U;
+
+  for (int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619U;
+  return h;
+}
+
+static uint dchash(int cid, uint dev, uint dir, char *name) {
+  return (namehash(name) + cid * 31 + dev * 17 + dir * 7) % NDCHASH;
+}
+
+// Returns the entry of name in dp, or 0. The dcache lock must be held.
+static struct dentry *dcfind(struct inode *dp, char *name) {
+  struct dentry *d;
+  int cid = myproc()->cid;
+
+  for (d = dcache.hash[dchash(cid, dp->dev, dp->inum, name)]; d; d = d->hnext)
+    if (d->cid == cid && d->dev == dp->dev && d->dir == dp->inum &&
+        strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  return 0;
+}
+
+static void dcunhash(struct dentry *d) {
+  struct dentry **pp;
+
+  for (pp = &dcache.hash[dchash(d->cid, d->dev, d->dir, d->name)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == d) {
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->hnext = 0;
+  d->valid = 0;
+}
+
+// Looks name up in the cache of dp. If it is cached, sets *inum to its
+// inum, or to 0 if dp has no such name, and returns 1; else returns 0.
+static int dclookup(struct inode *dp, char *name, uint *inum) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dcfind(dp, name)) != 0) {
+    d->lastuse = ++dcache.clock;
+    *inum = d->inum;
+    num_dcache_hits++;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Remembers that name in dp is inum, or missing if inum is 0.
+static void dcenter(struct inode *dp, char *name, uint inum) {
+  struct dentry *d, *victim;
+  int cid = myproc()->cid;
+  uint h = dchash(cid, dp->dev, dp->inum, name);
+
+  acquire(&dcache.lock);
+  if ((d = dcfind(dp, name)) == 0) {
+    victim = dcache.entries;
+    for (d = dcache.entries; d < &dcache.entries[NDCACHE]; d++) {
+      if (!d->valid) {
+        victim = d;
+        break;
+      }
+      if (d->lastuse < victim->lastuse)
+        victim = d;
+    }
+    d = victim;
+    if (d->valid)
+      dcunhash(d);
+    d->valid = 1;
+    d->cid = cid;
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->lastuse = ++dcache.clock;
+  release(&dcache.lock);
+}
+
+// Name was added to dp as inum. A cached miss becomes a hit; a cached
+// hit stays, since lookups find the first entry of a name.
+static void dcadd(struct inode *dp, char *name, uint inum) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if ((d = dcfind(dp, name)) != 0 && d->inum == 0)
+    d->inum = inum;
+  release(&dcache.lock);
+}
+
+// Forgets the names cached for container cid.
+void dcdrop(int cid) {
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for (d = dcache.entries; d < &dcache.entries[NDCACHE]; d++)
+    if (d->valid && d->cid == cid)
+      dcunhash(d);
+  release(&dcache.lock);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -83,24 +511,40 @@ static void init_inodefile(int dev) {
   icache.inodefile.type = di.type;
   icache.inodefile.devid = di.devid;
   icache.inodefile.size = di.size;
-  icache.inodefile.data = di.data;
+  icache.inodefile.overflow = di.overflow;
+  memmove(icache.inodefile.extents, di.extents, sizeof(di.extents));
+  icache.inodefile.dirindex = di.dirindex;
 
   brelse(b);
 }
 
 void iinit(int dev) {
+  struct buf *b;
   int i;
 
   initlock(&icache.lock, "icache");
+  initlock(&dcache.lock, "dcache");
   for (i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
   }
   initsleeplock(&icache.inodefile.lock, "inodefile");
 
   readsb(dev, &sb);
-
-  // Initialize first user disk
-  udiskinit(0);
+  if (sb.bsize != BSIZE)
+    panic("iinit: file system block size is not BSIZE");
+  initlog(dev);
+
+  // Initialize the first user disk on the first boot only, so that its
+  // files survive a reboot.
+  if (sb.cids[0] == -1) {
+    udiskinit(0);
+    bsync();
+    sb.cids[0] = 0;
+    b = bread(dev, 1);
+    memmove(b->data, &sb, sizeof(sb));
+    bwritesync(b);
+    brelse(b);
+  }
 
   cprintf("sb: size %d nblocks %d udiskstart %d bmap start %d inodestart %d freeblock %d\n", sb.size,
           sb.nblocks, sb.udiskstart, sb.bmapstart, sb.inodestart, sb.freeblock);
@@ -110,6 +554,7 @@ void iinit(int dev) {
   }
 
   init_inodefile(dev);
+  fmapinit();
 }
 
 static void read_dinode(uint inum, struct dinode *dip) {
@@ -145,6 +590,9 @@ static struct inode *iget(uint dev, uint inum) {
   ip->ref = 1;
   ip->dev = dev;
   ip->inum = inum;
+  ip->ra_next = 0;
+  ip->ra_window = 0;
+  ip->ra_end = 0;
 
   release(&icache.lock);
 
@@ -152,7 +600,9 @@ static struct inode *iget(uint dev, uint inum) {
   ip->type = dip.type;
   ip->devid = dip.devid;
   ip->size = dip.size;
-  ip->data = dip.data;
+  ip->overflow = dip.overflow;
+  memmove(ip->extents, dip.extents, sizeof(dip.extents));
+  ip->dirindex = dip.dirindex;
 
   if (ip->type == 0)
     panic("iget: no type");
@@ -183,6 +633,20 @@ void irelease(struct inode *ip) {
   release(&icache.lock);
 }
 
+// Appends an inode of the given type to the inodefile and returns its
+// inum. It gets blocks when it is first written. The caller is inside a
+// transaction and holds the inodefile lock.
+static uint ialloc(uint dev, short type) {
+  struct inode in;
+
+  memset(&in, 0, sizeof(in));
+  in.inum = icache.inodefile.size / sizeof(struct dinode);
+  in.dev = dev;
+  in.type = type;
+  updateInodeFile(&in);
+  return in.inum;
+}
+
 // Copy stat information from inode.
 void stati(struct inode *ip, struct stat *st) {
   st->dev = ip->dev;
@@ -191,11 +655,61 @@ void stati(struct inode *ip, struct stat *st) {
   st->size = ip->size;
 }
 
+// Write the data blocks of ip, its overflow block and the block of the
+// inodefile holding it to disk.
+void isync(struct inode *ip) {
+  uint base = (myproc()->cid + 1) * UDISKSIZE;
+  uint b = base + bmap(&icache.inodefile, INODEOFF(ip->inum) / BSIZE, 0);
+  struct extent e;
+
+  for (uint i = 0; iextent(ip, i, &e); i++)
+    bflush(ip->dev, base + e.startblkno, base + e.startblkno + e.nblocks);
+  if (ip->overflow)
+    bflush(ip->dev, base + ip->overflow, base + ip->overflow + 1);
+  bflush(ip->dev, b, b + 1);
+}
+
+// Read-ahead. A read that starts where the previous one ended is
+// sequential; the first one opens a window of RA_MIN blocks and each
+// sequential read after it doubles the window, up to RA_MAX. Once the
+// reader gets within half a window of what has been read ahead, the
+// next window past it is prefetched without waiting. Any other read
+// closes the window.
+#define RA_MIN 8
+#define RA_MAX 64
+
+static void readahead(struct inode *ip, uint off, uint n) {
+  uint base = (myproc()->cid + 1) * UDISKSIZE;
+  uint last = (off + n - 1) / BSIZE;
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  uint start, end, b, run;
+
+  if (off != ip->ra_next) {
+    ip->ra_next = off + n;
+    ip->ra_window = 0;
+    ip->ra_end = 0;
+    return;
+  }
+  ip->ra_next = off + n;
+  ip->ra_window = ip->ra_window ? min(ip->ra_window * 2, (uint) RA_MAX) : RA_MIN;
+
+  if (last + ip->ra_window / 2 < ip->ra_end)
+    return;
+  start = max(ip->ra_end, last + 1);
+  end = min(last + 1 + ip->ra_window, nblocks);
+  // no need to go to the disk for what the page cache holds
+  if (start < end && !pccached(ip, start * BSIZE / PGSIZE)) {
+    // one prefetch per extent the window covers
+    for (uint i = start; i < end && (b = bmap(ip, i, &run)) != 0; i += run) {
+      run = min(run, end - i);
+      bprefetch(ip->dev, base + b, run);
+    }
+  }
+  ip->ra_end = max(ip->ra_end, end);
+}
+
 // Read data from inode.
 int readi(struct inode *ip, char *dst, uint off, uint n) {
-  uint tot, m;
-  struct buf *bp;
-
   if (ip->type == T_DEV) {
     if (ip->devid < 0 || ip->devid >= NDEV || !devsw[ip->devid].read)
       return -1;
@@ -206,15 +720,10 @@ int readi(struct inode *ip, char *dst, uint off, uint n) {
     return -1;
   if (off + n > ip->size)
     n = ip->size - off;
+  if (n > 0)
+    readahead(ip, off, n);
 
-  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-    uint cid = myproc()->cid;
-    bp = bread(ip->dev, ip->data.startblkno + (cid + 1)*UDISKSIZE + off / BSIZE);
-    m = min(n - tot, BSIZE - off % BSIZE);
-    memmove(dst, bp->data + off % BSIZE, m);
-    brelse(bp);
-  }
-  return n;
+  return pcread(ip, dst, off, n);
 }
 
 // Write data to inode.
@@ -224,30 +733,16 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
       return -1;
     return devsw[ip->devid].write(ip, src, n);
   } else {
-    uint b, boff, bn, write, ioff = off;
-    uint cid = myproc()->cid;
-    write = 0;
-    while (n > 0) {
-      // Fetch each blook we need to modify
-      b = ip->data.startblkno + (cid + 1)*UDISKSIZE + off/BSIZE;
-      boff = off%BSIZE;
-      if (n < BSIZE-boff) {
-        bn = n;
-        n = 0;
-      } else {
-        bn = BSIZE-boff;
-        n -= bn;
-      }
-
-      // Read in the block
-      struct buf *tmp = bread(ROOTDEV, b);
-      memmove(tmp->data + boff, src+write, bn);
-      bwrite(tmp);
-      brelse(tmp);
+    uint write, ioff = off;
 
-      off += bn;
-      write += bn;
-    }
+    if (off + n < off)
+      return -1;
+    // blocks are allocated as the file grows, before the data is logged
+    if (off + n > ip->size && igrow(ip, (off + n + BSIZE - 1) / BSIZE) < 0)
+      return -1;
+    imagedrop(myproc()->cid, ip);
+    // through the page cache, so readers and shared mappings see it
+    write = pcwrite(ip, src, off, n);
 
     if (ioff + write > ip->size) {
       ip->size = ioff + write;
@@ -266,33 +761,146 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
 struct inode *rootlookup(char *name) {
-  return dirlookup(namei("/"), name, 0);
+  struct inode *dp = iget(ROOTDEV, ROOTINO), *ip;
+
+  ip = dirlookup(dp, name, 0);
+  irelease(dp);
+  return ip;
+}
+
+// Directory hash index; see struct dirhashhead.
+
+#define DIRHASH_STEP 2 // entries indexed each time one is added
+#define NOOFF (~0U)
+
+// Offsets in an index: the head of bucket b, and entry i of the block
+// at boff. A block starts with its next and n fields.
+#define DHHEAD(b) (sizeof(uint) * (1 + (b)))
+#define DHENT(boff, i) ((boff) + 2 * sizeof(uint) + (i) * sizeof(struct dirhashent))
+
+static char zeroes[BSIZE];
+
+// Looks name up in the hash index of dp. Returns the offset of the
+// first dirent of that name, or NOOFF, and sets *upto to the end of
+// the entries the index covers.
+static uint dirhashlookup(struct inode *dp, char *name, uint *upto) {
+  struct inode *ix = iget(dp->dev, dp->dirindex);
+  struct dirhashent ents[16];
+  struct dirent de;
+  uint h = namehash(name), boff, bh[2], i, j, n, off = NOOFF;
+
+  readi(ix, (char *)upto, 0, sizeof(*upto));
+  readi(ix, (char *)&boff, DHHEAD(h % NDIRHASH), sizeof(boff));
+  for (; boff; boff = bh[0]) {
+    readi(ix, (char *)bh, boff, sizeof(bh));
+    for (i = 0; i < bh[1]; i += n) {
+      n = min(bh[1] - i, (uint) NELEM(ents));
+      readi(ix, (char *)ents, DHENT(boff, i), n * sizeof(ents[0]));
+      for (j = 0; j < n; j++) {
+        if (ents[j].hash != h || ents[j].off >= off)
+          continue;
+        if (readi(dp, (char *)&de, ents[j].off, sizeof(de)) == sizeof(de) &&
+            de.inum != 0 && namecmp(name, de.name) == 0)
+          off = ents[j].off;
+      }
+    }
+  }
+  irelease(ix);
+  return off;
+}
+
+// Adds the dirent at off, named name, to the index ix. The bucket's
+// first block takes it, or a new first block if that one is full.
+static void dirhashadd(struct inode *ix, char *name, uint off) {
+  struct dirhashent e = {namehash(name), off};
+  uint b = e.hash % NDIRHASH, boff, bh[2] = {0, 0}; // next, n
+
+  readi(ix, (char *)&boff, DHHEAD(b), sizeof(boff));
+  if (boff)
+    readi(ix, (char *)bh, boff, sizeof(bh));
+  if (boff == 0 || bh[1] == NDIRHASHENT) {
+    bh[0] = boff;
+    bh[1] = 0;
+    boff = ix->size;
+    writei(ix, zeroes, boff, BSIZE);
+    writei(ix, (char *)&boff, DHHEAD(b), sizeof(boff));
+  }
+  writei(ix, (char *)&e, DHENT(boff, bh[1]), sizeof(e));
+  bh[1]++;
+  writei(ix, (char *)bh, boff, sizeof(bh));
+}
+
+// Indexes up to DIRHASH_STEP more entries of dp, after giving dp an
+// index if it has grown large. Indexing a few at a time keeps each
+// transaction small. The caller is inside a transaction and holds the
+// inodefile lock.
+static void dirindex(struct inode *dp) {
+  struct inode *ix;
+  struct dirent de;
+  uint upto, n = 0;
+
+  if (dp->dirindex == 0) {
+    if (dp->size < DIRHASH_MIN * sizeof(de))
+      return;
+    dp->dirindex = ialloc(dp->dev, T_FILE);
+    ix = iget(dp->dev, dp->dirindex);
+    writei(ix, zeroes, 0, BSIZE);
+    irelease(ix);
+    updateInodeFile(dp);
+    return;
+  }
+
+  ix = iget(dp->dev, dp->dirindex);
+  readi(ix, (char *)&upto, 0, sizeof(upto));
+  for (; n < DIRHASH_STEP && upto < dp->size; upto += sizeof(de)) {
+    if (readi(dp, (char *)&de, upto, sizeof(de)) != sizeof(de))
+      panic("dirindex read");
+    if (de.inum == 0)
+      continue;
+    dirhashadd(ix, de.name, upto);
+    n++;
+  }
+  writei(ix, (char *)&upto, 0, sizeof(upto));
+  irelease(ix);
 }
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Names looked up before come from the name cache without reading dp.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
-  uint off, inum;
+  uint off, inum, start = 0;
   struct dirent de;
 
   if (dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for (off = 0; off < dp->size; off += sizeof(de)) {
-    if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if (de.inum == 0)
-      continue;
-    if (namecmp(name, de.name) == 0) {
-      // entry matches path element
-      if (poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if (poff == 0 && dclookup(dp, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  // createInode holds the lock while it adds a name, so the result
+  // cached below cannot miss a name added meanwhile
+  acquiresleep(&icache.inodefile.lock);
+  // the index, then the entries added since it was brought up to date
+  if (dp->dirindex == 0 || (off = dirhashlookup(dp, name, &start)) == NOOFF) {
+    for (off = start; off < dp->size; off += sizeof(de)) {
+      if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if (de.inum != 0 && namecmp(name, de.name) == 0)
+        break;
     }
   }
-
-  return 0;
+  if (off >= dp->size) {
+    dcenter(dp, name, 0);
+    releasesleep(&icache.inodefile.lock);
+    return 0;
+  }
+  if (readi(dp, (char *)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirlink read");
+  dcenter(dp, name, de.inum);
+  releasesleep(&icache.inodefile.lock);
+  if (poff)
+    *poff = off;
+  return iget(dp->dev, de.inum);
 }
 
 // Paths
@@ -339,10 +947,8 @@ static char *skipelem(char *path, char *name) {
 static struct inode *namex(char *path, int nameiparent, char *name) {
   struct inode *ip, *next;
 
-  if (*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(namei("/"));
+  // there is no current directory; relative paths start at the root too
+  ip = iget(ROOTDEV, ROOTINO);
 
   while ((path = skipelem(path, name)) != 0) {
     if (ip->type != T_DIR)
@@ -380,10 +986,15 @@ struct inode *nameiparent(char *path, char *name) {
 
 // Initialize a new user disk for container cid
 void udiskinit(int cid) {
+  imagedrop(cid, 0);
+  dcdrop(cid);
+  pcdrop((cid + 1)*UDISKSIZE, UDISKSIZE);
   for (int i = 0; i < UDISKSIZE; i++) {
+    if (i % RA_MAX == 0)
+      bprefetch(ROOTDEV, i, min(RA_MAX, UDISKSIZE - i));
     struct buf *b_kernel = bread(ROOTDEV, i);
     struct buf *b_guest = bread(ROOTDEV, (cid + 1)*UDISKSIZE + i);
-    memmove(&b_guest->data, &b_kernel->data, BSIZE);
+    memmove(b_guest->data, b_kernel->data, BSIZE);
     bwrite(b_guest);
     brelse(b_kernel);
     brelse(b_guest);
@@ -392,152 +1003,59 @@ void udiskinit(int cid) {
 
 // Copy a new user disk from cid_src = cid_dest
 void udiskcopy(int cid_src, int cid_dest) {
+  imagedrop(cid_dest, 0);
+  dcdrop(cid_dest);
+  pcdrop((cid_dest + 1)*UDISKSIZE, UDISKSIZE);
   for (int i = 0; i < UDISKSIZE; i++) {
+    if (i % RA_MAX == 0)
+      bprefetch(ROOTDEV, (cid_src + 1)*UDISKSIZE + i, min(RA_MAX, UDISKSIZE - i));
     struct buf *b_src = bread(ROOTDEV, (cid_src + 1)*UDISKSIZE + i);
     struct buf *b_dest = bread(ROOTDEV, (cid_dest + 1)*UDISKSIZE + i);
-    memmove(&b_dest->data, &b_src->data, BSIZE);
+    memmove(b_dest->data, b_src->data, BSIZE);
     bwrite(b_dest);
     brelse(b_src);
     brelse(b_dest);
   }
 }
 
-/* This function finds n contiguous blocks in extent region at
- * or after block #b and sets the bitmap for returned blocks to 1.
- *
- * @param b is the index of block to start searching at
- * @param n is the number of contiguous blocks we need
- *
- * @return index of starting block on success,
- *         and 0 on error
- */
-uint
-findBlocks(uint b, uint n) {
-  struct buf *cur;
-  uint i, j;
-  bool found = false;
-  // Loop through each block in bitmap
-  while (!found) {
-    i = BBLOCK(b, sb);
-    cur = bread(ROOTDEV, i);
-    if (b%BPB + n < BPB) {
-      // Case 1: bit for n blocks starting at b are in i
-      for (j = 0; j < n; j++) {
-        // Get byte containing info for block b+j
-        uchar byte = cur->data[((b+j)%BPB)/8];
-        // Check if b+j bit is on
-        byte = byte << (((b+j)%BPB)%8);
-        if (byte) {
-          // Block b+j used, continue searching at b+j+1
-          b = b+j+1;
-          j = n+1;
-        } else {
-          // Turn on the bit
-          cur->data[((b+j)%BPB)/8] |= 1 << (7-(((b+j)%BPB)%8));
-        }
-      }
-      if (j <= n) {
-        found = true;
-        bwrite(cur);
-      }
-      brelse(cur);
-    } else {
-      // Case 2: bit for n blocks starting at b are in i and i+1
-      // Check for fitst b%BPB + n - BPB bits
-      uint bits = BPB-(b%BPB);
-      for (j = 0; j < bits; j++) {
-        // Get byte containing info for block b+j
-        uchar byte = cur->data[((b+j)%BPB)/8];
-        // Check if b+j bit is on
-        byte = byte << (((b+j)%BPB)%8);
-        if (byte) {
-          // Block b+j used, continue searching at b+j+1
-          b = b+j+1;
-          j = bits+1;
-        } else {
-          // Turn on the bit
-          cur->data[((b+j)%BPB)/8] |= 1 << (7-(((b+j)%BPB)%8));
-        }
-      }
-
-      if (j > bits) {
-        brelse(cur);
-        continue;
-      }
-      // Check for remaining
-      bits = b%BPB + n - BPB;
-      struct buf *cur1 = bread(ROOTDEV, i+1);
-      for (j = 0; j < bits; j++) {
-        // Get byte containing info for block b+j
-        uchar byte = cur1->data[((b+j)%BPB)/8];
-        // Check if b+j bit is on
-        byte = byte << (((b+j)%BPB)%8);
-        if (byte) {
-          // Block b+j used, continue searching at b+j+1
-          b = b+n-bits+j;
-          j = bits+1;
-        } else {
-          // Turn on the bit
-          cur->data[((b+j)%BPB)/8] |= 1 << (7-(((b+j)%BPB)%8));
-        }
-      }
-
-      if (j <= bits) {
-        found = true;
-        bwrite(cur);
-        bwrite(cur1);
-      }
-      brelse(cur);
-      brelse(cur1);
-    }
-  }
-
-  return b;
-}
-
 // Rewrites the given inode to the inodefile to update it.
 void
 updateInodeFile(struct inode *ip)
 {
   struct dinode di;
 
+  memset(&di, 0, sizeof(di));
   di.type = ip->type;
+  di.devid = ip->devid;
   di.size = ip->size;
-  di.data = ip->data;
+  di.overflow = ip->overflow;
+  memmove(di.extents, ip->extents, sizeof(di.extents));
+  di.dirindex = ip->dirindex;
 
   writei(&icache.inodefile, (char*)&di, INODEOFF(ip->inum), sizeof(di));
 }
 
-// Rewrites the given inode to the inodefile to update it.
+// Appends de to the root directory and its index.
 void
 updateRootdir(struct dirent de)
 {
   struct inode *rootdir = iget(ROOTDEV, ROOTINO);
   writei(rootdir, (char*)&de, rootdir->size, sizeof(de));
+  dirindex(rootdir);
+  dcadd(rootdir, de.name, de.inum);
   irelease(rootdir);
 }
 
 void
 createInode(char *name) {
-  acquiresleep(&icache.inodefile.lock);
-
-  struct inode in;
   struct dirent de;
-  // Get inum of new inode
-  in.inum = icache.inodefile.size/sizeof(struct dinode);
 
-  // Set up new inode
-  in.dev = ROOTDEV;
-  in.type = T_FILE;
-  in.size = 0;
-  in.data.startblkno = findBlocks(sb.inodestart, 20);
-  in.data.nblocks = 20;
+  acquiresleep(&icache.inodefile.lock);
 
-  // Update inodefile
-  updateInodeFile(&in);
+  // the new inode gets blocks when it is first written
+  de.inum = ialloc(ROOTDEV, T_FILE);
 
   // Add dirent to root directory
-  de.inum = in.inum;
   memmove(de.name, name, DIRSIZ);
   updateRootdir(de);
 
@@ -7,9 +7,27 @@
 #include <trap.h>
 #include <memlayout.h>
 #include <x86_64vm.h>
+#include <fs.h>
+#include <buf.h>
+#include <pvblk.h>
 
 extern int nextcid;
 
+int num_hypercalls = 0;
+
+// balloon accounting, see sysinfo.h
+int guest_pages = 0;
+int balloon_inflated = 0;
+int balloon_deflated = 0;
+int num_mem_pressure = 0;
+
+// 1 once guests were asked for memory, until free_pages recovers above
+// BALLOON_HIGH_WATERMARK
+static int balloon_notified = 0;
+
+// number of guest oses with an armed virtual timer
+static int guest_timers = 0;
+
 // for initproc to startup guest os
 int
 sys_fork_guest(void)
@@ -20,7 +38,66 @@ sys_fork_guest(void)
   return fork_guest(num_pages);
 }
 
+// Picks the guest os that serves hypercall sys_num from p. Apps are served
+// by the guest that owns them. Requests for new apps go to the least loaded
+// registered guest so that app load is sharded across all guests.
+// The ptable lock must be held.
+static struct proc *
+routeguest(struct proc *p, int sys_num)
+{
+  struct proc *g, *best;
+  struct proc *proc_arr;
+
+  if (sys_num != MESSAGE_INIT_APP && sys_num != MESSAGE_INIT_APP_COLD)
+    return p->guest;
+
+  best = 0;
+  proc_arr = get_proc_arr();
+  for (g = proc_arr; g < &proc_arr[NPROC]; g++) {
+    if (!g->is_guest_os || g->killed)
+      continue;
+    if (g->state != RUNNABLE && g->state != RUNNING && g->state != SLEEPING)
+      continue;
+    if (best == 0 || g->napps + g->nqueued < best->napps + best->nqueued)
+      best = g;
+  }
+  return best;
+}
+
+// Queues message for the guest os that serves it and blocks the current
+// process until the guest answers with gresume. Returns the value the guest
+// replied with, or -1 if there is no guest or we were killed meanwhile.
+// Takes ownership of message.
+static int
+sendguest(struct syscall_message *message)
+{
+  struct proc *guest;
+  int ret;
+
+  // WORKFLOW: queue the message for the guest OS, wake it up and put the
+  // guest user process to sleep until the guest answers with gresume. The
+  // guest keeps serving other apps in the meantime.
+  lock_ptable();
+  if ((guest = routeguest(myproc(), message->syscall_index)) == 0) {
+    unlock_ptable();
+    kfree((char *) message);
+    return -1;
+  }
+  num_hypercalls++;
+  insert_syscall(message, guest);
+  myproc()->awaiting_guest = guest;
+  wakeup1(guest);
+  while (myproc()->awaiting_guest && !myproc()->killed)
+    sleep_process2(&myproc()->awaiting_guest);
+  myproc()->awaiting_guest = 0;
+  ret = myproc()->killed ? -1 : myproc()->reply_value;
+  unlock_ptable();
+  return ret;
+}
+
 // sys_guestcall forwards syscall to guest_os process
+// Blocks the calling app until the guest os answers with gresume and returns
+// the value the guest replied with.
 int 
 sys_app_syscall(void)
 {
@@ -39,7 +116,11 @@ sys_app_syscall(void)
   if(argptr(1, (void*)&args, sizeof(struct arg)*MAX_ARGS) < 0)
     return -1;
 
-  new_message = (struct syscall_message *) kalloc();
+  if (args[0].arg_val.i < 0 || args[0].arg_val.i > MAX_ARGS)
+    return -1;
+
+  if ((new_message = (struct syscall_message *) kalloc()) == 0)
+    return -1;
 
   new_message->pid = myproc()->pid;
   new_message->syscall_index = sys_num;
@@ -50,39 +131,269 @@ sys_app_syscall(void)
     (new_message->args)[i].arg_type = args[i+1].arg_type;
     (new_message->args)[i].arg_val = args[i+1].arg_val;
   }
- 
-  insert_syscall(new_message, GUEST_PID);
 
-  // WORKFLOW: switch to guest OS from guest user process, put guest user
-  // process to sleep, guest os calls write, then wake up guest user process
-  // when that finishes
-  lock_ptable();
-  wakeup1(findproc(GUEST_PID));
-  sleep_process2(myproc());
-  unlock_ptable();
-  return 0;
+  return sendguest(new_message);
 }
 
 // Inserts the given syscall message (created by a guest user syscall) into the
-// syscall message buffer of the guest os with the given guest id (pid).
+// syscall message buffer of the given guest os. The ptable lock must be held.
 void
-insert_syscall(struct syscall_message* new_message, int gid) 
+insert_syscall(struct syscall_message* new_message, struct proc *guest) 
 {
+  struct syscall_message **pp;
+
   new_message->next_message = NULL;
 
-  // insert new syscall message at end of parent syscall buffer
-  struct syscall_message *parent_syscall_buffer = findproc(gid)->syscall_buffer;
-  if (parent_syscall_buffer == NULL) {
-    // no messages in buffer; add at front
-    findproc(gid)->syscall_buffer = new_message;
-  } else {
-    // stop at end of buffer and add new message
-    while (parent_syscall_buffer != NULL && 
-           parent_syscall_buffer->next_message != NULL) {
-      parent_syscall_buffer = parent_syscall_buffer->next_message;
+  // insert new syscall message at end of guest syscall buffer
+  for (pp = &guest->syscall_buffer; *pp; pp = &(*pp)->next_message)
+    ;
+  *pp = new_message;
+  guest->nqueued++;
+}
+
+// Frames leased to a guest os are tracked in their core_map entries: the
+// guest's pid, how many apps map the frame, and links on the guest's lease
+// list. Finding the lease of a frame costs the same however much memory
+// the machine has, and walking a guest's frames costs one step per frame.
+
+// Returns the core_map entry of frame ppn if it is leased to guest g, else 0.
+static struct core_map_entry *
+leased(struct proc *g, uint64_t ppn)
+{
+  struct core_map_entry *r;
+
+  if (ppn >= npages)
+    return 0;
+  r = &core_map[ppn];
+  return r->lessee == g->pid ? r : 0;
+}
+
+// Leases one more frame to guest g, idle in its pool. Returns -1 if there
+// is no free memory.
+int
+leaseframe(struct proc *g)
+{
+  char *mem;
+  uint ppn;
+
+  if ((mem = kalloc()) == 0)
+    return -1;
+  ppn = PGNUM(V2P(mem));
+  core_map[ppn].lessee = g->pid;
+  core_map[ppn].maps = 1;
+  core_map[ppn].prev = 0;
+  core_map[ppn].next = g->leases;
+  if (g->leases)
+    core_map[g->leases - 1].prev = ppn + 1;
+  g->leases = ppn + 1;
+  g->nleases++;
+  guest_pages++;
+  return 0;
+}
+
+// Takes frame r off g's lease list. What becomes of the frame is up to the
+// caller.
+static void
+unlease(struct proc *g, struct core_map_entry *r)
+{
+  if (r->prev)
+    core_map[r->prev - 1].next = r->next;
+  else
+    g->leases = r->next;
+  if (r->next)
+    core_map[r->next - 1].prev = r->prev;
+  r->lessee = 0;
+  r->maps = 0;
+  r->next = r->prev = 0;
+  g->nleases--;
+  guest_pages--;
+}
+
+// Returns the calling guest os's record of the app with the given pid and
+// stores the app's proc in *app, or returns 0 if the guest does not own a
+// live app with that pid. Records are indexed by process table slot since
+// pids grow without bound.
+static struct app_va_segment *
+ownedapp(int pid, struct proc **app)
+{
+  struct proc *p;
+  struct app_va_segment *seg;
+
+  if (pid <= 0 || (p = findproc(pid)) == 0)
+    return 0;
+  seg = &myproc()->app_processes[procslot(p)];
+  if (seg->owned != 1 || seg->pid != pid)
+    return 0;
+  if (app)
+    *app = p;
+  return seg;
+}
+
+// Drops one app mapping of the guest-leased frame ppn at va. Once no app
+// maps the frame it is back in the guest's pool and the guest's mirror
+// mapping of it goes away.
+static void
+unmapframe(struct proc *guest, uint64_t va, uint64_t ppn)
+{
+  pte_t *pte_guest;
+
+  if (--leased(guest, ppn)->maps != 1)
+    return;
+  pte_guest = walkpml4(guest->vspace.pgtbl, (void *) va, 0);
+  if (pte_guest && PTE_ADDR(*pte_guest) == ppn << PT_SHIFT)
+    *pte_guest = 0;
+}
+
+// Hands every guest-leased frame mapped into the app back to the guest's
+// pool and clears the guest's mirror mapping, so that freeing the app's
+// address space does not kfree memory the guest still owns.
+static void
+releaseframes(struct proc *guest, struct app_va_segment *seg, struct proc *app)
+{
+  pte_t *pte_app;
+  uint64_t va, ppn;
+  struct core_map_entry *r;
+
+  for (va = seg->base; va < seg->bound; va += PGSIZE) {
+    pte_app = walkpml4(app->vspace.pgtbl, (void *) va, 0);
+    if (pte_app == 0 || PTE_ADDR(*pte_app) == 0)
+      continue;
+    ppn = PTE_ADDR(*pte_app) >> PT_SHIFT;
+    if ((r = leased(guest, ppn)) == 0 || r->maps < 2)
+      continue;
+
+    *pte_app = 0;
+    unmapframe(guest, va, ppn);
+  }
+}
+
+// Tears down an app that was never started (still EMBRYO) after a failed
+// gload_program or gdeploy_program. The requester learns about the failure
+// through the guest's reply.
+static void
+abortapp(struct app_va_segment *seg, struct proc *app)
+{
+  // Close all open files.
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(app->ofile[fd]){
+      fileclose(app->ofile[fd]);
+      app->ofile[fd] = 0;
     }
-    parent_syscall_buffer->next_message = new_message;
   }
+
+  releaseframes(myproc(), seg, app);
+  seg->owned = 0;
+  myproc()->napps--;
+  kfree((char *) app->kstack);
+  app->kstack = 0;
+  vspacefree(&app->vspace);
+
+  lock_ptable();
+  app->parent = 0;
+  app->pid = 0;
+  app->state = UNUSED;
+  unlock_ptable();
+}
+
+// Called from exit() when a guest app dies. Returns the app's guest-leased
+// frames to the guest and queues a MESSAGE_DESTROY_APP so the guest can
+// retire the app from its tables.
+void
+guest_app_exit(struct proc *app)
+{
+  struct proc *guest;
+  struct app_va_segment *seg;
+  struct syscall_message *message;
+
+  if ((guest = app->guest) == 0)
+    return;
+  seg = &guest->app_processes[procslot(app)];
+  if (seg->owned != 1 || seg->pid != app->pid)
+    return;
+
+  releaseframes(guest, seg, app);
+  seg->owned = 0;
+  guest->napps--;
+
+  if ((message = (struct syscall_message *) kalloc()) == 0)
+    return;
+  message->pid = app->pid;
+  message->syscall_index = MESSAGE_DESTROY_APP;
+  message->num_args = 0;
+
+  lock_ptable();
+  insert_syscall(message, guest);
+  wakeup1(guest);
+  unlock_ptable();
+}
+
+// Called from exit() when a guest os dies. Apps it owned lose their guest
+// (their hypercalls fail from now on), processes blocked on it get -1, and
+// the frames it was leased but had not mapped into apps go back to the
+// kernel. Frames still mapped into apps are freed when those apps exit.
+void
+guest_exit(struct proc *guest)
+{
+  struct proc *p;
+  struct proc *proc_arr;
+  struct syscall_message *m;
+  struct app_va_segment *seg;
+  struct core_map_entry *r;
+  pte_t *pte;
+  uint64_t va, pa;
+  int maps;
+
+  lock_ptable();
+  proc_arr = get_proc_arr();
+  for (p = proc_arr; p < &proc_arr[NPROC]; p++) {
+    if (p->guest == guest)
+      p->guest = 0;
+    if (p->awaiting_guest == guest) {
+      p->reply_value = -1;
+      p->awaiting_guest = 0;
+      wakeup1(&p->awaiting_guest);
+    }
+  }
+  m = guest->syscall_buffer;
+  guest->syscall_buffer = 0;
+  guest->nqueued = 0;
+  if (guest->timer_deadline) {
+    guest->timer_deadline = 0;
+    guest_timers--;
+  }
+  unlock_ptable();
+
+  while (m) {
+    struct syscall_message *next = m->next_message;
+    kfree((char *) m);
+    m = next;
+  }
+
+  // drop the mirror mappings so freeing our address space does not free
+  // frames that apps still use
+  for (seg = guest->app_processes; seg < &guest->app_processes[NPROC]; seg++) {
+    if (seg->owned != 1)
+      continue;
+    for (va = seg->base; va < seg->bound; va += PGSIZE)
+      if ((pte = walkpml4(guest->vspace.pgtbl, (void *) va, 0)) != 0)
+        *pte = 0;
+    seg->owned = 0;
+  }
+  guest->napps = 0;
+
+  // frames mapped into apps are freed as those apps exit; a frame shared by
+  // k apps after gfork_app needs k kernel references for that
+  while (guest->leases) {
+    pa = (uint64_t) (guest->leases - 1) << PT_SHIFT;
+    r = &core_map[guest->leases - 1];
+    maps = r->maps;
+    unlease(guest, r);
+    if (maps == 1)
+      kfree(P2V(pa));
+    for (maps -= 2; maps > 0; maps--)
+      kincref(pa);
+  }
+  guest->is_guest_os = 0;
 }
 
 // Priveleged system calls (for a guest OS)
@@ -100,58 +411,97 @@ int
 sys_gnext_syscall(void)
 {
   struct syscall_message *s;
+  struct syscall_message *curr_s;
+
   if (argptr(0, (void *) &s, sizeof(struct syscall_message)) < 0) {
     // pointer failed to load
     return -1;
   }
 
-  struct syscall_message* curr_s = myproc()->syscall_buffer;
-  while (myproc()->syscall_buffer == NULL) {
+  // check the buffer under the ptable lock so a message queued by
+  // sys_app_syscall can't slip in between the check and the sleep
+  lock_ptable();
+  while ((curr_s = myproc()->syscall_buffer) == NULL) {
+    if (myproc()->killed) {
+      unlock_ptable();
+      return -1;
+    }
     // buffer was empty; put guest to sleep for now
-    sleep_process(myproc());
-    curr_s = myproc()->syscall_buffer;
+    sleep_process2(myproc());
   }
-  *s = *curr_s;
 
   // update buffer to next item and free syscall
   myproc()->syscall_buffer = curr_s->next_message;
+  myproc()->nqueued--;
+  if (curr_s->syscall_index == MESSAGE_TIMER && curr_s->pid == 0)
+    myproc()->timer_pending = 0;
+  unlock_ptable();
+
+  *s = *curr_s;
   kfree((char *) curr_s);
   return 0;
 }
 
-// Wakes up the guest user process with the given pid.
-// do not wakeup shell, only app user processes!
+// Answers a message from the process with the given pid. If the process is a
+// newly deployed app (still EMBRYO) it is started; otherwise the process must
+// be blocked in app_syscall and value becomes its return value. The guest OS
+// keeps running so it can serve other apps.
 int
 sys_gresume(void)
 {
   int pid;
-  if (argint(0, &pid) < 0)
+  int value;
+  int ret = -1;
+  struct proc *p;
+
+  if (argint(0, &pid) < 0 || argint(1, &value) < 0)
     return -1;
+  if (pid <= 0)
+    return -1;
+
   lock_ptable();
-  findproc(pid)->state = RUNNABLE;
-  sleep_process2(myproc());
+  if ((p = findproc(pid)) == 0) {
+    unlock_ptable();
+    return -1;
+  }
+  if (p->state == EMBRYO && ownedapp(pid, 0)) {
+    p->state = RUNNABLE;
+    ret = 0;
+  } else if (p->awaiting_guest == myproc()) {
+    p->reply_value = value;
+    p->awaiting_guest = 0;
+    wakeup1(&p->awaiting_guest);
+    ret = 0;
+  }
   unlock_ptable();
-  return 0;
+  return ret;
 }
 
-// Copies the user's physical memory "bitmap" from the proc struct
-// to the given array. To avoid messy bit shifting, we are using a
-// full uint8_t byte for each boolean value in the bitmap.
+// Copies up to n of the frames leased to the calling guest os to the given
+// array, each with how many apps map it. Returns the number of frames
+// leased, which is more than n if they did not all fit.
 int
 sys_gquery_user_pages(void)
 {
-  uint8_t *page_map;
-  if(argptr(0, (void *) &page_map, sizeof(uint8_t) * MAX_PHYS_PAGES) < 0)
+  struct guest_frame *frames;
+  struct core_map_entry *r;
+  uint lease;
+  int n, i;
+
+  if (!myproc()->is_guest_os)
     return -1;
-  int num_free_pages = 0;
-  for (int i = 0; i < MAX_PHYS_PAGES; i++) {
-    uint8_t owned = myproc()->user_pages[i];
-    if (owned == 1) {
-      num_free_pages++;
-    }
-    page_map[i] = owned;
+  if (argint(1, &n) < 0 || n < 0)
+    return -1;
+  n = min(n, myproc()->nleases);
+  if (n > 0 && argptr(0, (void *) &frames, sizeof(struct guest_frame) * n) < 0)
+    return -1;
+
+  for (i = 0, lease = myproc()->leases; i < n && lease; i++, lease = r->next) {
+    r = &core_map[lease - 1];
+    frames[i].ppn = lease - 1;
+    frames[i].maps = r->maps;
   }
-  return num_free_pages;
+  return myproc()->nleases;
 }
 
 int
@@ -159,14 +509,13 @@ sys_gload_program(void)
 {
   int pid;
   char *path;
+  struct proc *new_proc;
+  struct app_va_segment *seg;
 
-  if(argint(0, &pid) < 0)
-    goto bad;
-  if (myproc()->app_processes[pid].owned != 1)
-    goto bad;
+  if(argint(0, &pid) < 0 || (seg = ownedapp(pid, &new_proc)) == 0)
+    return -1;
   if(argstr(1, &path) < 0)
     goto bad;
-  struct proc *new_proc = findproc(pid);
 
   // save heap and base since vspaceloadcode has side effect of setting if after code
   uint64_t heap_base = new_proc->vspace.regions[VR_HEAP].va_base;
@@ -186,36 +535,54 @@ sys_gload_program(void)
   return 0;
 
   bad:
-        // Close all open files.
-    for(int fd = 0; fd < NOFILE; fd++){
-      if(new_proc->ofile[fd]){
-        fileclose(new_proc->ofile[fd]);
-        new_proc->ofile[fd] = 0;
-      }
-    }
-    new_proc->parent = 0;
+    abortapp(seg, new_proc);
+    return -1;
+}
 
-    kfree((char *) new_proc->kstack);
-    kfree((char *) new_proc->vspace.pgtbl);
+// Hands an app that has not been started yet, such as a zygote shell the
+// guest os built ahead of time, to parent_pid: the parent waits on it and
+// its open files are replaced by the parent's. 0 on success, -1 on failure.
+int
+sys_gbind_app(void)
+{
+  int pid, parent_pid;
+  struct proc *app, *parent;
+  struct file *old[NOFILE];
 
-    lock_ptable();
-    // Parent might be sleeping in wait().
-    wakeup1(findproc(SHELL_PID));
-    new_proc->state = UNUSED;
-    unlock_ptable();
+  if (argint(0, &pid) < 0 || ownedapp(pid, &app) == 0 || app->state != EMBRYO)
+    return -1;
+  if (argint(1, &parent_pid) < 0 || parent_pid <= 0 || (parent = findproc(parent_pid)) == 0)
     return -1;
+
+  for (int i = 0; i < NOFILE; i++) {
+    old[i] = app->ofile[i];
+    app->ofile[i] = parent->ofile[i] ? filedup(parent->ofile[i]) : 0;
+  }
+  for (int i = 0; i < NOFILE; i++)
+    if (old[i])
+      fileclose(old[i]);
+
+  lock_ptable();
+  app->parent = parent;
+  unlock_ptable();
+  return 0;
 }
 
 // allocates a proc, sets base, midpoint, and bound for va boundaries
 // va of guest os and app process mapped the same
 // start of stack and heap are set to midpoint
+// the app becomes a child of parent_pid, which waits on it to exit
 // returns pid, -1 on failure
 int
 sys_grequest_proc(void)
 {
   // get app_va_segment to store guest os copy of base, midpoint, bound
-  struct app_va_segment* proc_map;
-  if(argptr(0, (void *) &proc_map, sizeof(struct app_va_segment) * MAX_PROC) < 0) {
+  struct app_va_segment* app_seg;
+  struct app_va_segment* seg;
+  struct proc *parent;
+  int parent_pid;
+
+  if(argptr(0, (void *) &app_seg, sizeof(struct app_va_segment)) < 0) {
     return -1;
   }
 
@@ -225,49 +592,48 @@ sys_grequest_proc(void)
   uint64_t bound = fetcharg(3);
   
   // check boundaries
-  if (bound > KERNBASE || base >= midpoint || midpoint >= bound) {
+  if (bound > USERTOP || base >= midpoint || midpoint >= bound) {
     return -1;
   }
 
+  if (!myproc()->is_guest_os)
+    return -1;
+
+  if (argint(4, &parent_pid) < 0 || parent_pid <= 0 || (parent = findproc(parent_pid)) == 0)
+    return -1;
+
   // allocate space for a new proc
   struct proc *new_proc = allocproc(nextcid++);
+  if (new_proc == 0)
+    return -1;
 
-  // set parent as shell since shell waits on children to exit
-  new_proc->parent = findproc(SHELL_PID);
+  // the requesting process waits on its apps to exit
+  new_proc->parent = parent;
   
+  // the app is owned by this guest, which serves all its hypercalls
   new_proc->is_guest_os = 0;
+  new_proc->guest = myproc();
+  myproc()->napps++;
 
   int pid = new_proc->pid;
 
-  // get ptable proc array
-  struct proc *proc_arr = get_proc_arr();
-
-  // update guest os proc array if any children are unused or zombies
-  for (int i = 0 ; i < MAX_PROC; i++) {
-    int pid = proc_arr[i].pid;
-    if (proc_map[pid].owned == 1 && (proc_arr[i].state == UNUSED || proc_arr[i].state == ZOMBIE)) {
-      proc_map[pid].owned = 0;
-    }
-  }
-
   // copy file descriptors to app proc
   for(int i = 0; i < NOFILE; i++)
-    if(findproc(SHELL_PID)->ofile[i])
-      new_proc->ofile[i] = filedup(myproc()->ofile[i]);
+    if(parent->ofile[i])
+      new_proc->ofile[i] = filedup(parent->ofile[i]);
 
   udiskcopy(myproc()->cid, new_proc->cid);
 
   // update guest os copy of boundaries
-  proc_map[pid].owned = 1;
-  proc_map[pid].base = base;
-  proc_map[pid].midpoint = midpoint;
-  proc_map[pid].bound = bound;
+  app_seg->owned = 1;
+  app_seg->pid = pid;
+  app_seg->base = base;
+  app_seg->midpoint = midpoint;
+  app_seg->bound = bound;
 
   // update kernel copy of boundaries
-  myproc()->app_processes[pid].owned = 1;
-  myproc()->app_processes[pid].base = base;
-  myproc()->app_processes[pid].midpoint = midpoint;
-  myproc()->app_processes[pid].bound = bound;
+  seg = &myproc()->app_processes[procslot(new_proc)];
+  *seg = *app_seg;
 
   // setup pml4 page table and region directions
   vspaceinit(&new_proc->vspace);
@@ -309,18 +675,23 @@ sys_gaddmap(void) {
   uint64_t va;
   int app_present;
   int app_writeable;
+  struct proc *app_proc;
+  struct app_va_segment *seg;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *r;
 
   // check if guest os owns proc
-  if(argint(0, &pid) < 0 || myproc()->app_processes[pid].owned == 0)
+  if(argint(0, &pid) < 0 || (seg = ownedapp(pid, &app_proc)) == 0)
     return -1;
 
   // check if guest os owns physical page
-  if (argint(1, &ppn) < 0 || myproc()->user_pages[ppn] == 0)
+  if (argint(1, &ppn) < 0 || ppn < 0 || (r = leased(myproc(), ppn)) == 0)
     return -1;
 
   va = fetcharg(2);
   // check if va is within base and bounds
-  if (va < myproc()->app_processes[pid].base || va > myproc()->app_processes[pid].bound)
+  if (va < seg->base || va >= seg->bound || va % PGSIZE)
     return -1;
 
   if(argint(3, &app_present) < 0)
@@ -329,9 +700,29 @@ sys_gaddmap(void) {
   if(argint(4, &app_writeable) < 0)
     return -1;
 
+  // record the frame in the app's vspace too, so that rebuilding its page
+  // table (kernel sbrk, stack growth) keeps the mapping. Never replace a
+  // page the app already has.
+  vr = &app_proc->vspace.regions[va < seg->midpoint ? VR_USTACK : VR_HEAP];
+  if ((vpi = va2vpage_info(vr, va)) == 0 || vpi->used)
+    return -1;
+  if (va < seg->midpoint) {
+    vr->size = max(vr->size, seg->midpoint - va);
+    myproc()->vspace.regions[VR_APP_USTACK].size += PGSIZE;
+  } else {
+    vr->size = max(vr->size, va + PGSIZE - seg->midpoint);
+    myproc()->vspace.regions[VR_APP_HEAP].size += PGSIZE;
+  }
+  vpi->used = 1;
+  vpi->ppn = ppn;
+  vpi->present = app_present ? VPI_PRESENT : 0;
+  vpi->writable = app_writeable ? VPI_WRITABLE : 0;
+
   // set application entry
-  struct proc *app_proc = findproc(pid);
   pte_t *app_entry = walkpml4(app_proc->vspace.pgtbl, (void *) va, 1);
+  pte_t *guest_entry = walkpml4(myproc()->vspace.pgtbl, (void *) va, 1);
+  if (app_entry == 0 || guest_entry == 0)
+    return -1;
   int app_perm = PTE_U;
 
   if (app_present)
@@ -343,49 +734,56 @@ sys_gaddmap(void) {
   *app_entry = PTE(ppn << PT_SHIFT, app_perm);
 
   // set guest entry
-  pte_t *guest_entry = walkpml4(myproc()->vspace.pgtbl, (void *) va, 1);
   *guest_entry = PTE(ppn << PT_SHIFT, PTE_P | PTE_U | PTE_W);
 
-  if (va < myproc()->app_processes[pid].midpoint) {
-    app_proc->vspace.regions[VR_USTACK].size += PGSIZE;
-    myproc()->vspace.regions[VR_APP_USTACK].size += PGSIZE;
-  } else {
-    app_proc->vspace.regions[VR_HEAP].size += PGSIZE;
-    myproc()->vspace.regions[VR_APP_HEAP].size += PGSIZE;
-  }
-
   // flush pml4
   vspaceinstall(myproc());
-  myproc()->user_pages[ppn] = 2;
+  r->maps++;
   return 0;
 } 
 
-// returns ppn of unmapped page
+// Returns ppn of unmapped page. The guest can reuse it once no other app
+// maps it, which after gfork_app it learns from gquery_user_pages.
 int 
 sys_gremovemap(void) {
   int pid;
-  if(argint(0, &pid) < 0 || myproc()->app_processes[pid].owned == 0)
-    return -1;
+  struct proc *app_proc;
+  struct app_va_segment *seg;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *r;
 
-  uint64_t va = fetcharg(1);
-  if (va > myproc()->app_processes[pid].bound || va < myproc()->app_processes[pid].base)
+  if(argint(0, &pid) < 0 || (seg = ownedapp(pid, &app_proc)) == 0)
     return -1;
 
-  pte_t *pte_guest = walkpml4(myproc()->vspace.pgtbl, (void *) va, 0);
-  int ppn = PTE_ADDR(*pte_guest) >> PT_SHIFT;
-  if (pte_guest == 0 || myproc()->user_pages[ppn] == 0)
+  uint64_t va = fetcharg(1);
+  if (va >= seg->bound || va < seg->base)
     return -1;
 
-  struct proc *app_proc = findproc(pid);
   pte_t *pte_app = walkpml4(app_proc->vspace.pgtbl, (void *) va, 0);
-  int ppn2 = PTE_ADDR(*pte_app) >> PT_SHIFT;
-  if (pte_app == 0 || ppn != ppn2)
+  if (pte_app == 0 || PTE_ADDR(*pte_app) == 0)
+    return -1;
+  int ppn = PTE_ADDR(*pte_app) >> PT_SHIFT;
+  if ((r = leased(myproc(), ppn)) == 0 || r->maps < 2)
     return -1;
 
   // clear page table entries
-  *pte_guest = 0;
   *pte_app = 0;
-  myproc()->user_pages[ppn] = 1;
+  unmapframe(myproc(), va, ppn);
+
+  // forget the frame in the app's vspace; shrink the region if this was
+  // its outermost page
+  vr = &app_proc->vspace.regions[va < seg->midpoint ? VR_USTACK : VR_HEAP];
+  if (vregioncontains(vr, PGROUNDDOWN(va), 0) && (vpi = va2vpage_info(vr, PGROUNDDOWN(va))) != 0) {
+    vpi->used = 0;
+    vpi->ppn = 0;
+    vpi->present = 0;
+    vpi->writable = 0;
+  }
+  if (vr->dir == VRDIR_UP && PGROUNDDOWN(va) + PGSIZE == VRTOP(vr))
+    vr->size -= PGSIZE;
+  else if (vr->dir == VRDIR_DOWN && PGROUNDDOWN(va) == VRBOT(vr))
+    vr->size -= PGSIZE;
 
   // flush pml4
   vspaceinstall(myproc());
@@ -399,22 +797,29 @@ sys_gupdate_flags(void) {
   uint64_t va;
   int present;
   int writeable;
+  struct proc *app_proc;
+  struct app_va_segment *seg;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *r;
 
-  if(argint(0, &app_pid) < 0 || myproc()->app_processes[app_pid].owned == 0)
+  if(argint(0, &app_pid) < 0 || (seg = ownedapp(app_pid, &app_proc)) == 0)
     return -1;
 
   va = fetcharg(1);
   
-  if (va > myproc()->app_processes[app_pid].bound || va < myproc()->app_processes[app_pid].base)
+  if (va >= seg->bound || va < seg->base)
     return -1;
   
-  if (argint(1, &present) < 0 || argint(1, &writeable) < 0)
+  if (argint(2, &present) < 0 || argint(3, &writeable) < 0)
     return -1;
 
-  pte_t *pte_guest = walkpml4(myproc()->vspace.pgtbl, (void *) va, 0);
-  pte_t *pte_app = walkpml4(findproc(app_pid)->vspace.pgtbl, (void *) va, 0);
-  
-  if (pte_guest == 0 || pte_app == 0 || (PTE_ADDR(*pte_guest) >> PT_SHIFT) != (PTE_ADDR(*pte_app) >> PT_SHIFT))
+  // only pages the guest mapped itself
+  pte_t *pte_app = walkpml4(app_proc->vspace.pgtbl, (void *) va, 0);
+  if (pte_app == 0 || PTE_ADDR(*pte_app) == 0)
+    return -1;
+  uint64_t ppn = PTE_ADDR(*pte_app) >> PT_SHIFT;
+  if ((r = leased(myproc(), ppn)) == 0 || r->maps < 2)
     return -1;
 
   // set flags
@@ -430,9 +835,53 @@ sys_gupdate_flags(void) {
     *pte_app &= ~PTE_W;
   }
 
+  // keep the app's vspace in sync with the page table
+  vr = &app_proc->vspace.regions[va < seg->midpoint ? VR_USTACK : VR_HEAP];
+  if (vregioncontains(vr, PGROUNDDOWN(va), 0) && (vpi = va2vpage_info(vr, PGROUNDDOWN(va))) != 0 && vpi->used) {
+    vpi->present = present == 1 ? VPI_PRESENT : 0;
+    vpi->writable = writeable == 1 ? VPI_WRITABLE : 0;
+  }
   return 0;
 }
 
+// Copies n bytes from the guest os buffer src to va in the address space of
+// the app with the given pid, for app memory the guest has no mirror mapping
+// of. Returns n, or -1 if a destination page is not mapped user-writable in
+// the app.
+int
+sys_gcopyout(void)
+{
+  int pid, n, m;
+  uint64_t va;
+  char *src;
+  pte_t *pte;
+  struct proc *app_proc;
+
+  if (argint(0, &pid) < 0 || ownedapp(pid, &app_proc) == 0)
+    return -1;
+  va = fetcharg(1);
+  if (argint(3, &n) < 0 || n < 0 || argptr(2, &src, n) < 0)
+    return -1;
+  if (va + n < va || va + n > USERTOP)
+    return -1;
+
+  for (int tot = 0; tot < n; tot += m, va += m, src += m) {
+    // buffers in the app's data may not be paged in yet, or share the
+    // cached program image
+    vspaceloadrange(&app_proc->vspace, va, 1);
+    pte = walkpml4(app_proc->vspace.pgtbl, (void *) PGROUNDDOWN(va), 0);
+    if (pte != 0 && !(*pte & PTE_W) &&
+        va2vregion(&app_proc->vspace, va) == &app_proc->vspace.regions[VR_CODE] &&
+        vspacecowcopy(&app_proc->vspace, va) == 0)
+      pte = walkpml4(app_proc->vspace.pgtbl, (void *) PGROUNDDOWN(va), 0);
+    if (pte == 0 || (*pte & (PTE_P | PTE_U | PTE_W)) != (PTE_P | PTE_U | PTE_W))
+      return -1;
+    m = min(n - tot, (int) (PGSIZE - va % PGSIZE));
+    memmove((char *) P2V(PTE_ADDR(*pte)) + va % PGSIZE, src, m);
+  }
+  return n;
+}
+
 // Helper for exec
 // Round size of arg upwards to the nearest multiple of 8
 int
@@ -447,32 +896,38 @@ multipleOfEight(char * arg) {
 int
 sys_gdeploy_program(void) {
   struct syscall_message *message;
+  struct proc *app_proc;
+  struct app_va_segment *seg;
+
   if (argptr(0, (void *) &message, sizeof(struct syscall_message)) < 0)
-    goto bad;
+    return -1;
   
   int app_pid = message->pid;
-  if(myproc()->app_processes[app_pid].owned == 0)
-    goto bad;
+  if((seg = ownedapp(app_pid, &app_proc)) == 0)
+    return -1;
 
-  struct proc *app_proc = findproc(app_pid);
   int argc = 0;
   char **argv = message->args[1].arg_val.char_ptr_ptr;
-  char *topOfStack = myproc()->app_processes[app_pid].midpoint;
+  char *topOfStack = (char *) seg->midpoint;
   char * pointers[MAXARG];
 
-  while (*argv != '\0') {
+  while (*argv != 0) {
+    if (argc >= MAXARG - 1)
+      goto bad;
     topOfStack -= multipleOfEight(*argv);
     pointers[argc] = topOfStack;
-    copyout(app_proc->vspace.pgtbl, (uint64_t) topOfStack, (void *) *argv, strlen(*argv) + 1);
+    if (copyout(app_proc->vspace.pgtbl, (uint64_t) topOfStack, (void *) *argv, strlen(*argv) + 1) < 0)
+      goto bad;
     argc++;
     argv++;
   }
 
-  pointers[argc] = '\0';
+  pointers[argc] = 0;
 
   topOfStack -= (8 * (argc + 1));
 
-  copyout(app_proc->vspace.pgtbl, (uint64_t) topOfStack, (void *) pointers, sizeof(uint64_t) * (argc + 1));
+  if (copyout(app_proc->vspace.pgtbl, (uint64_t) topOfStack, (void *) pointers, sizeof(uint64_t) * (argc + 1)) < 0)
+    goto bad;
 
   app_proc->tf->rdi = argc;
   app_proc->tf->rsi = (uint64_t) topOfStack;
@@ -485,22 +940,505 @@ sys_gdeploy_program(void) {
 
   // cleanup proc
   bad:
-    // Close all open files.
-    for(int fd = 0; fd < NOFILE; fd++){
-      if(app_proc->ofile[fd]){
-        fileclose(app_proc->ofile[fd]);
-        app_proc->ofile[fd] = 0;
-      }
+    abortapp(seg, app_proc);
+    return -1;
+}
+
+// Asks every guest os to return idle frames when free_pages falls below
+// BALLOON_LOW_WATERMARK. Guests answer with ginflate. Called on the way back
+// to user space, with no locks held.
+void
+guest_balloon_check(void)
+{
+  struct proc *g;
+  struct proc *proc_arr;
+  struct syscall_message *message;
+  int nguests, want;
+
+  if (free_pages >= BALLOON_HIGH_WATERMARK)
+    balloon_notified = 0;
+  if (balloon_notified || free_pages >= BALLOON_LOW_WATERMARK)
+    return;
+  balloon_notified = 1;
+  num_mem_pressure++;
+
+  lock_ptable();
+  proc_arr = get_proc_arr();
+  nguests = 0;
+  for (g = proc_arr; g < &proc_arr[NPROC]; g++)
+    if (g->is_guest_os && !g->killed)
+      nguests++;
+  if (nguests == 0) {
+    unlock_ptable();
+    return;
+  }
+
+  // split what it takes to get back above the high watermark evenly
+  want = (BALLOON_HIGH_WATERMARK - free_pages + nguests - 1) / nguests;
+  for (g = proc_arr; g < &proc_arr[NPROC]; g++) {
+    if (!g->is_guest_os || g->killed)
+      continue;
+    if ((message = (struct syscall_message *) kalloc()) == 0)
+      break;
+    message->pid = 0;
+    message->syscall_index = MESSAGE_MEM_PRESSURE;
+    message->num_args = 1;
+    message->args[0].arg_type = INT_TYPE;
+    message->args[0].arg_val.i = want;
+    insert_syscall(message, g);
+    wakeup1(g);
+  }
+  unlock_ptable();
+}
+
+// Inflates the balloon: the guest os gives back the n frames listed in ppns.
+// Frames the guest does not own or has mapped into an app are skipped.
+// Returns the number of frames returned to xkvisor.
+int
+sys_ginflate(void)
+{
+  int *ppns;
+  int n, ppn, freed;
+  struct core_map_entry *r;
+
+  if (!myproc()->is_guest_os)
+    return -1;
+  if (argint(1, &n) < 0 || n < 0 || n > myproc()->nleases)
+    return -1;
+  if (argptr(0, (void *) &ppns, sizeof(int) * n) < 0)
+    return -1;
+
+  freed = 0;
+  for (int i = 0; i < n; i++) {
+    ppn = ppns[i];
+    if (ppn < 0 || (r = leased(myproc(), ppn)) == 0 || r->maps != 1)
+      continue;
+    unlease(myproc(), r);
+    kfree(P2V((uint64_t) ppn << PT_SHIFT));
+    freed++;
+  }
+  balloon_inflated += freed;
+  return freed;
+}
+
+// Deflates the balloon: leases up to n more frames to the guest os, without
+// taking free_pages below BALLOON_LOW_WATERMARK. The guest learns which
+// frames it got through gquery_user_pages. Returns the number granted.
+int
+sys_gdeflate(void)
+{
+  int n, granted;
+
+  if (!myproc()->is_guest_os)
+    return -1;
+  if (argint(0, &n) < 0 || n < 0)
+    return -1;
+  if (n > BALLOON_MAX_DEFLATE)
+    n = BALLOON_MAX_DEFLATE;
+
+  granted = 0;
+  while (granted < n && free_pages > BALLOON_LOW_WATERMARK &&
+         leaseframe(myproc()) == 0)
+    granted++;
+  balloon_deflated += granted;
+  return granted;
+}
+
+// Returns the kernel address of va in the calling guest os. Its page
+// must be mapped user accessible, and writable if write is set; pages
+// populated on first touch are populated first, as kernfault does,
+// except in the windows onto app memory. Returns 0 if the page is not
+// accessible.
+static char *
+guestpage(uint64_t va, int write)
+{
+  struct vspace *vs = &myproc()->vspace;
+  struct vregion *vr = va2vregion(vs, va);
+  uint64_t perm = PTE_P | PTE_U | (write ? PTE_W : 0);
+  pte_t *pte;
+
+  if (vr == 0)
+    return 0;
+  pte = walkpml4(vs->pgtbl, (void *) PGROUNDDOWN(va), 0);
+  if ((pte == 0 || (*pte & perm) != perm) &&
+      vr != &vs->regions[VR_APP_HEAP] && vr != &vs->regions[VR_APP_USTACK]) {
+    if (vspacedemandload(vs, va) == 0 || vspacefilefault(vs, va, write) == 0 ||
+        vspacezerofill(vs, va, write) == 0 || (write && vspacecowcopy(vs, va) == 0))
+      vspaceinstall(myproc());
+    pte = walkpml4(vs->pgtbl, (void *) PGROUNDDOWN(va), 0);
+  }
+  if (pte == 0 || (*pte & perm) != perm)
+    return 0;
+  return (char *) P2V(PTE_ADDR(*pte)) + va % PGSIZE;
+}
+
+// Copies n bytes between buf and va in the calling guest os, page by
+// page: to the guest if out is set, from it if not. Returns 0, or -1 if
+// a page is not accessible.
+static int
+guestcopy(uint64_t va, void *buf, int n, int out)
+{
+  char *p, *b = buf;
+  int tot, m;
+
+  if (va + n < va || va + n > USERTOP)
+    return -1;
+  for (tot = 0; tot < n; tot += m, va += m, b += m) {
+    if ((p = guestpage(va, out)) == 0)
+      return -1;
+    m = min(n - tot, (int) (PGSIZE - va % PGSIZE));
+    if (out)
+      memmove(p, b, m);
+    else
+      memmove(b, p, m);
+  }
+  return 0;
+}
+
+// Registers the paravirtual block ring of the calling guest os. Requests
+// already in the ring are ignored; the guest starts submitting at its
+// current avail_idx.
+int
+sys_gblk_setup(void)
+{
+  struct pvblk_ring *ring;
+  uint zero = 0, avail;
+
+  if (!myproc()->is_guest_os)
+    return -1;
+  ring = (struct pvblk_ring *) fetcharg(0);
+  // the ring stays in guest memory; it is only reached through guestcopy
+  if (guestcopy((uint64_t) &ring->avail_idx, &avail, sizeof(avail), 0) < 0 ||
+      guestcopy((uint64_t) &ring->used_idx, &zero, sizeof(zero), 1) < 0)
+    return -1;
+
+  myproc()->blkring = ring;
+  myproc()->blk_avail = avail;
+  return 0;
+}
+
+// Runs one descriptor, a copy the guest cannot change any more, against
+// the guest's container disk, blocks [(cid + 1) * UDISKSIZE,
+// (cid + 2) * UDISKSIZE). Data goes through a bounce page, so guest
+// memory is never touched with a buffer locked.
+static int
+blkrun(struct pvblk_desc *d)
+{
+  struct buf *b;
+  uint disk;
+  uint64_t data = (uint64_t) d->data;
+  char *bounce;
+  int err = 0;
+
+  if (d->nblocks == 0 || d->nblocks > PVBLK_MAX_NBLOCKS)
+    return PVBLK_ERR;
+  if (d->blockno >= UDISKSIZE || d->nblocks > UDISKSIZE - d->blockno)
+    return PVBLK_ERR;
+  if (d->type != PVBLK_READ && d->type != PVBLK_WRITE)
+    return PVBLK_ERR;
+  if ((bounce = kalloc()) == 0)
+    return PVBLK_ERR;
+
+  disk = (myproc()->cid + 1) * UDISKSIZE + d->blockno;
+  if (d->type == PVBLK_WRITE) {
+    pcdrop(disk, d->nblocks);
+    dcdrop(myproc()->cid);
+    imagedrop(myproc()->cid, 0);
+  }
+  for (uint i = 0; i < d->nblocks && !err; i++) {
+    if (d->type == PVBLK_READ) {
+      b = bread(ROOTDEV, disk + i);
+      memmove(bounce, b->data, BSIZE);
+      brelse(b);
+      err = guestcopy(data + i * BSIZE, bounce, BSIZE, 1);
+    } else if ((err = guestcopy(data + i * BSIZE, bounce, BSIZE, 0)) == 0) {
+      b = bread(ROOTDEV, disk + i);
+      memmove(b->data, bounce, BSIZE);
+      bwrite(b);
+      brelse(b);
     }
+  }
+  kfree(bounce);
+  return err ? PVBLK_ERR : PVBLK_OK;
+}
 
-    kfree((char *) app_proc->kstack);
-    kfree((char *) app_proc->vspace.pgtbl);
+// Serves every descriptor the guest os posted since the last notify, so a
+// whole batch costs one hypercall. Completions go to the used ring and are
+// announced with a single MESSAGE_BLK_COMPLETE. Returns the number of
+// descriptors served, or -1 if the ring is not accessible.
+int
+sys_gblk_notify(void)
+{
+  struct pvblk_ring *ring = myproc()->blkring;
+  struct syscall_message *message;
+  struct pvblk_desc d;
+  struct pvblk_used u;
+  uint id, avail, used, next;
+  int n;
+
+  // the guest can change the ring at any time, so every field is read
+  // once, into a local copy, before it is checked or used
+  if (ring == 0 ||
+      guestcopy((uint64_t) &ring->avail_idx, &avail, sizeof(avail), 0) < 0 ||
+      guestcopy((uint64_t) &ring->used_idx, &used, sizeof(used), 0) < 0)
+    return -1;
+
+  // never serve more than one ring's worth, whatever avail_idx claims
+  if (avail - myproc()->blk_avail > PVBLK_RING_SIZE)
+    avail = myproc()->blk_avail + PVBLK_RING_SIZE;
+
+  for (n = 0; myproc()->blk_avail != avail; myproc()->blk_avail++, n++, used++) {
+    if (guestcopy((uint64_t) &ring->avail[myproc()->blk_avail % PVBLK_RING_SIZE],
+                  &id, sizeof(id), 0) < 0)
+      return -1;
+    u.id = id;
+    u.status = PVBLK_ERR;
+    if (id < PVBLK_RING_SIZE && guestcopy((uint64_t) &ring->desc[id], &d, sizeof(d), 0) == 0)
+      u.status = blkrun(&d);
+    next = used + 1;
+    if (guestcopy((uint64_t) &ring->used[used % PVBLK_RING_SIZE], &u, sizeof(u), 1) < 0 ||
+        guestcopy((uint64_t) &ring->used_idx, &next, sizeof(next), 1) < 0)
+      return -1;
+  }
 
+  if (n > 0 && (message = (struct syscall_message *) kalloc()) != 0) {
+    message->pid = 0;
+    message->syscall_index = MESSAGE_BLK_COMPLETE;
+    message->num_args = 1;
+    message->args[0].arg_type = INT_TYPE;
+    message->args[0].arg_val.i = n;
     lock_ptable();
-    // Parent might be sleeping in wait().
-    wakeup1(findproc(SHELL_PID));
-    app_proc->state = UNUSED;
-    app_proc->parent = 0;
+    insert_syscall(message, myproc());
     unlock_ptable();
+  }
+  return n;
+}
+
+// Programs the virtual timer of the calling guest os. The first
+// MESSAGE_TIMER arrives delay ticks from now, then every period ticks, or
+// just once if period is 0. A delay of 0 disarms the timer.
+int
+sys_gtimer(void)
+{
+  int delay, period;
+
+  if (!myproc()->is_guest_os)
+    return -1;
+  if (argint(0, &delay) < 0 || argint(1, &period) < 0)
+    return -1;
+  if (delay < 0 || period < 0)
+    return -1;
+
+  lock_ptable();
+  if (myproc()->timer_deadline)
+    guest_timers--;
+  myproc()->timer_deadline = 0;
+  myproc()->timer_period = period;
+  myproc()->timer_overruns = 0;
+  if (delay > 0) {
+    // 0 means disarmed, so never land on tick 0 after a wrap
+    myproc()->timer_deadline = ticks + delay ? ticks + delay : 1;
+    guest_timers++;
+  }
+  unlock_ptable();
+  return 0;
+}
+
+// Called on every timer tick. Queues a MESSAGE_TIMER for each guest os whose
+// deadline has passed. At most one event per guest is queued at a time;
+// deadlines that pass while it is pending are reported as overruns.
+void
+guest_timer_tick(void)
+{
+  struct proc *g;
+  struct proc *proc_arr;
+  struct syscall_message *message;
+
+  if (guest_timers == 0)
+    return;
+
+  lock_ptable();
+  proc_arr = get_proc_arr();
+  for (g = proc_arr; g < &proc_arr[NPROC]; g++) {
+    if (!g->is_guest_os || g->timer_deadline == 0)
+      continue;
+    if ((int) (ticks - g->timer_deadline) < 0)
+      continue;
+
+    if (g->timer_period) {
+      g->timer_deadline += g->timer_period;
+      if (g->timer_deadline == 0)
+        g->timer_deadline = 1;
+    } else {
+      g->timer_deadline = 0;
+      guest_timers--;
+    }
+
+    if (g->timer_pending || (message = (struct syscall_message *) kalloc()) == 0) {
+      g->timer_overruns++;
+      continue;
+    }
+    message->pid = 0;
+    message->syscall_index = MESSAGE_TIMER;
+    message->num_args = 2;
+    message->args[0].arg_type = INT_TYPE;
+    message->args[0].arg_val.i = ticks;
+    message->args[1].arg_type = INT_TYPE;
+    message->args[1].arg_val.i = g->timer_overruns;
+    g->timer_overruns = 0;
+    g->timer_pending = 1;
+    insert_syscall(message, g);
+    wakeup1(g);
+  }
+  unlock_ptable();
+}
+
+// Clones the app with the given pid into a new app of the calling guest
+// os. Guest-leased frames are shared copy-on-write instead of copied, so
+// the cost is proportional to the size of the page tables: both apps lose
+// write access and a write fault sends MESSAGE_COW_FAULT to the guest (see
+// guest_cow_fault). The clone is a child of the app, shares its container
+// and va window, returns 0 from the hypercall it was blocked in, and stays
+// EMBRYO until the guest starts it with gresume. Returns the clone's pid.
+int
+sys_gfork_app(void)
+{
+  int pid;
+  struct proc *app, *np;
+  struct app_va_segment *seg, *app_seg, *kseg;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *r;
+  uint64_t va;
+
+  if (!myproc()->is_guest_os)
+    return -1;
+  if (argint(0, &pid) < 0 || (seg = ownedapp(pid, &app)) == 0)
+    return -1;
+  if (argptr(1, (void *) &app_seg, sizeof(struct app_va_segment)) < 0)
+    return -1;
+
+  // the clone sees the same files, so it stays in the app's container
+  if ((np = allocproc(app->cid)) == 0)
+    return -1;
+  vspaceinit(&np->vspace);
+  if (cow_vspacecopy(&np->vspace, &app->vspace) < 0) {
+    vspacefree(&np->vspace);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
+
+  // guest frames are counted by their lease, not by the kernel allocator
+  for (vr = &np->vspace.regions[VR_HEAP]; vr <= &np->vspace.regions[VR_USTACK]; vr++) {
+    for (va = VRBOT(vr); va < VRTOP(vr); va += PGSIZE) {
+      vpi = va2vpage_info(vr, va);
+      if (vpi == 0 || !vpi->used || (r = leased(myproc(), vpi->ppn)) == 0 ||
+          r->maps < 2)
+        continue;
+      r->maps++;
+      kfree(P2V(vpi->ppn << PT_SHIFT)); // drops the reference cow_vspacecopy took
+    }
+  }
+
+  np->parent = app;
+  np->guest = myproc();
+  myproc()->napps++;
+
+  *np->tf = *app->tf;
+  np->tf->rax = 0;
+  for (int i = 0; i < NOFILE; i++)
+    if (app->ofile[i])
+      np->ofile[i] = filedup(app->ofile[i]);
+  safestrcpy(np->name, app->name, sizeof(app->name));
+
+  kseg = &myproc()->app_processes[procslot(np)];
+  *kseg = *seg;
+  kseg->pid = np->pid;
+  *app_seg = *kseg;
+  return np->pid;
+}
+
+// Called from trap() on a write fault to a copy-on-write page of the current
+// app. Returns 0 if the frame is not leased from a guest os and the kernel
+// should copy it, 1 once the fault is resolved and -1 if it cannot be. A
+// frame no other app maps any more is just made writable again; otherwise
+// the owning guest os gets MESSAGE_COW_FAULT and remaps the page with
+// gcowcopy while the app waits.
+int
+guest_cow_fault(struct vpage_info *vpi, uint64_t va)
+{
+  struct proc *guest = myproc()->guest;
+  struct syscall_message *message;
+  struct core_map_entry *r;
+  pte_t *pte;
+
+  if (guest == 0 || (r = leased(guest, vpi->ppn)) == 0 || r->maps < 2)
+    return 0;
+
+  if (r->maps == 2) {
+    vpi->cow = 0;
+    vpi->writable = VPI_WRITABLE;
+    if ((pte = walkpml4(myproc()->vspace.pgtbl, (void *) va, 0)) != 0)
+      *pte |= PTE_W;
+    vspaceinstall(myproc());
+    return 1;
+  }
+
+  if ((message = (struct syscall_message *) kalloc()) == 0)
     return -1;
-}
\ No newline at end of file
+  message->pid = myproc()->pid;
+  message->syscall_index = MESSAGE_COW_FAULT;
+  message->num_args = 1;
+  message->args[0].arg_type = LONG_TYPE;
+  message->args[0].arg_val.l = va;
+  return sendguest(message) < 0 ? -1 : 1;
+}
+
+// Resolves a copy-on-write fault of the app with the given pid at va: copies
+// the shared frame into the guest's free frame ppn and maps that writable in
+// the app instead. 0 on success, -1 on failure.
+int
+sys_gcowcopy(void)
+{
+  int pid, ppn;
+  uint64_t va, old;
+  struct proc *app;
+  struct app_va_segment *seg;
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  struct core_map_entry *r, *rold;
+  pte_t *pte;
+
+  if (argint(0, &pid) < 0 || (seg = ownedapp(pid, &app)) == 0)
+    return -1;
+  va = fetcharg(1);
+  if (va < seg->base || va >= seg->bound || va % PGSIZE)
+    return -1;
+  if (argint(2, &ppn) < 0 || ppn < 0 || (r = leased(myproc(), ppn)) == 0 || r->maps != 1)
+    return -1;
+
+  vr = &app->vspace.regions[va < seg->midpoint ? VR_USTACK : VR_HEAP];
+  if (!vregioncontains(vr, va, 0) || (vpi = va2vpage_info(vr, va)) == 0)
+    return -1;
+  if (!vpi->used || !vpi->cow || vpi->writable)
+    return -1;
+  old = vpi->ppn;
+  if ((rold = leased(myproc(), old)) == 0 || rold->maps < 2)
+    return -1;
+  if ((pte = walkpml4(app->vspace.pgtbl, (void *) va, 0)) == 0)
+    return -1;
+
+  memmove(P2V((uint64_t) ppn << PT_SHIFT), P2V(old << PT_SHIFT), PGSIZE);
+  vpi->ppn = ppn;
+  vpi->cow = 0;
+  vpi->writable = VPI_WRITABLE;
+  *pte = PTE((uint64_t) ppn << PT_SHIFT, PTE_U | PTE_W | (vpi->present ? PTE_P : 0));
+  r->maps = 2;
+  unmapframe(myproc(), va, old);
+
+  // flush pml4
+  vspaceinstall(myproc());
+  return 0;
+}
@@ -1,4 +1,6 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code. Data moves by bus-master DMA when the PCI IDE
+// controller supports it, by PIO otherwise. If the file system disk is a
+// virtio-blk device instead, requests are passed on to virtio.c.
 
 #include <cdefs.h>
 #include <defs.h>
@@ -6,6 +8,7 @@
 #include <memlayout.h>
 #include <mmu.h>
 #include <param.h>
+#include <pci.h>
 #include <proc.h>
 #include <sleeplock.h>
 #include <spinlock.h>
@@ -24,13 +27,52 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_READ_DMA 0xc8
+#define IDE_CMD_WRITE_DMA 0xca
+
+// Bus-master IDE registers of the primary channel, at offsets from the
+// I/O base in BAR4 of the controller.
+#define BM_CMD 0          // start bit, and direction of the transfer
+#define BM_STATUS 2       // error and interrupt bits, write 1 to clear
+#define BM_PRDT 4         // physical address of the PRD table
+#define BM_CMD_START 0x1
+#define BM_CMD_READ 0x8   // device to memory
+#define BM_STATUS_ERR 0x2
+#define BM_STATUS_INTR 0x4
+
+// Physical region descriptor: one piece of memory a DMA transfer reads
+// or fills. The table of a command must not cross a 64KB boundary, and
+// neither may the piece an entry describes.
+struct prd {
+  uint addr;
+  ushort count;     // bytes
+  ushort flags;
+};
+#define PRD_EOT 0x8000 // last entry of the table
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// The queue is kept in elevator (C-LOOK) order: the blocks after the
+// current request in ascending order, then the blocks before it for the
+// next sweep. A buf that has waited IDE_DEADLINE ticks goes next, so a
+// stream of requests ahead of the head cannot starve the others. Queued
+// bufs of consecutive blocks in the same direction are transferred with
+// one multi-sector command; ideleft counts the bufs of the current
+// command not yet transferred.
+
+#define IDE_DEADLINE 50
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int ideleft;
+
+static ushort bmbase;     // bus-master registers, 0 if PIO only
+static struct prd *prdt;  // PRD table, one entry per buf of a command
+static int idedma;        // the current command uses DMA
+static int idevirtio;     // disk requests go to virtio-blk
 
 static int havedisk1;
 static void idestart(struct buf *);
@@ -46,10 +88,36 @@ static int idewait(int checkerr) {
   return 0;
 }
 
+// Set up bus-master DMA if there is a PCI IDE controller that can do
+// it. Without one, or if it is out of reach of 32-bit DMA addresses, the
+// driver keeps using PIO.
+static void idedmainit(void) {
+  struct pcidev d;
+  uint bar;
+
+  // mass storage, IDE, bus master capable
+  if (pcifind(PCI_CLASS, 0xffff8000, 0x01018000, &d) < 0)
+    return;
+  bar = pciread(&d, PCI_BAR0 + 4 * 4);
+  if (!(bar & PCI_BAR_IO) || (prdt = (struct prd *)kalloc()) == 0)
+    return;
+  if (V2P(prdt) >> 32) {
+    kfree((char *)prdt);
+    return;
+  }
+  pciwrite(&d, PCI_COMMAND, pciread(&d, PCI_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+  bmbase = bar & ~3;
+  cprintf("ide: bus-master DMA at port 0x%x\n", bmbase);
+}
+
 void ideinit(void) {
   int i;
 
   initlock(&idelock, "ide");
+  if (virtioinit() == 0) {
+    idevirtio = 1;
+    return;
+  }
   picenable(IRQ_IDE);
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
@@ -63,12 +131,47 @@ void ideinit(void) {
     }
   }
 
+  // RDMUL and WRMUL interrupt once per block
+  if (BSIZE / SECTOR_SIZE > 1) {
+    for (i = 0; i <= havedisk1; i++) {
+      outb(0x1f6, 0xe0 | (i << 4));
+      idewait(0);
+      outb(0x1f2, BSIZE / SECTOR_SIZE);
+      outb(0x1f7, IDE_CMD_SETMUL);
+      idewait(0);
+    }
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0 << 4));
+
+  idedmainit();
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Point the PRD table at the data of the nblocks bufs starting at b.
+// Returns 0 if one of them is out of reach of DMA.
+static int idedmasetup(struct buf *b, int nblocks) {
+  uint64_t pa;
+  int i;
+
+  for (i = 0; i < nblocks; i++, b = b->qnext) {
+    pa = V2P(b->data);
+    if ((pa + BSIZE - 1) >> 32 || (pa >> 16) != ((pa + BSIZE - 1) >> 16))
+      return 0;
+    prdt[i].addr = pa;
+    prdt[i].count = BSIZE;
+    prdt[i].flags = 0;
+  }
+  prdt[nblocks - 1].flags = PRD_EOT;
+  return 1;
+}
+
+// Start the request for b, and for the bufs of the blocks after it that
+// are queued behind it in the same direction.  Caller must hold idelock.
 static void idestart(struct buf *b) {
+  struct buf *n;
+  int nblocks = 1;
+
   if (b == 0)
     panic("idestart");
   if (b->blockno >= FSSIZE)
@@ -78,17 +181,36 @@ static void idestart(struct buf *b) {
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
   int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7)
+  if (sector_per_block > 16)
     panic("idestart");
 
+  for (n = b->qnext; n && nblocks < 255 / sector_per_block &&
+                     (n->flags & B_DIRTY) == (b->flags & B_DIRTY) &&
+                     n->dev == b->dev && n->blockno == b->blockno + nblocks;
+       n = n->qnext)
+    nblocks++;
+  ideleft = nblocks;
+  num_disk_requests += 1;
+
+  idedma = bmbase && idedmasetup(b, nblocks);
+  if (idedma) {
+    outl(bmbase + BM_PRDT, V2P(prdt));
+    outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_INTR);
+    outb(bmbase + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_CMD_READ);
+  }
+
   idewait(0);
   outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
+  outb(0x1f2, sector_per_block * nblocks); // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
-  if (b->flags & B_DIRTY) {
+  if (idedma) {
+    // one interrupt when the whole command is done
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+    outb(bmbase + BM_CMD, inb(bmbase + BM_CMD) | BM_CMD_START);
+  } else if (b->flags & B_DIRTY) {
     outb(0x1f7, write_cmd);
     outsl(0x1f0, b->data, BSIZE / 4);
   } else {
@@ -96,6 +218,41 @@ static void idestart(struct buf *b) {
   }
 }
 
+// Sort key of b in a sweep that starts after block pos.
+static uint idekey(struct buf *b, uint pos) {
+  return b->blockno > pos ? b->blockno : b->blockno + FSSIZE;
+}
+
+// Move the oldest buf that has waited past its deadline to the front of
+// the queue. Caller must hold idelock and the disk must be idle.
+static void idedeadline(void) {
+  struct buf **pp, **oldest = 0;
+
+  for (pp = &idequeue; *pp; pp = &(*pp)->qnext)
+    if (ticks - (*pp)->qtime >= IDE_DEADLINE &&
+        (oldest == 0 || (int)((*pp)->qtime - (*oldest)->qtime) < 0))
+      oldest = pp;
+  if (oldest && *oldest != idequeue) {
+    struct buf *b = *oldest;
+    *oldest = b->qnext;
+    b->qnext = idequeue;
+    idequeue = b;
+  }
+}
+
+// Mark b, whose transfer is done, valid and clean. Wake the process
+// waiting for it, or let go of a read ahead. Caller must hold idelock.
+static void idedone(struct buf *b) {
+  b->flags |= B_VALID;
+  b->flags &= ~B_DIRTY;
+  if (b->flags & B_ASYNC) {
+    b->flags &= ~B_ASYNC;
+    brelse(b);
+  } else {
+    wakeup(b);
+  }
+}
+
 // Interrupt handler.
 void ideintr(void) {
   struct buf *b;
@@ -107,29 +264,60 @@ void ideintr(void) {
     // cprintf("spurious IDE interrupt\n");
     return;
   }
+
+  if (idedma) {
+    if (!(inb(bmbase + BM_STATUS) & BM_STATUS_INTR)) {
+      release(&idelock);
+      return;
+    }
+    // stop the engine, clear its status and the disk's interrupt
+    outb(bmbase + BM_CMD, 0);
+    outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_INTR);
+    idewait(1);
+    idedma = 0;
+    // every buf of the command is done
+    for (; ideleft > 0; ideleft--) {
+      b = idequeue;
+      idequeue = b->qnext;
+      idedone(b);
+    }
+    if (idequeue != 0) {
+      idedeadline();
+      idestart(idequeue);
+    }
+    release(&idelock);
+    return;
+  }
+
   idequeue = b->qnext;
 
   // Read data if needed.
   if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
     insl(0x1f0, b->data, BSIZE / 4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  idedone(b);
 
-  // Start disk on next buf in queue.
-  if (idequeue != 0)
+  if (--ideleft > 0) {
+    // the current command goes on with the next buf
+    if (idequeue->flags & B_DIRTY) {
+      idewait(0);
+      outsl(0x1f0, idequeue->data, BSIZE / 4);
+    }
+  } else if (idequeue != 0) {
+    // Start disk on next buf in queue.
+    idedeadline();
     idestart(idequeue);
+  }
 
   release(&idelock);
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void iderw(struct buf *b) {
+// Insert b into idequeue and start the disk if it is idle.
+// Caller must hold idelock.
+static void ideappend(struct buf *b) {
   struct buf **pp;
+  uint pos = 0;
+  int i;
 
   if (!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
@@ -138,17 +326,49 @@ void iderw(struct buf *b) {
   if (b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
-  acquire(&idelock); // DOC:acquire-lock
-
-  // Append b to idequeue.
-  b->qnext = 0;
-  for (pp = &idequeue; *pp; pp = &(*pp)->qnext) // DOC:insert-queue
+  // Insert b into idequeue, behind the bufs of the current command and
+  // in sweep order after them.
+  b->qtime = ticks;
+  for (pp = &idequeue, i = 0; *pp && i < ideleft; pp = &(*pp)->qnext, i++)
+    pos = (*pp)->blockno;
+  for (; *pp && idekey(*pp, pos) <= idekey(b, pos); pp = &(*pp)->qnext) // DOC:insert-queue
     ;
+  b->qnext = *pp;
   *pp = b;
 
   // Start disk if necessary.
   if (idequeue == b)
     idestart(b);
+}
+
+// Start reading locked buf b from disk and return. The interrupt handler
+// sets B_VALID and releases b when the data is in.
+void iderwasync(struct buf *b) {
+  if (b->flags & (B_VALID | B_DIRTY))
+    panic("iderwasync: not a read");
+  if (idevirtio) {
+    b->flags |= B_ASYNC;
+    virtiorw(&b, 1);
+    return;
+  }
+
+  acquire(&idelock);
+  b->flags |= B_ASYNC;
+  ideappend(b);
+  release(&idelock);
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void iderw(struct buf *b) {
+  if (idevirtio) {
+    virtiorw(&b, 1);
+    return;
+  }
+  acquire(&idelock); // DOC:acquire-lock
+
+  ideappend(b);
 
   // Wait for request to finish.
   while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID) {
@@ -157,3 +377,21 @@ void iderw(struct buf *b) {
 
   release(&idelock);
 }
+
+// Sync the n locked bufs of bs with disk, as iderw does. They are all
+// queued before waiting, so the disk can merge and order them.
+void iderwv(struct buf **bs, int n) {
+  int i;
+
+  if (idevirtio) {
+    virtiorw(bs, n);
+    return;
+  }
+  acquire(&idelock);
+  for (i = 0; i < n; i++)
+    ideappend(bs[i]);
+  for (i = 0; i < n; i++)
+    while ((bs[i]->flags & (B_VALID | B_DIRTY)) != B_VALID)
+      sleep(bs[i], &idelock);
+  release(&idelock);
+}
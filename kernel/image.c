@@ -0,0 +1,235 @@
+// Exec image cache.
+//
+// Keeps the pages of recently exec'd programs, keyed by container and
+// inode. Programs are paged in on demand, see vspacedemandload, and each
+// page read from the file is added to the program's image. A new address
+// space running a cached program maps the pages already in the image
+// instead of reading them again: pages of read-only segments are shared
+// read-only, pages of writable segments are shared copy-on-write. The
+// cache holds one core_map reference to each frame and every mapping holds
+// another, so a frame lives until the last user and the cache have both
+// let go of it.
+//
+// readi reads the disk of the caller's container, so the same inode can
+// hold different programs in different containers. writei drops the
+// images of an inode it changes. A container disk that is (re)initialized,
+// or that a guest writes through its paravirtual block ring (blkrun),
+// drops all images of that container.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <vspace.h>
+
+#define NIMAGE 8           // programs cached
+#define IMAGE_MAXPAGES 64  // larger programs are loaded the usual way
+
+struct image {
+  int valid;
+  int cid;                        // container whose disk it was read from
+  uint dev;
+  uint inum;
+  uint size;                      // file size when it was loaded
+  uint64_t sz;                    // bytes of code region, as vspaceloadcode returns
+  uint64_t entry;
+  int nsegs;
+  struct vsegment segs[NVSEGMENTS];
+  uint npages;
+  uint64_t ppn[IMAGE_MAXPAGES];   // 0 for a page that is not loaded
+  uint lastuse;                   // for LRU replacement
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct image images[NIMAGE];
+} imgcache;
+
+int num_image_hits = 0;
+
+void
+imageinit(void)
+{
+  initlock(&imgcache.lock, "imgcache");
+}
+
+static struct image *
+imagefind(int cid, struct inode *ip)
+{
+  struct image *im;
+
+  for (im = imgcache.images; im < &imgcache.images[NIMAGE]; im++)
+    if (im->valid && im->cid == cid && im->dev == ip->dev &&
+        im->inum == ip->inum && im->size == ip->size)
+      return im;
+  return 0;
+}
+
+// Drops the cache's references to the frames of im.
+// The imgcache lock must be held.
+static void
+imageevict(struct image *im)
+{
+  for (uint i = 0; i < im->npages; i++)
+    if (im->ppn[i])
+      kfree(P2V(im->ppn[i] << PT_SHIFT));
+  im->valid = 0;
+}
+
+// Returns 1 if the page at va of im belongs to a writable segment.
+static int
+imagewritable(struct image *im, uint64_t va)
+{
+  for (int i = 0; i < im->nsegs; i++)
+    if (va >= im->segs[i].va && va < im->segs[i].va + im->segs[i].memsz)
+      return im->segs[i].writable;
+  return 0;
+}
+
+// Sets up the code region of vs for the cached program ip: its segments,
+// and mappings of the pages that are already loaded. Returns the code size
+// and sets *rip on a hit, 0 if ip is not cached.
+uint64_t
+imagemap(struct vspace *vs, struct inode *ip, uint64_t *rip)
+{
+  struct vregion *vr = &vs->regions[VR_CODE];
+  struct vpage_info *vpi;
+  struct image *im;
+  uint64_t sz, va;
+
+  acquire(&imgcache.lock);
+  if ((im = imagefind(myproc()->cid, ip)) == 0) {
+    release(&imgcache.lock);
+    return 0;
+  }
+
+  // the last page allocates every vpi page in front of it
+  if (im->npages > 0 && va2vpage_info(vr, (uint64_t) (im->npages - 1) * PGSIZE) == 0) {
+    release(&imgcache.lock);
+    return 0;
+  }
+
+  for (uint i = 0; i < im->npages; i++) {
+    if (im->ppn[i] == 0)
+      continue;
+    va = (uint64_t) i * PGSIZE;
+    vpi = va2vpage_info(vr, va);
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->writable = 0;
+    vpi->cow = imagewritable(im, va);
+    vpi->ppn = im->ppn[i];
+    kincref(im->ppn[i] << PT_SHIFT);
+  }
+
+  vs->nsegs = im->nsegs;
+  memmove(vs->segs, im->segs, sizeof(im->segs));
+  im->lastuse = ++imgcache.clock;
+  num_image_hits++;
+  sz = im->sz;
+  *rip = im->entry;
+  release(&imgcache.lock);
+  return sz;
+}
+
+// Starts an empty image for the program whose segments were just read
+// from ip into vs. Its pages are added as they are paged in.
+void
+imageadd(struct vspace *vs, struct inode *ip, uint64_t sz, uint64_t entry)
+{
+  struct image *im, *victim;
+  uint npages = PGROUNDUP(sz) / PGSIZE;
+
+  if (npages > IMAGE_MAXPAGES)
+    return;
+
+  acquire(&imgcache.lock);
+  // someone else loaded it at the same time
+  if (imagefind(myproc()->cid, ip)) {
+    release(&imgcache.lock);
+    return;
+  }
+
+  victim = 0;
+  for (im = imgcache.images; im < &imgcache.images[NIMAGE]; im++) {
+    if (!im->valid) {
+      victim = im;
+      break;
+    }
+    if (victim == 0 || im->lastuse < victim->lastuse)
+      victim = im;
+  }
+  if (victim->valid)
+    imageevict(victim);
+
+  im = victim;
+  im->cid = myproc()->cid;
+  im->dev = ip->dev;
+  im->inum = ip->inum;
+  im->size = ip->size;
+  im->sz = sz;
+  im->entry = entry;
+  im->nsegs = vs->nsegs;
+  memmove(im->segs, vs->segs, sizeof(im->segs));
+  im->npages = npages;
+  memset(im->ppn, 0, sizeof(im->ppn));
+  im->lastuse = ++imgcache.clock;
+  im->valid = 1;
+  release(&imgcache.lock);
+}
+
+// Returns the cached frame of page va of program ip loaded by container
+// cid with a reference taken for the caller, or 0 if it is not cached.
+uint64_t
+imagegetpage(int cid, struct inode *ip, uint64_t va)
+{
+  struct image *im;
+  uint64_t ppn = 0;
+  uint i = va / PGSIZE;
+
+  acquire(&imgcache.lock);
+  if ((im = imagefind(cid, ip)) != 0 && i < im->npages && im->ppn[i]) {
+    ppn = im->ppn[i];
+    kincref(ppn << PT_SHIFT);
+  }
+  release(&imgcache.lock);
+  return ppn;
+}
+
+// Offers frame ppn, just read for page va of program ip, to the image of
+// ip. Returns 1 if the image took a reference to it, 0 otherwise.
+int
+imageputpage(int cid, struct inode *ip, uint64_t va, uint64_t ppn)
+{
+  struct image *im;
+  uint i = va / PGSIZE;
+  int r = 0;
+
+  acquire(&imgcache.lock);
+  if ((im = imagefind(cid, ip)) != 0 && i < im->npages && im->ppn[i] == 0) {
+    im->ppn[i] = ppn;
+    kincref(ppn << PT_SHIFT);
+    r = 1;
+  }
+  release(&imgcache.lock);
+  return r;
+}
+
+// Drops the images of ip read from container cid, or every image of cid
+// if ip is 0.
+void
+imagedrop(int cid, struct inode *ip)
+{
+  struct image *im;
+
+  acquire(&imgcache.lock);
+  for (im = imgcache.images; im < &imgcache.images[NIMAGE]; im++)
+    if (im->valid && im->cid == cid &&
+        (ip == 0 || (im->dev == ip->dev && im->inum == ip->inum)))
+      imageevict(im);
+  release(&imgcache.lock);
+}
@@ -10,7 +10,7 @@
 #include <param.h>
 #include <spinlock.h>
 
-int npages = 0;
+uint64_t npages = 0;
 int pages_in_use;
 int pages_in_swap;
 int free_pages;
@@ -36,57 +36,132 @@ uint64_t page2pa(struct core_map_entry *pp) {
 void detect_memory(void) {
   uint32_t i;
   struct e820_entry *e;
-  size_t mem = 0, mem_max = -KERNBASE;
+  uint64_t mem = 0, avail = 0;
 
+  // Only RAM counts; reserved ranges and holes stay out of the allocator.
   e = e820_map.entries;
   for (i = 0; i != e820_map.nr; ++i, ++e) {
-    if (e->addr >= mem_max)
+    if (e->type != E820_AVAILABLE || e->addr >= MAXPHYSMEM)
       continue;
-    mem = max(mem, (size_t)(e->addr + e->len));
+    mem = max(mem, min(e->addr + e->len, MAXPHYSMEM));
+    avail += min(e->addr + e->len, MAXPHYSMEM) - e->addr;
   }
 
-  // Limit memory to 256MB.
-  mem = min(mem, mem_max);
   npages = mem / PGSIZE;
-  cprintf("E820: physical memory %dMB\n", mem / 1024 / 1024);
+  cprintf("E820: physical memory %dMB, %dMB usable\n", mem / 1024 / 1024,
+          avail / 1024 / 1024);
 }
 
-void freerange(void *vstart, void *vend);
+void freerange(uint64_t pstart, uint64_t pend);
 extern char end[]; // first address after kernel loaded from ELF file
 
+// Free pages are kept on a doubly linked list threaded through their
+// core_map entries, so kalloc takes the head instead of searching
+// core_map. Pages freed while the allocator starts up go to the tail, so
+// low pages are handed out first; later frees go to the head. hpfree
+// counts the free pages of each 2MB run for kallochuge.
 struct {
   struct spinlock lock;
   int use_lock;
+  uint freelist;   // first free page (ppn + 1), 0 if none
+  uint freetail;   // last free page (ppn + 1)
+  ushort *hpfree;  // free pages in each HPGPAGES run
 } kmem;
 
+// Start of the pages the allocator owns, after the kernel, core_map and
+// hpfree.
+static uint64_t pfree;
+
+static void freepage(char *v, int tail);
+
 // Initialization happens in two phases.
-// 1. main() calls kinit1() while still using entrypgdir to place just
-// the pages mapped by entrypgdir on free list.
-// 2. main() calls kinit2() with the rest of the physical pages
-// after installing a full page table that maps them on all cores.
+// 1. main() calls mem_init() while still using the boot page table to
+// place just the pages it maps, the first BOOTMAPPED bytes, on the free
+// list.
+// 2. main() calls mem_init_high() with the rest of the physical pages
+// after installing a full page table that maps them all.
 void mem_init(void *vstart) {
-  void *vend;
-
-  core_map = vstart;
-  memset(vstart, 0, PGROUNDUP(npages * sizeof(struct core_map_entry)));
-  vstart += PGROUNDUP(npages * sizeof(struct core_map_entry));
+  uint64_t size = npages * sizeof(struct core_map_entry);
+  uint64_t hpsize = (npages / HPGPAGES + 1) * sizeof(ushort);
+
+  // core_map and hpfree sit right after the kernel
+  core_map = P2V(V2P(vstart));
+  kmem.hpfree = (ushort *) ((char *) core_map + size);
+  size = PGROUNDUP(size + hpsize);
+  memset(core_map, 0, size);
+  kmem.freelist = kmem.freetail = 0;
+  pfree = V2P(vstart) + size;
+  if (pfree > BOOTMAPPED)
+    panic("mem_init: core_map does not fit in the boot map");
 
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
 
-  vend = (void *)P2V((uint64_t)(npages * PGSIZE));
-  freerange(vstart, vend);
-  free_pages = (vend - vstart) >> PT_SHIFT;
+  free_pages = 0;
+  freerange(pfree, BOOTMAPPED);
   pages_in_use = 0;
   pages_in_swap = 0;
   kmem.use_lock = 1;
 }
 
-void freerange(void *vstart, void *vend) {
-  char *p;
-  p = (char *)PGROUNDUP((uint64_t)vstart);
-  for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-    kfree(p);
+void mem_init_high(void) {
+  int in_use = pages_in_use;
+
+  freerange(max(pfree, BOOTMAPPED), (uint64_t) npages * PGSIZE);
+  pages_in_use = in_use;
+}
+
+// Frees the RAM pages of physical [pstart, pend).
+void freerange(uint64_t pstart, uint64_t pend) {
+  struct e820_entry *e;
+  uint64_t p, lo, hi;
+  uint32_t i;
+
+  e = e820_map.entries;
+  for (i = 0; i != e820_map.nr; ++i, ++e) {
+    if (e->type != E820_AVAILABLE)
+      continue;
+    lo = PGROUNDUP(max(e->addr, pstart));
+    hi = PGROUNDDOWN(min(e->addr + e->len, pend));
+    for (p = lo; p + PGSIZE <= hi; p += PGSIZE)
+      freepage(P2V(p), 1);
+  }
+}
+
+// Puts page r on the free list, at the tail if tail is set.
+static void freelist_add(struct core_map_entry *r, int tail) {
+  uint ppn1 = r - core_map + 1;
+
+  if (tail) {
+    r->next = 0;
+    r->prev = kmem.freetail;
+  } else {
+    r->next = kmem.freelist;
+    r->prev = 0;
+  }
+  if (r->prev)
+    core_map[r->prev - 1].next = ppn1;
+  else
+    kmem.freelist = ppn1;
+  if (r->next)
+    core_map[r->next - 1].prev = ppn1;
+  else
+    kmem.freetail = ppn1;
+  kmem.hpfree[(ppn1 - 1) / HPGPAGES]++;
+}
+
+// Takes page r off the free list.
+static void freelist_remove(struct core_map_entry *r) {
+  if (r->prev)
+    core_map[r->prev - 1].next = r->next;
+  else
+    kmem.freelist = r->next;
+  if (r->next)
+    core_map[r->next - 1].prev = r->prev;
+  else
+    kmem.freetail = r->prev;
+  r->next = r->prev = 0;
+  kmem.hpfree[(r - core_map) / HPGPAGES]--;
 }
 
 // Free the page of physical memory pointed at by v,
@@ -94,9 +169,13 @@ void freerange(void *vstart, void *vend) {
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
 void kfree(char *v) {
+  freepage(v, 0);
+}
+
+static void freepage(char *v, int tail) {
   struct core_map_entry *r;
 
-  if ((uint64_t)v % PGSIZE || v < _end || V2P(v) >= (uint64_t)(npages * PGSIZE))
+  if ((uint64_t)v % PGSIZE || V2P(v) < V2P(_end) || V2P(v) >= npages * PGSIZE)
     panic("kfree");
 
   if (kmem.use_lock)
@@ -110,6 +189,8 @@ void kfree(char *v) {
       release(&kmem.lock);
     return;
   }
+  if (r->available)
+    panic("kfree: page is already free");
 
   pages_in_use--;
   free_pages++;
@@ -121,6 +202,7 @@ void kfree(char *v) {
   r->user = 0;
   r->va = 0;
   r->ref = 0;
+  freelist_add(r, tail);
   if (kmem.use_lock)
     release(&kmem.lock);
 }
@@ -153,27 +235,55 @@ mark_kernel_mem(uint64_t pa)
 }
 
 char *kalloc(void) {
+  struct core_map_entry *r;
+
+  if (kmem.use_lock)
+    acquire(&kmem.lock);
+
+  if (kmem.freelist == 0) {
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    return 0;
+  }
+  r = &core_map[kmem.freelist - 1];
+  freelist_remove(r);
+  r->available = 0;
+  r->ref = 1;
   pages_in_use++;
   free_pages--;
 
-  int i;
+  if (kmem.use_lock)
+    release(&kmem.lock);
+  return P2V(page2pa(r));
+}
+
+// Allocate HPGPAGES physically contiguous pages starting at a 2MB
+// boundary, for a 2MB mapping. Each page gets its own reference, so they
+// are freed one by one with kfree. Searches from the top of memory down,
+// away from where kalloc takes single pages. Returns 0 if there is no free
+// 2MB run. Only the free page count of each run is looked at.
+char *kallochuge(void) {
+  int i, j;
 
   if (kmem.use_lock)
     acquire(&kmem.lock);
 
-  for (i = 0; i < npages; i++) {
-    if (core_map[i].available == 1) {
-      core_map[i].available = 0;
-      if (kmem.use_lock)
-        release(&kmem.lock);
-
-      core_map[i].ref = 1;
-      return P2V(page2pa(&core_map[i]));
+  for (i = (int) (npages / HPGPAGES) * HPGPAGES - HPGPAGES; i >= 0; i -= HPGPAGES) {
+    if (kmem.hpfree[i / HPGPAGES] < HPGPAGES)
+      continue;
+    for (j = 0; j < HPGPAGES; j++) {
+      freelist_remove(&core_map[i + j]);
+      core_map[i + j].available = 0;
+      core_map[i + j].ref = 1;
     }
+    pages_in_use += HPGPAGES;
+    free_pages -= HPGPAGES;
+    if (kmem.use_lock)
+      release(&kmem.lock);
+    return P2V(page2pa(&core_map[i]));
   }
 
   if (kmem.use_lock)
     release(&kmem.lock);
-
   return 0;
 }
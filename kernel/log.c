@@ -0,0 +1,273 @@
+// Write-ahead log.
+//
+// File system updates are grouped into transactions. A system call that
+// changes the file system brackets its changes with begin_op and end_op,
+// and writes each changed buffer with log_write instead of bwrite. The
+// buffer stays pinned in the buffer cache and its block number is added
+// to the in-memory log header; a block written again is absorbed into
+// the same slot.
+//
+// A transaction is not committed when its end_op returns. Transactions
+// pile up in the log until there is no room for another one, or until
+// logsync is called by the flusher, fsync or sync, and are then committed
+// together: one pass writes all of their blocks to the log, one write of
+// the header commits them, and then the blocks are installed in place.
+// A crash before the header write loses the whole group; a crash after
+// it is repaired on the next boot by replaying the log.
+//
+// The log is a fixed region at the end of the disk, described by the
+// super block: a header block followed by LOGSIZE blocks of contents.
+//
+//   header | block 0 | block 1 | ... | block LOGSIZE-1
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <param.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#include <buf.h>
+
+extern struct superblock sb;
+
+// Contents of the header block, on disk and in memory.
+struct logheader {
+  int n;
+  int block[LOGSIZE];
+};
+
+struct log {
+  struct spinlock lock;
+  int start;
+  int size;
+  int outstanding; // how many FS sys calls are executing
+  int committing;  // in commit(), or waiting to commit; ops must wait
+  int dev;
+  struct logheader lh;
+};
+struct log log;
+
+int num_log_commits = 0;
+
+static void recover_from_log(void);
+static void commit(void);
+
+void initlog(int dev) {
+  if (sizeof(struct logheader) >= BSIZE)
+    panic("initlog: too big logheader");
+
+  initlock(&log.lock, "log");
+  log.start = sb.logstart;
+  log.size = sb.nlog;
+  log.dev = dev;
+  if (log.size < LOGSIZE + 1)
+    panic("initlog: log region too small");
+  recover_from_log();
+}
+
+// Copy committed blocks from the log to their home location, in the
+// order of their block numbers, and wait for them to reach the disk.
+// They are written as one batch, so neighbours go out together.
+static void install_trans(int recovering) {
+  int tail;
+  uint lo = ~0U, hi = 0;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *lbuf = bread(log.dev, log.start + tail + 1); // log block
+    struct buf *dbuf = bread(log.dev, log.lh.block[tail]);   // home block
+    memmove(dbuf->data, lbuf->data, BSIZE);
+    bwrite(dbuf);
+    if (!recovering)
+      bunpin(dbuf);
+    brelse(lbuf);
+    brelse(dbuf);
+    lo = min(lo, (uint) log.lh.block[tail]);
+    hi = max(hi, (uint) log.lh.block[tail] + 1);
+  }
+  if (lo < hi)
+    bflush(log.dev, lo, hi);
+}
+
+// Read the log header from disk into the in-memory log header.
+static void read_head(void) {
+  struct buf *buf = bread(log.dev, log.start);
+  struct logheader *lh = (struct logheader *)(buf->data);
+  int i;
+
+  log.lh.n = lh->n;
+  if (log.lh.n < 0 || log.lh.n > LOGSIZE)
+    log.lh.n = 0;
+  for (i = 0; i < log.lh.n; i++)
+    log.lh.block[i] = lh->block[i];
+  brelse(buf);
+}
+
+// Write the in-memory log header to disk. This is the point at which
+// the current transactions commit.
+static void write_head(void) {
+  struct buf *buf = bread(log.dev, log.start);
+  struct logheader *hb = (struct logheader *)(buf->data);
+  int i;
+
+  hb->n = log.lh.n;
+  for (i = 0; i < log.lh.n; i++)
+    hb->block[i] = log.lh.block[i];
+  bwritesync(buf);
+  brelse(buf);
+}
+
+static void recover_from_log(void) {
+  read_head();
+  if (log.lh.n > 0)
+    cprintf("log: replaying %d blocks\n", log.lh.n);
+  install_trans(1); // if committed, copy from log to disk
+  log.lh.n = 0;
+  write_head(); // clear the log
+}
+
+// Called at the start of each FS system call.
+void begin_op(void) {
+  acquire(&log.lock);
+  while (1) {
+    if (log.committing) {
+      sleep(&log, &log.lock);
+    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
+      if (log.outstanding > 0) {
+        // the last op to end commits and makes room
+        sleep(&log, &log.lock);
+        continue;
+      }
+      log.committing = 1;
+      release(&log.lock);
+      commit();
+      acquire(&log.lock);
+      log.committing = 0;
+      wakeup(&log);
+    } else {
+      log.outstanding += 1;
+      release(&log.lock);
+      break;
+    }
+  }
+}
+
+// Called at the end of each FS system call.
+// Commits if this was the last outstanding operation and the log has no
+// room for another one.
+void end_op(void) {
+  int do_commit = 0;
+
+  acquire(&log.lock);
+  log.outstanding -= 1;
+  if (log.outstanding == 0 && !log.committing &&
+      log.lh.n + MAXOPBLOCKS > LOGSIZE) {
+    do_commit = 1;
+    log.committing = 1;
+  } else {
+    // begin_op() or logsync() may be waiting for log space or for the
+    // outstanding ops to drain.
+    wakeup(&log);
+  }
+  release(&log.lock);
+
+  if (do_commit) {
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    commit();
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+  }
+}
+
+// Commit the transactions in the log once the running ones have ended.
+void logsync(void) {
+  if (log.size == 0)
+    return; // not initialized yet
+
+  acquire(&log.lock);
+  while (log.committing)
+    sleep(&log, &log.lock);
+  if (log.lh.n == 0 && log.outstanding == 0) {
+    release(&log.lock);
+    return;
+  }
+  // new ops wait while the running ones drain
+  log.committing = 1;
+  while (log.outstanding > 0)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+
+  commit();
+
+  acquire(&log.lock);
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Copy modified blocks from cache to log.
+static void write_log(void) {
+  int tail;
+
+  for (tail = 0; tail < log.lh.n; tail++) {
+    struct buf *to = bread(log.dev, log.start + tail + 1); // log block
+    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+    memmove(to->data, from->data, BSIZE);
+    bwrite(to);
+    brelse(from);
+    brelse(to);
+  }
+  // the log blocks are contiguous; write them as one sorted batch
+  bflush(log.dev, log.start + 1, log.start + 1 + log.lh.n);
+}
+
+static void commit(void) {
+  int i, j, b;
+
+  if (log.lh.n == 0)
+    return;
+  // sort by home block so installing sweeps the disk once
+  for (i = 1; i < log.lh.n; i++) {
+    b = log.lh.block[i];
+    for (j = i; j > 0 && log.lh.block[j - 1] > b; j--)
+      log.lh.block[j] = log.lh.block[j - 1];
+    log.lh.block[j] = b;
+  }
+  write_log();      // Write modified blocks from cache to log
+  write_head();     // Write header to disk -- the real commit
+  install_trans(0); // Now install writes to home locations
+  log.lh.n = 0;
+  write_head(); // Erase the transaction from the log
+  num_log_commits += 1;
+}
+
+// Caller has modified b->data and is done with the buffer.
+// Record the block number and pin in the cache until commit.
+// log_write() replaces bwrite(); a typical use is:
+//   bp = bread(...)
+//   modify bp->data[]
+//   log_write(bp)
+//   brelse(bp)
+void log_write(struct buf *b) {
+  int i;
+
+  acquire(&log.lock);
+  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+    panic("too big a transaction");
+  if (log.outstanding < 1)
+    panic("log_write outside of trans");
+
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno) // log absorption
+      break;
+  }
+  log.lh.block[i] = b->blockno;
+  if (i == log.lh.n) { // Add new block to log?
+    bpin(b);
+    log.lh.n++;
+  }
+  release(&log.lock);
+}
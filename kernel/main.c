@@ -13,6 +13,7 @@ int main(uint64_t addr) {
   detect_memory();
   mem_init(_end); // phys page allocator
   vspacebootinit();
+  mem_init_high(); // memory past the boot map
   mpinit();
   lapicinit();
   picinit();
@@ -26,8 +27,11 @@ int main(uint64_t addr) {
   pinit();
   tvinit();   // trap vectors
   binit();    // buffer cache
+  imageinit(); // exec image cache
+  pcinit();   // page cache
   ideinit();  // disk
   userinit(); // first user process
+  kthread(bflusher, "bflush"); // writes dirty buffers back
   mpmain();
   fileinit();
   return 0;
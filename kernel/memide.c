@@ -45,6 +45,7 @@ void iderw(struct buf *b) {
     panic("iderw: block out of range");
 
   p = memdisk + b->blockno * BSIZE;
+  num_disk_requests += 1;
 
   if (b->flags & B_DIRTY) {
     b->flags &= ~B_DIRTY;
@@ -53,3 +54,14 @@ void iderw(struct buf *b) {
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+void iderwv(struct buf **bs, int n) {
+  for (int i = 0; i < n; i++)
+    iderw(bs[i]);
+}
+
+// The memory disk is never busy; read b now and release it.
+void iderwasync(struct buf *b) {
+  iderw(b);
+  brelse(b);
+}
@@ -0,0 +1,382 @@
+// Page cache.
+//
+// Caches whole pages of files, keyed by container, inode and page number,
+// on top of the buffer cache. readi and writei copy through these pages,
+// so a file read twice costs one trip to the disk, and file mmap maps the
+// same frames into user space: shared mappings write straight into the
+// cache, private ones map it copy-on-write. Either way readi sees what a
+// shared mapping wrote.
+//
+// A page holds one core_map reference for the cache and one per mapping,
+// so a page with a frame reference count of 1 is not mapped anywhere and
+// can be recycled. writei writes through to the log. Pages written through
+// a shared mapping are marked dirty when the mapping first writes them and
+// go through the log in a transaction of their own on msync, munmap, exit
+// or exec. A dirty page is never recycled: pcget may run inside its
+// caller's transaction or under an inode lock, where it can start none.
+//
+// Interface:
+// * pcread and pcwrite back readi and writei.
+// * pcmap returns a referenced frame holding a file page, to be mapped.
+// * pcdirty marks a mapped page dirty, pcsync writes it back.
+// * pcdrop forgets pages of disk blocks that were written behind the
+//   cache's back, e.g. a container disk that is (re)initialized.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <file.h>
+#include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+
+#include <buf.h>
+
+#define NPCACHE 256       // file pages cached
+#define NPCHASH 61        // hash chains
+
+struct cpage {
+  int valid;              // in the hash, holding the page below
+  int cid;                // container whose disk the page is from
+  uint dev;
+  uint inum;
+  uint pgno;              // page of the file
+  uint blockno;           // disk block of the first byte of the page, 0 if
+                          // the file has no blocks there yet
+  uint nblocks;           // blocks of the page that are inside the file
+  uint64_t ppn;           // 0 until a frame is allocated
+  int loaded;             // the frame holds the page
+  int dirty;              // a shared mapping wrote it since it was written back
+  int refcnt;             // callers using the entry
+  uint lastuse;           // for LRU replacement
+  struct cpage *hnext;    // hash chain
+  struct sleeplock lock;  // held while the page is read, written or copied
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct cpage pages[NPCACHE];
+  struct cpage *hash[NPCHASH];
+} pcache;
+
+int num_pcache_hits = 0;
+
+void
+pcinit(void)
+{
+  struct cpage *cp;
+
+  initlock(&pcache.lock, "pcache");
+  for (cp = pcache.pages; cp < &pcache.pages[NPCACHE]; cp++)
+    initsleeplock(&cp->lock, "cpage");
+}
+
+static uint
+pchash(int cid, uint dev, uint inum, uint pgno)
+{
+  return (cid * 31 + dev * 17 + inum * 7 + pgno) % NPCHASH;
+}
+
+// Removes cp from its hash chain. The pcache lock must be held.
+static void
+pcunhash(struct cpage *cp)
+{
+  struct cpage **pp;
+
+  for (pp = &pcache.hash[pchash(cp->cid, cp->dev, cp->inum, cp->pgno)]; *pp; pp = &(*pp)->hnext) {
+    if (*pp == cp) {
+      *pp = cp->hnext;
+      break;
+    }
+  }
+  cp->hnext = 0;
+  cp->valid = 0;
+  cp->loaded = 0;
+}
+
+// Returns the disk block of the first byte of page pgno of ip, or 0 if
+// ip has no blocks there. Extents are whole pages, so the rest of the
+// page follows it.
+static uint
+pcblockno(struct inode *ip, uint pgno)
+{
+  uint b = bmap(ip, pgno * PGBLOCKS, 0);
+
+  return b ? b + (myproc()->cid + 1)*UDISKSIZE : 0;
+}
+
+static int
+pcmapped(struct cpage *cp)
+{
+  return cp->ppn && pa2page(cp->ppn << PT_SHIFT)->ref > 1;
+}
+
+// Logs the blocks of locked page cp that are inside the file. Must be
+// called inside a transaction; a page is PGBLOCKS <= MAXOPBLOCKS blocks.
+static void
+pcwriteback(struct cpage *cp)
+{
+  struct buf *b;
+  char *mem = P2V(cp->ppn << PT_SHIFT);
+
+  for (uint i = 0; i < cp->nblocks; i++) {
+    b = bread(ROOTDEV, cp->blockno + i);
+    memmove(b->data, mem + i * BSIZE, BSIZE);
+    log_write(b);
+    brelse(b);
+  }
+  cp->dirty = 0;
+}
+
+static void
+pcrelease(struct cpage *cp)
+{
+  releasesleep(&cp->lock);
+  acquire(&pcache.lock);
+  cp->refcnt--;
+  release(&pcache.lock);
+}
+
+// Returns the locked entry of page pgno of ip, read from the caller's
+// container disk, with the page loaded. Returns 0 if every entry is in use
+// or mapped, or there is no memory for the page.
+static struct cpage *
+pcget(struct inode *ip, uint pgno)
+{
+  struct cpage *cp, *victim;
+  int cid = myproc()->cid;
+  uint h = pchash(cid, ip->dev, ip->inum, pgno);
+  uint end;
+  struct buf *bs[PGBLOCKS];
+  char *mem;
+
+  acquire(&pcache.lock);
+  for (cp = pcache.hash[h]; cp; cp = cp->hnext) {
+    if (cp->valid && cp->cid == cid && cp->dev == ip->dev && cp->inum == ip->inum &&
+        cp->pgno == pgno) {
+      cp->refcnt++;
+      cp->lastuse = ++pcache.clock;
+      release(&pcache.lock);
+      acquiresleep(&cp->lock);
+      if (cp->loaded) {
+        num_pcache_hits++;
+        return cp;
+      }
+      goto load;
+    }
+  }
+
+  // recycle the least recently used clean page nobody maps
+  victim = 0;
+  for (cp = pcache.pages; cp < &pcache.pages[NPCACHE]; cp++)
+    if (cp->refcnt == 0 && !cp->dirty && !pcmapped(cp) &&
+        (victim == 0 || cp->lastuse < victim->lastuse))
+      victim = cp;
+  if (victim == 0) {
+    release(&pcache.lock);
+    return 0;
+  }
+
+  if (victim->valid)
+    pcunhash(victim);
+  cp = victim;
+  cp->valid = 1;
+  cp->cid = cid;
+  cp->dev = ip->dev;
+  cp->inum = ip->inum;
+  cp->pgno = pgno;
+  cp->refcnt = 1;
+  cp->lastuse = ++pcache.clock;
+  cp->hnext = pcache.hash[h];
+  pcache.hash[h] = cp;
+  release(&pcache.lock);
+  acquiresleep(&cp->lock);
+
+ load:
+  if (cp->ppn == 0) {
+    if ((mem = kalloc()) == 0) {
+      pcrelease(cp);
+      return 0;
+    }
+    cp->ppn = PGNUM(V2P(mem));
+  }
+  mem = P2V(cp->ppn << PT_SHIFT);
+  memset(mem, 0, PGSIZE);
+
+  cp->blockno = pcblockno(ip, pgno);
+  cp->nblocks = 0;
+  if ((uint64_t) pgno * PGSIZE < ip->size) {
+    end = min((uint64_t) ip->size - (uint64_t) pgno * PGSIZE, (uint64_t) PGSIZE);
+    cp->nblocks = (end + BSIZE - 1) / BSIZE;
+  }
+  // one disk request for the blocks of the page that are not cached
+  breadn(ip->dev, cp->blockno, cp->nblocks, bs);
+  for (uint i = 0; i < cp->nblocks; i++) {
+    memmove(mem + i * BSIZE, bs[i]->data, BSIZE);
+    brelse(bs[i]);
+  }
+  cp->loaded = 1;
+  cp->dirty = 0;
+  return cp;
+}
+
+// Reads [off, off + n) of ip, which must be inside the file, into dst.
+// Pages the cache cannot hold are read block by block.
+int
+pcread(struct inode *ip, char *dst, uint off, uint n)
+{
+  struct cpage *cp;
+  struct buf *bp;
+  uint tot, m, cid = myproc()->cid;
+
+  for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    if ((cp = pcget(ip, off / PGSIZE)) != 0) {
+      m = min(n - tot, PGSIZE - off % PGSIZE);
+      memmove(dst, P2V(cp->ppn << PT_SHIFT) + off % PGSIZE, m);
+      pcrelease(cp);
+      continue;
+    }
+    bp = bread(ip->dev, bmap(ip, off / BSIZE, 0) + (cid + 1)*UDISKSIZE);
+    m = min(n - tot, BSIZE - off % BSIZE);
+    memmove(dst, bp->data + off % BSIZE, m);
+    brelse(bp);
+  }
+  return n;
+}
+
+// Writes src to [off, off + n) of ip, through the cache to the log. The
+// caller is inside a transaction and updates the file size afterwards.
+int
+pcwrite(struct inode *ip, char *src, uint off, uint n)
+{
+  struct cpage *cp;
+  struct buf *bp;
+  uint tot, m, b, nb, cid = myproc()->cid;
+  uint64_t size = max((uint64_t) ip->size, (uint64_t) off + n);
+  char *mem;
+
+  for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    if ((cp = pcget(ip, off / PGSIZE)) != 0) {
+      m = min(n - tot, PGSIZE - off % PGSIZE);
+      mem = P2V(cp->ppn << PT_SHIFT);
+      memmove(mem + off % PGSIZE, src, m);
+      // cached before writei gave the file blocks here
+      if (cp->blockno == 0)
+        cp->blockno = pcblockno(ip, cp->pgno);
+      nb = (min(size - (uint64_t) cp->pgno * PGSIZE, (uint64_t) PGSIZE) + BSIZE - 1) / BSIZE;
+      cp->nblocks = max(cp->nblocks, nb);
+      for (b = (off % PGSIZE) / BSIZE; b <= (off % PGSIZE + m - 1) / BSIZE; b++) {
+        bp = bread(ROOTDEV, cp->blockno + b);
+        memmove(bp->data, mem + b * BSIZE, BSIZE);
+        log_write(bp);
+        brelse(bp);
+      }
+      pcrelease(cp);
+      continue;
+    }
+    bp = bread(ROOTDEV, bmap(ip, off / BSIZE, 0) + (cid + 1)*UDISKSIZE);
+    m = min(n - tot, BSIZE - off % BSIZE);
+    memmove(bp->data + off % BSIZE, src, m);
+    log_write(bp);
+    brelse(bp);
+  }
+  return n;
+}
+
+// Returns the frame holding page pgno of ip with a reference taken for a
+// mapping, or 0 if the cache cannot hold it.
+uint64_t
+pcmap(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+  uint64_t ppn;
+
+  if ((cp = pcget(ip, pgno)) == 0)
+    return 0;
+  ppn = cp->ppn;
+  kincref(ppn << PT_SHIFT);
+  pcrelease(cp);
+  return ppn;
+}
+
+static struct cpage *
+pcfind(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+  int cid = myproc()->cid;
+
+  for (cp = pcache.hash[pchash(cid, ip->dev, ip->inum, pgno)]; cp; cp = cp->hnext)
+    if (cp->valid && cp->cid == cid && cp->dev == ip->dev && cp->inum == ip->inum &&
+        cp->pgno == pgno)
+      return cp;
+  return 0;
+}
+
+// Returns 1 if page pgno of ip is in the cache.
+int
+pccached(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+  int r;
+
+  acquire(&pcache.lock);
+  r = (cp = pcfind(ip, pgno)) != 0 && cp->loaded;
+  release(&pcache.lock);
+  return r;
+}
+
+// Marks page pgno of ip, which the caller maps, dirty.
+void
+pcdirty(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  if ((cp = pcfind(ip, pgno)) != 0)
+    cp->dirty = 1;
+  release(&pcache.lock);
+}
+
+// Writes page pgno of ip, which the caller maps and wrote, to the log. The
+// caller is not inside a transaction.
+void
+pcsync(struct inode *ip, uint pgno)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  if ((cp = pcfind(ip, pgno)) == 0) {
+    release(&pcache.lock);
+    return;
+  }
+  cp->refcnt++;
+  release(&pcache.lock);
+  // begin_op before the page lock: writei holds the log and then waits
+  // for page locks
+  begin_op();
+  acquiresleep(&cp->lock);
+  if (cp->loaded)
+    pcwriteback(cp);
+  pcrelease(cp);
+  end_op();
+}
+
+// Forgets the cached pages of disk blocks [blockno, blockno + n).
+void
+pcdrop(uint blockno, uint n)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  for (cp = pcache.pages; cp < &pcache.pages[NPCACHE]; cp++)
+    if (cp->valid && cp->refcnt == 0 &&
+        cp->blockno < blockno + n && cp->blockno + PGBLOCKS > blockno) {
+      pcunhash(cp);
+      cp->dirty = 0;
+    }
+  release(&pcache.lock);
+}
@@ -0,0 +1,49 @@
+// PCI configuration space, through the I/O ports of configuration
+// mechanism #1. Only what the disk drivers need to find their
+// controllers: probing for a device and reading and writing its
+// configuration registers.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <pci.h>
+#include <x86_64.h>
+
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+static uint pciaddr(struct pcidev *d, int reg) {
+  return 0x80000000 | d->bus << 16 | d->dev << 11 | d->func << 8 | (reg & 0xfc);
+}
+
+uint pciread(struct pcidev *d, int reg) {
+  outl(PCI_CONFIG_ADDR, pciaddr(d, reg));
+  return inl(PCI_CONFIG_DATA);
+}
+
+void pciwrite(struct pcidev *d, int reg, uint v) {
+  outl(PCI_CONFIG_ADDR, pciaddr(d, reg));
+  outl(PCI_CONFIG_DATA, v);
+}
+
+// Find the first function whose register reg, masked with mask, reads
+// val. Returns 0 and fills in *d if there is one, -1 if not.
+int pcifind(int reg, uint mask, uint val, struct pcidev *d) {
+  uint nfunc;
+
+  for (d->bus = 0; d->bus < 256; d->bus++) {
+    for (d->dev = 0; d->dev < 32; d->dev++) {
+      d->func = 0;
+      if ((pciread(d, PCI_ID) & 0xffff) == 0xffff)
+        continue; // no device
+      // multi-function devices have bit 7 of the header type set
+      nfunc = (pciread(d, PCI_HEADER) & 0x800000) ? 8 : 1;
+      for (d->func = 0; d->func < nfunc; d->func++) {
+        if ((pciread(d, PCI_ID) & 0xffff) == 0xffff)
+          continue;
+        if ((pciread(d, reg) & mask) == val)
+          return 0;
+      }
+    }
+  }
+  return -1;
+}
@@ -22,6 +22,7 @@ int nextpid = 1;
 int nextcid = 1;
 extern void forkret(void);
 extern void trapret(void);
+extern pml4e_t *kpml4;
 
 void wakeup1(void *chan);
 
@@ -40,6 +41,12 @@ struct proc *get_proc_arr(void) {
   return ptable.proc;
 }
 
+// Index of p in the process table. Used to key per-app tables, which must
+// stay bounded even though pids grow without limit.
+int procslot(struct proc *p) {
+  return p - ptable.proc;
+}
+
 void
 pinit(void)
 {
@@ -67,6 +74,18 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->cid = cid;
+  p->is_guest_os = 0;
+  p->napps = 0;
+  p->nqueued = 0;
+  p->guest = 0;
+  p->awaiting_guest = 0;
+  p->syscall_buffer = 0;
+  p->blkring = 0;
+  p->blk_avail = 0;
+  p->timer_deadline = 0;
+  p->timer_period = 0;
+  p->timer_pending = 0;
+  p->timer_overruns = 0;
 
   release(&ptable.lock);
 
@@ -124,6 +143,25 @@ userinit(void)
   release(&ptable.lock);
 }
 
+// Start a kernel thread running fn, which must never return. It has no
+// user address space and runs on the kernel page table.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  assertm((p = allocproc(0)) != 0, "kthread: no proc");
+  p->vspace.pgtbl = kpml4;
+  p->parent = 0;
+  // forkret returns into fn instead of trapret
+  *(uint64_t *)(p->context + 1) = (uint64_t)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
@@ -180,19 +218,25 @@ fork(void)
 
 // Almost identical to fork, except is used to kick off a guest OS, so it sets
 // the is_guest_os bit in the proc struct and allocates the given number of
-// pages into that process's page bitmap.
+// pages to that process as its lease (see leaseframe in guest.c). Any number
+// of guests can be started; once running, a guest is picked for new apps by
+// its load (see routeguest in guest.c).
 int
 fork_guest(int num_pages)
 {
   int pid = fork();
+  if (pid < 0)
+    return -1;
   struct proc* np = findproc(pid);
   acquire(&ptable.lock);
+
+  np->leases = 0;
+  np->nleases = 0;
+  memset(np->app_processes, 0, sizeof(np->app_processes));
  
-  // allocate user pages, set to 1 as owned
-  for (int i = 0; i < num_pages; i++) {
-    int ppn = PGNUM(V2P(kalloc()));
-    np->user_pages[ppn] = 1;
-  }
+  // lease user pages, idle in the guest's pool
+  for (int i = 0; i < num_pages && leaseframe(np) == 0; i++)
+    ;
 
   // set guest os status
   np->is_guest_os = 1;
@@ -213,6 +257,16 @@ exit(void)
   if(myproc() == initproc)
     panic("init exiting");
 
+  // Give guest-leased memory back to the owning guest os before the
+  // parent frees our address space; a dying guest os releases its apps.
+  if (myproc()->is_guest_os)
+    guest_exit(myproc());
+  else
+    guest_app_exit(myproc());
+
+  // Write back what we wrote through shared file mappings.
+  vspacemsync(&myproc()->vspace, MMAP_BASE, MMAP_TOP - MMAP_BASE);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(myproc()->ofile[fd]){
@@ -292,9 +346,6 @@ wait(void)
     }
 
     // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    if (myproc()->pid == SHELL_PID) {
-      cprintf("sleeping shell\n");
-    }
     sleep(myproc(), &ptable.lock);  //DOC: wait-sleep
   }
 }
@@ -472,18 +523,8 @@ wakeup1(void *chan)
 void
 wakeup(void *chan)
 {
-  if (findproc(GUEST_PID) == chan) {
-    cprintf("waking up guest in wak\n");
-  }
   acquire(&ptable.lock);
   wakeup1(chan);
-    if (findproc(GUEST_PID) == chan) {
-    cprintf("done waking up guest in wak\n");
-    if (findproc(GUEST_PID)->state == RUNNABLE) {
-      cprintf("guest is runnable\n");
-    }
-
-  }
   release(&ptable.lock);
 }
 
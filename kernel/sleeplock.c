@@ -29,6 +29,19 @@ void acquiresleep(struct sleeplock *lk) {
   release(&lk->lk);
 }
 
+// takes the lock only if it is free; returns 1 if it did
+int tryacquiresleep(struct sleeplock *lk) {
+  int r;
+
+  acquire(&lk->lk);
+  if ((r = !lk->locked)) {
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+  }
+  release(&lk->lk);
+  return r;
+}
+
 // a sleeping lock wakes up a waiting process, if any, on lock release
 void releasesleep(struct sleeplock *lk) {
   acquire(&lk->lk);
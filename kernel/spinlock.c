@@ -69,7 +69,7 @@ void getcallerpcs(void *v, uint64_t pcs[]) {
   asm volatile("mov %%rbp, %0" : "=r"(rbp));
 
   for (i = 0; i < 10; i++) {
-    if (rbp == 0 || rbp < (uint64_t *)KERNBASE ||
+    if (rbp == 0 || rbp < (uint64_t *)DIRECTMAP ||
         rbp == (uint64_t *)0xffffffffffffffff)
       break;
     pcs[i] = rbp[1];          // saved %eip
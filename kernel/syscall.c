@@ -16,18 +16,26 @@
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
 
+// Pages in the program pages of [addr, addr + size) that have not been
+// touched yet, so syscalls can use them without faulting while they hold
+// locks.
+static void
+pagein(uint64_t addr, uint64_t size)
+{
+  if (vspaceloadrange(&myproc()->vspace, addr, size) > 0)
+    vspaceinstall(myproc());
+}
+
 #define syscall_gen_fetcher(type) \
   int \
   fetch ## type(uint64_t addr, type *ip) \
   { \
     struct vregion *r; \
-    struct vspace *v; \
-    v = &myproc()->vspace; \
-    for (r = v->regions; r < &v->regions[NREGIONS]; r++) { \
-      if (vregioncontains(r, addr, sizeof(type))) { \
-        *ip = *(type *)(addr); \
-        return 0; \
-      } \
+    r = va2vregion(&myproc()->vspace, addr); \
+    if (r && vregioncontains(r, addr, sizeof(type))) { \
+      pagein(addr, sizeof(type)); \
+      *ip = *(type *)(addr); \
+      return 0; \
     } \
     return -1; \
   } \
@@ -48,18 +56,17 @@ int
 fetchstr(uint64_t addr, char **pp)
 {
   struct vregion *r;
-  struct vspace *v;
   char *s, *ep;
 
-  v = &myproc()->vspace;
-  for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
-    if (vregioncontains(r, addr, 0)) {
-      *pp = (char*)addr;
-      ep = (char *)VRTOP(r);
-      for(s = *pp; s < ep; s++) {
-        if(*s == 0)
-          return s - *pp;
-      }
+  r = va2vregion(&myproc()->vspace, addr);
+  if (r && vregioncontains(r, addr, 0)) {
+    *pp = (char*)addr;
+    ep = (char *)VRTOP(r);
+    for(s = *pp; s < ep; s++) {
+      if(s == *pp || (uint64_t)s % PGSIZE == 0)
+        pagein((uint64_t)s, 1);
+      if(*s == 0)
+        return s - *pp;
     }
   }
   return -1;
@@ -101,19 +108,17 @@ int argint64(int n, int64_t *ip) {
 int argptr(int n, char **pp, int size) {
   int64_t i;
   struct vregion *r;
-  struct vspace *v;
 
   if (argint64(n, &i) < 0)
     return -1;
   if (size < 0)
     return -1;
 
-  v = &myproc()->vspace;
-  for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
-    if (vregioncontains(r, i, size)) {
-      *pp = (char*)i;
-      return 0;
-    }
+  r = va2vregion(&myproc()->vspace, i);
+  if (r && vregioncontains(r, i, size)) {
+    pagein(i, size);
+    *pp = (char*)i;
+    return 0;
   }
   return -1;
 }
@@ -130,6 +135,8 @@ int argstr(int n, char **pp) {
   if (*pp != NULL) {
     // max string length is 510 by C89 standards
     for (int i = 0; i < 510; i++) {
+      if (i == 0 || (uint64_t)(*pp + i) % PGSIZE == 0)
+        pagein((uint64_t)(*pp + i), 1);
       if ((*pp)[i] == '\0') {
         return i;
       }
@@ -171,6 +178,21 @@ extern int sys_gaddmap(void);
 extern int sys_gremovemap(void);
 extern int sys_gupdate_flags(void);
 extern int sys_gdeploy_program(void);
+extern int sys_ginflate(void);
+extern int sys_gdeflate(void);
+extern int sys_gblk_setup(void);
+extern int sys_gblk_notify(void);
+extern int sys_gtimer(void);
+extern int sys_gcopyout(void);
+extern int sys_gfork_app(void);
+extern int sys_gcowcopy(void);
+extern int sys_gbind_app(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_mprotect(void);
+extern int sys_msync(void);
+extern int sys_fsync(void);
+extern int sys_sync(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -188,6 +210,15 @@ static int (*syscalls[])(void) = {
     [SYS_grequest_proc] = sys_grequest_proc, [SYS_gload_program] = sys_gload_program,
     [SYS_gaddmap] = sys_gaddmap, [SYS_gremovemap] = sys_gremovemap,
     [SYS_gupdate_flags] = sys_gupdate_flags, [SYS_gdeploy_program] = sys_gdeploy_program,
+    [SYS_ginflate] = sys_ginflate, [SYS_gdeflate] = sys_gdeflate,
+    [SYS_gblk_setup] = sys_gblk_setup, [SYS_gblk_notify] = sys_gblk_notify,
+    [SYS_gtimer] = sys_gtimer, [SYS_gcopyout] = sys_gcopyout,
+    [SYS_gfork_app] = sys_gfork_app, [SYS_gcowcopy] = sys_gcowcopy,
+    [SYS_gbind_app] = sys_gbind_app,
+    [SYS_mmap] = sys_mmap, [SYS_munmap] = sys_munmap,
+    [SYS_mprotect] = sys_mprotect,
+    [SYS_msync] = sys_msync,
+    [SYS_fsync] = sys_fsync, [SYS_sync] = sys_sync,
 };
 
 void syscall(void) {
@@ -213,6 +244,25 @@ int sys_sysinfo(void) {
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
   info->num_disk_reads = num_disk_reads;
+  info->num_bcache_hits = num_bcache_hits;
+  info->num_disk_writes = num_disk_writes;
+  info->num_log_commits = num_log_commits;
+  info->num_readahead_blocks = num_readahead_blocks;
+  info->num_readahead_hits = num_readahead_hits;
+  info->num_disk_requests = num_disk_requests;
+  info->num_hypercalls = num_hypercalls;
+  info->guest_pages = guest_pages;
+  info->balloon_inflated = balloon_inflated;
+  info->balloon_deflated = balloon_deflated;
+  info->num_mem_pressure = num_mem_pressure;
+  info->num_image_hits = num_image_hits;
+  info->num_demand_pages = num_demand_pages;
+  info->num_lazy_pages = num_lazy_pages;
+  info->num_zero_maps = num_zero_maps;
+  info->num_file_maps = num_file_maps;
+  info->num_pcache_hits = num_pcache_hits;
+  info->num_huge_pages = num_huge_pages;
+  info->num_dcache_hits = num_dcache_hits;
 
   return 0;
 }
@@ -116,6 +116,24 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
+int
+sys_sync(void)
+{
+  logsync();
+  bsync();
+  return 0;
+}
+
 int
 sys_open(void)
 {
@@ -128,8 +146,11 @@ sys_open(void)
     return -1;
   }
 
-  if(omode & O_CREATE)
-      createInode(path);
+  if(omode & O_CREATE) {
+    begin_op();
+    createInode(path);
+    end_op();
+  }
 
   if((ip = namei(path)) == 0)
     return -1;
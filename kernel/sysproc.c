@@ -1,10 +1,13 @@
 #include <cdefs.h>
 #include <date.h>
 #include <defs.h>
+#include <file.h>
 #include <memlayout.h>
+#include <mman.h>
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <stat.h>
 #include <x86_64.h>
 
 int sys_crashn(void) {
@@ -12,6 +15,9 @@ int sys_crashn(void) {
   if (argint(0, &n) < 0)
     return -1;
 
+  // count writes from a clean disk, so the test's earlier writes are safe
+  logsync();
+  bsync();
   crashn_enable = 1;
   crashn = n;
 
@@ -43,7 +49,7 @@ int sys_sbrk(void)
 {
   int addr;
   int n;
-  struct vregion *heap;
+  struct vregion *heap, *stack;
 
   if(argint(0, &n) < 0 || n < 0)
     return -1;
@@ -51,14 +57,110 @@ int sys_sbrk(void)
   heap = &myproc()->vspace.regions[VR_HEAP];
   addr = heap->va_base + heap->size;
 
-  if (vregionaddmap(heap, addr, n, VPI_PRESENT, VPI_WRITABLE) < 0)
+  // pages are zero-filled on first touch, see vspacezerofill; stay clear
+  // of the stack and the pages it may still grow into
+  stack = &myproc()->vspace.regions[VR_USTACK];
+  if (stack->va_base > (uint64_t) addr &&
+      (uint64_t) addr + n > stack->va_base - 10*PGSIZE)
+    return -1;
+  if ((uint64_t) addr < MMAP_BASE && (uint64_t) addr + n > MMAP_BASE)
     return -1;
   heap->size += n;
 
-  vspaceinvalidate(&myproc()->vspace);
+  return addr;
+}
+
+// Maps len bytes of fresh zeroed memory, or of the file open as fd from
+// the page aligned offset off on. Anonymous mappings must be private and
+// use 2MB pages where they can unless MAP_NOHUGE is given; file mappings
+// are shared, writing to the file, or private, writing to copies. The
+// kernel picks the address. Returns the address, or -1.
+int sys_mmap(void)
+{
+  int len, prot, flags, fd, off;
+  struct inode *ip = 0;
+  struct file *f;
+  uint64_t va;
+
+  if (argint(1, &len) < 0 || argint(2, &prot) < 0 || argint(3, &flags) < 0)
+    return -1;
+  if (len <= 0 || !(prot & PROT_READ) || (prot & ~(PROT_READ | PROT_WRITE)))
+    return -1;
+  if (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NOHUGE))
+    return -1;
+  if (!(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -1;
+  // the memory of guest apps is managed by their guest os
+  if (myproc()->guest)
+    return -1;
+
+  if (flags & MAP_ANONYMOUS) {
+    if (flags & MAP_SHARED)
+      return -1;
+    off = 0;
+  } else {
+    if (argint(4, &fd) < 0 || argint(5, &off) < 0 || off < 0 || off % PGSIZE)
+      return -1;
+    if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0)
+      return -1;
+    if (f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+      return -1;
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+    ip = f->ip;
+  }
+
+  if ((va = vspacemmap(&myproc()->vspace, len, prot & PROT_WRITE, ip, off,
+                       flags & MAP_SHARED, (flags & MAP_NOHUGE) != 0)) == 0)
+    return -1;
+  return va;
+}
+
+// Unmaps the mmap areas in [addr, addr + len), writes back the shared
+// file pages they wrote and frees their pages.
+int sys_munmap(void)
+{
+  int64_t addr;
+  int len;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  if (vspacemunmap(&myproc()->vspace, addr, len) < 0)
+    return -1;
   vspaceinstall(myproc());
+  return 0;
+}
 
-  return addr;
+// Makes the mmap areas in [addr, addr + len) read-only or read-write.
+int sys_mprotect(void)
+{
+  int64_t addr;
+  int len, prot;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0)
+    return -1;
+  if (len <= 0 || !(prot & PROT_READ) || (prot & ~(PROT_READ | PROT_WRITE)))
+    return -1;
+  if (vspacemprotect(&myproc()->vspace, addr, len, prot & PROT_WRITE) < 0)
+    return -1;
+  vspaceinstall(myproc());
+  return 0;
+}
+
+// Writes back the shared file pages in [addr, addr + len) that were
+// written. Every flag is served as MS_SYNC.
+int sys_msync(void)
+{
+  int64_t addr;
+  int len, flags;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &flags) < 0)
+    return -1;
+  if (len <= 0 || addr % PGSIZE || (flags & ~(MS_ASYNC | MS_INVALIDATE | MS_SYNC)))
+    return -1;
+  vspacemsync(&myproc()->vspace, addr, len);
+  vspaceinstall(myproc());
+  return 0;
 }
 
 int sys_sleep(void) {
@@ -29,6 +29,26 @@ void tvinit(void) {
 
 void idtinit(void) { lidt((void *)idt, sizeof(idt)); }
 
+// Resolves a fault the kernel takes on a user page that is populated on
+// first touch or copied on write, as when a syscall reads a string from
+// rodata or read()s into a fresh malloc buffer. Memory of guest apps other
+// than their code belongs to their guest os and is left alone, as are the
+// guest os windows onto it. Returns 0 if resolved.
+static int kernfault(uint64_t addr, int write) {
+  struct vspace *vs = &myproc()->vspace;
+  struct vregion *vr = va2vregion(vs, addr);
+
+  if (vr == 0 || (myproc()->guest != 0 && vr != &vs->regions[VR_CODE]))
+    return -1;
+  if (vr == &vs->regions[VR_APP_HEAP] || vr == &vs->regions[VR_APP_USTACK])
+    return -1;
+  if (vspacedemandload(vs, addr) < 0 && vspacefilefault(vs, addr, write) < 0 &&
+      vspacezerofill(vs, addr, write) < 0 && vspacecowcopy(vs, addr) < 0)
+    return -1;
+  vspaceinstall(myproc());
+  return 0;
+}
+
 void trap(struct trap_frame *tf) {
   uint64_t addr;
 
@@ -37,6 +57,7 @@ void trap(struct trap_frame *tf) {
       exit();
     myproc()->tf = tf;
     syscall();
+    guest_balloon_check();
     if (myproc()->killed)
       exit();
     return;
@@ -49,6 +70,7 @@ void trap(struct trap_frame *tf) {
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      guest_timer_tick();
     }
     lapiceoi();
     break;
@@ -74,11 +96,19 @@ void trap(struct trap_frame *tf) {
     break;
 
   default:
+    if (tf->trapno >= TRAP_IRQ0 && virtiointr(tf->trapno - TRAP_IRQ0)) {
+      lapiceoi();
+      break;
+    }
     addr = rcr2();
 
     if (tf->trapno == TRAP_PF) {
       num_page_faults += 1;
 
+      if (myproc() != 0 && (tf->cs & 3) == 0 && addr < USERTOP &&
+          kernfault(addr, tf->err & PF_WRITE) == 0)
+        break;
+
       if (myproc() == 0 || (tf->cs & 3) == 0) {
         // In kernel, it must be our mistake.
         cprintf("unexpected trap %d from cpu %d rip %lx (cr2=0x%x)\n",
@@ -88,21 +118,39 @@ void trap(struct trap_frame *tf) {
 
       struct vregion *stack;
       struct vpage_info *vpi;
-      char *mem;
+      int r;
 
       if (vspacecontains(&myproc()->vspace, addr, 0)) {
         vpi = va2vpage_info(va2vregion(&myproc()->vspace, addr), addr);
         if (vpi->used && !vpi->writable && vpi->cow) {
-          vpi->cow = 0;
-          vpi->writable = 1;
+          // frames leased from a guest os are copied by that guest
+          if ((r = guest_cow_fault(vpi, PGROUNDDOWN(addr))) > 0)
+            break;
+          if (r < 0)
+            goto bad;
+
+          // read-only mapping, or no memory for the copy
+          if (vspacecowcopy(&myproc()->vspace, addr) < 0)
+            goto bad;
+          vspaceinstall(myproc());
+          break;
+        }
 
-          if (!(mem = kalloc()))
-            panic("no mem cow");
+        // first touch of a program page
+        if (!vpi->used && vspacedemandload(&myproc()->vspace, addr) == 0) {
+          vspaceinstall(myproc());
+          break;
+        }
+
+        // first touch of a file mmap page, or first write to a shared one
+        if (vspacefilefault(&myproc()->vspace, addr, tf->err & PF_WRITE) == 0) {
+          vspaceinstall(myproc());
+          break;
+        }
 
-          memmove(mem, P2V(vpi->ppn << PT_SHIFT), PGSIZE);
-          kfree((char *)P2V(vpi->ppn << PT_SHIFT));
-          vpi->ppn = PGNUM(V2P(mem));
-          vspaceinvalidate(&myproc()->vspace);
+        // first touch of a page sbrk or mmap handed out
+        if (!vpi->used && myproc()->guest == 0 &&
+            vspacezerofill(&myproc()->vspace, addr, tf->err & PF_WRITE) == 0) {
           vspaceinstall(myproc());
           break;
         }
@@ -118,6 +166,7 @@ void trap(struct trap_frame *tf) {
       }
     }
 
+  bad:
     // Assume process misbehaved.
     cprintf("pid %d %s: trap %d err %d on cpu %d "
             "rip 0x%lx addr 0x%x--kill proc\n",
@@ -132,6 +181,12 @@ void trap(struct trap_frame *tf) {
   if (myproc() && myproc()->killed && (tf->cs & 3) == DPL_USER)
     exit();
 
+  // Interrupted user code holds no locks, so it is safe to queue memory
+  // pressure messages from here.
+  if (myproc() && (tf->cs & 3) == DPL_USER &&
+      tf->trapno == TRAP_IRQ0 + IRQ_TIMER)
+    guest_balloon_check();
+
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if (myproc() && myproc()->state == RUNNING &&
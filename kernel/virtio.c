@@ -0,0 +1,222 @@
+// virtio-blk driver, for a file system disk attached with
+// -drive if=virtio.
+//
+// The device has one virtqueue. Each request in flight owns one slot:
+// a descriptor of the queue that points, as an indirect descriptor, at
+// the slot's own table of a header, one entry per buf of the request
+// and a status byte. The data entries point straight at the buffer-cache
+// bufs, so a run of consecutive blocks goes out as one request without
+// copying. Up to NVREQ requests are in flight at once and the device may
+// finish them in any order.
+//
+// The caller of virtiorw sleeps on each buf it waits for, as iderw does;
+// the interrupt handler marks the bufs of finished requests valid and
+// wakes their owners, or releases them if they were read ahead.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <pci.h>
+#include <proc.h>
+#include <sleeplock.h>
+#include <spinlock.h>
+#include <trap.h>
+#include <virtio.h>
+#include <x86_64.h>
+
+#include <buf.h>
+
+#define NVREQ 32      // requests in flight
+#define VIO_MAXSEG 32 // bufs per request
+#define VIO_MAXQ 256  // largest queue that fits in vring below
+
+struct vreq {
+  struct virtio_blk_req hdr;
+  uchar status;
+  int nbufs;                     // 0 if the slot is free
+  struct buf *bufs[VIO_MAXSEG];
+  struct vring_desc table[VIO_MAXSEG + 2] __attribute__((aligned(16)));
+};
+
+static struct {
+  struct spinlock lock;
+  ushort base;         // I/O base of the registers, 0 if there is no device
+  int irq;
+  uint qsize;
+  uint64_t capacity;   // in sectors
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  volatile struct vring_used *used;
+  ushort usedidx;      // used entries handled so far
+  struct vreq reqs[NVREQ];
+} vio;
+
+// descriptors, then the available ring, then on the next page the used ring
+static char vring[3 * VIRTIO_PGSIZE] __attribute__((aligned(VIRTIO_PGSIZE)));
+
+// Find and set up a virtio-blk device. Returns 0 if there is one, -1 if
+// not.
+int virtioinit(void) {
+  struct pcidev d;
+  uint bar, features;
+  int i;
+
+  if (pcifind(PCI_ID, ~0, VIRTIO_ID_BLK << 16 | VIRTIO_VENDOR, &d) < 0)
+    return -1;
+  bar = pciread(&d, PCI_BAR0);
+  if (!(bar & PCI_BAR_IO))
+    return -1;
+  pciwrite(&d, PCI_COMMAND, pciread(&d, PCI_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+  vio.base = bar & ~3;
+
+  outb(vio.base + VIRTIO_STATUS, 0); // reset
+  outb(vio.base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+  features = inl(vio.base + VIRTIO_HOST_FEATURES);
+  outw(vio.base + VIRTIO_QUEUE_SEL, 0);
+  vio.qsize = inw(vio.base + VIRTIO_QUEUE_NUM);
+  if (!(features & VIRTIO_RING_F_INDIRECT_DESC) || vio.qsize < NVREQ || vio.qsize > VIO_MAXQ) {
+    outb(vio.base + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+    vio.base = 0;
+    return -1;
+  }
+  outl(vio.base + VIRTIO_GUEST_FEATURES, VIRTIO_RING_F_INDIRECT_DESC);
+
+  vio.desc = (struct vring_desc *)vring;
+  vio.avail = (struct vring_avail *)(vring + vio.qsize * sizeof(struct vring_desc));
+  vio.used = (struct vring_used *)(vring + PGROUNDUP(vio.qsize * sizeof(struct vring_desc) +
+                                                     sizeof(struct vring_avail) +
+                                                     (vio.qsize + 1) * sizeof(ushort)));
+  // slot i always uses descriptor i, pointing at its table
+  for (i = 0; i < NVREQ; i++) {
+    vio.desc[i].addr = V2P(vio.reqs[i].table);
+    vio.desc[i].flags = VRING_DESC_F_INDIRECT;
+  }
+  outl(vio.base + VIRTIO_QUEUE_PFN, V2P(vring) / VIRTIO_PGSIZE);
+
+  vio.capacity = inl(vio.base + VIRTIO_CONFIG) | (uint64_t)inl(vio.base + VIRTIO_CONFIG + 4) << 32;
+  vio.irq = pciread(&d, PCI_INTR) & 0xff;
+  initlock(&vio.lock, "virtio");
+  picenable(vio.irq);
+  ioapicenable(vio.irq, ncpu - 1);
+  outb(vio.base + VIRTIO_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+  cprintf("virtio-blk: %d sectors, irq %d, queue %d\n", (int)vio.capacity, vio.irq, vio.qsize);
+  return 0;
+}
+
+// Send the n bufs of bs, consecutive blocks in the same direction, to
+// the device as one request. Caller must hold vio.lock.
+static void virtiosubmit(struct buf **bs, int n) {
+  struct vreq *r;
+  int i, write = bs[0]->flags & B_DIRTY;
+
+  if ((uint64_t)(bs[n - 1]->blockno + 1) * (BSIZE / 512) > vio.capacity)
+    panic("incorrect blockno");
+
+  for (;;) {
+    for (r = vio.reqs; r < &vio.reqs[NVREQ] && r->nbufs; r++)
+      ;
+    if (r < &vio.reqs[NVREQ])
+      break;
+    sleep(&vio.reqs, &vio.lock);
+  }
+
+  r->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  r->hdr.reserved = 0;
+  r->hdr.sector = (uint64_t)bs[0]->blockno * (BSIZE / 512);
+  r->status = 0xff;
+  r->nbufs = n;
+  r->table[0].addr = V2P(&r->hdr);
+  r->table[0].len = sizeof(r->hdr);
+  r->table[0].flags = VRING_DESC_F_NEXT;
+  r->table[0].next = 1;
+  for (i = 0; i < n; i++) {
+    r->bufs[i] = bs[i];
+    r->table[i + 1].addr = V2P(bs[i]->data);
+    r->table[i + 1].len = BSIZE;
+    r->table[i + 1].flags = VRING_DESC_F_NEXT | (write ? 0 : VRING_DESC_F_WRITE);
+    r->table[i + 1].next = i + 2;
+  }
+  r->table[n + 1].addr = V2P(&r->status);
+  r->table[n + 1].len = 1;
+  r->table[n + 1].flags = VRING_DESC_F_WRITE;
+  r->table[n + 1].next = 0;
+  vio.desc[r - vio.reqs].len = (n + 2) * sizeof(struct vring_desc);
+
+  vio.avail->ring[vio.avail->idx % vio.qsize] = r - vio.reqs;
+  __sync_synchronize(); // the device must see the entry before the index
+  vio.avail->idx++;
+  __sync_synchronize();
+  outw(vio.base + VIRTIO_QUEUE_NOTIFY, 0);
+  num_disk_requests += 1;
+}
+
+// Sync the n locked bufs of bs with the disk, as iderw does: write the
+// dirty ones, read the others. Runs of consecutive blocks become single
+// requests and are all sent before waiting. Bufs marked B_ASYNC are not
+// waited for; the interrupt handler releases them.
+void virtiorw(struct buf **bs, int n) {
+  int i, m;
+
+  for (i = 0; i < n; i++) {
+    if (!holdingsleep(&bs[i]->lock))
+      panic("iderw: buf not locked");
+    if ((bs[i]->flags & (B_VALID | B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+  }
+
+  acquire(&vio.lock);
+  for (i = 0; i < n; i += m) {
+    for (m = 1; i + m < n && m < VIO_MAXSEG && bs[i + m]->dev == bs[i]->dev &&
+                bs[i + m]->blockno == bs[i]->blockno + m &&
+                (bs[i + m]->flags & B_DIRTY) == (bs[i]->flags & B_DIRTY);
+         m++)
+      ;
+    virtiosubmit(bs + i, m);
+  }
+  for (i = 0; i < n; i++) {
+    if (bs[i]->flags & B_ASYNC)
+      continue;
+    while ((bs[i]->flags & (B_VALID | B_DIRTY)) != B_VALID)
+      sleep(bs[i], &vio.lock);
+  }
+  release(&vio.lock);
+}
+
+// Interrupt handler. Returns 0 if irq is not the device's.
+int virtiointr(int irq) {
+  struct vreq *r;
+  struct buf *b;
+  int i;
+
+  if (vio.base == 0 || irq != vio.irq)
+    return 0;
+
+  acquire(&vio.lock);
+  inb(vio.base + VIRTIO_ISR); // ack before looking, so no completion is missed
+  while (vio.usedidx != vio.used->idx) {
+    __sync_synchronize();
+    r = &vio.reqs[vio.used->ring[vio.usedidx % vio.qsize].id];
+    if (r->status != VIRTIO_BLK_S_OK)
+      cprintf("virtio-blk: error %d at sector %d\n", r->status, (int)r->hdr.sector);
+    for (i = 0; i < r->nbufs; i++) {
+      b = r->bufs[i];
+      b->flags |= B_VALID;
+      b->flags &= ~B_DIRTY;
+      if (b->flags & B_ASYNC) {
+        b->flags &= ~B_ASYNC;
+        brelse(b);
+      } else {
+        wakeup(b);
+      }
+    }
+    r->nbufs = 0;
+    vio.usedidx++;
+  }
+  wakeup(&vio.reqs);
+  release(&vio.lock);
+  return 1;
+}
@@ -31,12 +31,24 @@ x86perms(struct vpage_info *vpi)
 
 extern pml4e_t *kpml4;
 
+int num_demand_pages = 0;
+int num_lazy_pages = 0;
+int num_zero_maps = 0;
+int num_file_maps = 0;
+int num_huge_pages = 0;
+
+// Mapped copy-on-write for reads of heap pages that were never written.
+static char *zeropage;
+
 void
 vspacebootinit(void)
 {
   kpml4 = setupkvm();
   vspaceinstallkern();
   seginit();   // segment table
+
+  assertm(zeropage = kalloc(), "failed to allocate zero page");
+  memset(zeropage, 0, PGSIZE);
 }
 
 int
@@ -58,6 +70,10 @@ vspaceinit(struct vspace *vs)
   vs->regions[VR_APP_HEAP].dir   = VRDIR_UP;
   vs->regions[VR_APP_USTACK].dir = VRDIR_DOWN;
 
+  vs->ip = 0;
+  vs->nsegs = 0;
+  vs->nvmas = 0;
+  vs->vmas = 0;
   return 0;
 }
 
@@ -68,7 +84,7 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
   uint64_t a;
   struct vpage_info *vpi;
 
-  if (sz + from_va >= KERNBASE)
+  if (sz + from_va >= USERTOP)
     return -1;
   if (sz <= 0)
     return 0;
@@ -134,25 +150,6 @@ vradddata(struct vregion *r, uint64_t va, char *data, int sz, short present, sho
   return 0;
 }
 
-// va must be page aligned
-static int
-vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  struct vpage_info *vpi;
-  assertm(va % PGSIZE == 0, "va must be page aligned");
-
-  for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
-    assertm(vpi->used, "page must be allocated");
-    n = min(sz - i, (uint) PGSIZE);
-    if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
-      return -1;
-  }
-
-  return 0;
-}
-
 void
 vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
 {
@@ -184,26 +181,32 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
 {
   struct inode *ip;
   struct proghdr ph;
-  int off, sz;
-  uint64_t va;
+  int off;
+  uint64_t sz;
   struct elfhdr elf;
+  struct vsegment *seg;
   int i;
 
   if((ip = namei(path)) == 0){
     return 0;
   }
 
+  // Set start bound
+  vs->regions[VR_CODE].va_base = 0;
+
+  // Programs in the image cache share the pages already loaded
+  if((sz = imagemap(vs, ip, rip)) != 0)
+    goto loaded;
+
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
     goto elf_failure;
   if(elf.magic != ELF_MAGIC)
     goto elf_failure;
 
-  // Set start bound
-  vs->regions[VR_CODE].va_base = 0;
-
-  // Load program into memory.
-  va = 0;
+  // Record the segments; their pages are read in on first touch.
+  sz = 0;
+  vs->nsegs = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto elf_failure;
@@ -213,41 +216,97 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
       goto elf_failure;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto elf_failure;
-
-    if((sz = vregionaddmap(&vs->regions[VR_CODE], (uint64_t)va, ph.vaddr + ph.memsz, VPI_PRESENT, VPI_WRITABLE)) < 0)
-     goto elf_failure;
     if(ph.vaddr % PGSIZE != 0)
       goto elf_failure;
 
-    va += sz;
+    if(ph.memsz == 0)
+      continue;
+    if(vs->nsegs == NVSEGMENTS)
+      goto elf_failure;
 
-    if(vrloaddata(&vs->regions[VR_CODE], ph.vaddr, ip, ph.off, ph.filesz) < 0)
-     goto elf_failure;
+    seg = &vs->segs[vs->nsegs++];
+    seg->va = ph.vaddr;
+    seg->memsz = ph.memsz;
+    seg->off = ph.off;
+    seg->filesz = ph.filesz;
+    // only writable segments get copied when the image is shared
+    seg->writable = (ph.flags & ELF_PROG_FLAG_WRITE) ? VPI_WRITABLE : 0;
+    sz = max(sz, ph.vaddr + ph.memsz);
   }
+  if(sz == 0)
+    goto elf_failure;
+  *rip = elf.entry;
+  imageadd(vs, ip, sz, *rip);
 
+loaded:
   // Set end bound;
   vs->regions[VR_CODE].size = PGROUNDUP(sz);
   // The heap will be right after the code
   vs->regions[VR_HEAP].va_base = PGROUNDUP(sz);
   vs->regions[VR_HEAP].size = 0;
 
-  irelease(ip);
-  *rip = elf.entry;
+  // the code region keeps the program open for demand paging
+  vs->ip = ip;
+  vs->cid = myproc()->cid;
   return sz;
 elf_failure:
+  vs->nsegs = 0;
   if(ip)
     irelease(ip);
 
   return 0;
 }
 
+// Returns 1 if the 2MB aligned block at va of vr is backed by one 2MB
+// aligned run of frames with the same permissions, so one 2MB page can map
+// it. A copy-on-write copy or an unmap inside the block breaks the run, and
+// the block goes back to 4KB pages.
+static int
+vregionhuge(struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi, *first;
+  uint i;
+
+  if (va < VRBOT(vr) || va + HPGSIZE > VRTOP(vr))
+    return 0;
+  first = va2vpage_info(vr, va);
+  if (!first || !first->used || !first->present || first->ppn % HPGPAGES)
+    return 0;
+  for (i = 1; i < HPGPAGES; i++) {
+    vpi = va2vpage_info(vr, va + i * PGSIZE);
+    if (!vpi || !vpi->used || vpi->ppn != first->ppn + i || x86perms(vpi) != x86perms(first))
+      return 0;
+  }
+  return 1;
+}
+
+static void
+vregionmappages(pml4e_t *pgtbl, struct vregion *vr)
+{
+  struct vpage_info *vpi;
+  uint64_t start, end;
+
+  start = VRBOT(vr);
+  end = VRTOP(vr);
+
+  assert(start % PGSIZE == 0);
+
+  for (; start < end; start += PGSIZE) {
+    vpi = va2vpage_info(vr, start);
+    if (start % HPGSIZE == 0 && vregionhuge(vr, start) &&
+        maphugepage(pgtbl, start >> PT_SHIFT, vpi->ppn, x86perms(vpi)) == 0) {
+      start += HPGSIZE - PGSIZE;
+      continue;
+    }
+    mappages(pgtbl, start >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi), 0);
+  }
+}
+
 void
 vspaceinvalidate(struct vspace *vs)
 {
   uint i;
   struct vregion *vr;
-  struct vpage_info *vpi;
-  uint64_t start, end;
 
   // First free the user entries (not the pages they point to)
   for (i = 0; i <= PML4_INDEX(SZ_4G); i++) {
@@ -259,17 +318,10 @@ vspaceinvalidate(struct vspace *vs)
   }
 
   // Then rebuild the user virtual address space
-  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++) {
-    start = VRBOT(vr);
-    end = VRTOP(vr);
-
-    assert(start % PGSIZE == 0);
-
-    for (; start < end; start += PGSIZE) {
-      vpi = va2vpage_info(vr, start);
-      mappages(vs->pgtbl, start >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi), 0);
-    }
-  }
+  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++)
+    vregionmappages(vs->pgtbl, vr);
+  for (vr = vs->vmas; vr < &vs->vmas[vs->nvmas]; vr++)
+    vregionmappages(vs->pgtbl, vr);
 }
 
 void
@@ -315,7 +367,20 @@ vspacefree(struct vspace *vs)
     free_page_desc_list(vr->pages);
     memset(vr, 0, sizeof(struct vregion));
   }
-
+  for (vr = vs->vmas; vr < &vs->vmas[vs->nvmas]; vr++) {
+    free_page_desc_list(vr->pages);
+    if (vr->ip)
+      irelease(vr->ip);
+  }
+  if (vs->vmas)
+    kfree((char *)vs->vmas);
+  vs->vmas = 0;
+  vs->nvmas = 0;
+
+  if (vs->ip)
+    irelease(vs->ip);
+  vs->ip = 0;
+  vs->nsegs = 0;
   freevm(vs->pgtbl);
 }
 
@@ -323,6 +388,7 @@ struct vregion*
 va2vregion(struct vspace *vs, uint64_t va)
 {
   struct vregion *vr;
+  int lo, hi, mid;
 
   for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
     if (vr->dir == VRDIR_UP) {
@@ -333,6 +399,20 @@ va2vregion(struct vspace *vs, uint64_t va)
         return vr;
     }
   }
+
+  // binary search of the mmap areas
+  lo = 0;
+  hi = vs->nvmas;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    vr = &vs->vmas[mid];
+    if (va < vr->va_base)
+      hi = mid;
+    else if (va >= vr->va_base + vr->size)
+      lo = mid + 1;
+    else
+      return vr;
+  }
   return 0;
 }
 
@@ -384,6 +464,56 @@ vspacecontains(struct vspace *vs, uint64_t va, int size)
   return vregioncontains(vr, va, size);
 }
 
+// Copies the program segments and the mmap areas of src; their pages are
+// copied by the caller. Returns 0 on success, -1 if out of memory.
+static int
+vspacecopysegs(struct vspace *dst, struct vspace *src)
+{
+  struct vregion *vr;
+
+  dst->ip = src->ip ? idup(src->ip) : 0;
+  dst->cid = src->cid;
+  dst->nsegs = src->nsegs;
+  memmove(dst->segs, src->segs, sizeof(src->segs));
+
+  dst->nvmas = 0;
+  dst->vmas = 0;
+  if (src->vmas) {
+    if (!(dst->vmas = (struct vregion *)kalloc()))
+      return -1;
+    memmove(dst->vmas, src->vmas, sizeof(struct vregion) * src->nvmas);
+    dst->nvmas = src->nvmas;
+    for (vr = dst->vmas; vr < &dst->vmas[dst->nvmas]; vr++)
+      if (vr->ip)
+        idup(vr->ip);
+  }
+  return 0;
+}
+
+// Copies the page infos of a shared file mmap area: both address spaces
+// map the same cached pages, as they are.
+static int
+share_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+{
+  int i;
+
+  if (!src) {
+    *dst = 0;
+    return 0;
+  }
+
+  if (!(*dst = (struct vpi_page *)kalloc()))
+    return -1;
+
+  memmove(*dst, src, sizeof(struct vpi_page));
+  (*dst)->next = 0;
+  for (i = 0; i < VPIPPAGE; i++)
+    if (src->infos[i].used)
+      kincref(src->infos[i].ppn << PT_SHIFT);
+
+  return share_vpi_page(&(*dst)->next, src->next);
+}
+
 static int
 copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
 {
@@ -408,6 +538,13 @@ copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
       dstvpi->used = srcvpi->used;
       dstvpi->present = srcvpi->present;
       dstvpi->writable = srcvpi->writable;
+      if (srcvpi->cow) {
+        // already shared copy-on-write, e.g. a cached program image
+        dstvpi->cow = 1;
+        dstvpi->ppn = srcvpi->ppn;
+        kincref(dstvpi->ppn << PT_SHIFT);
+        continue;
+      }
       if (!(data = kalloc()))
         return -1;
       memmove(data, P2V(srcvpi->ppn << PT_SHIFT), PGSIZE);
@@ -424,10 +561,16 @@ vspacecopy(struct vspace *dst, struct vspace *src)
   struct vregion *vr;
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  if (vspacecopysegs(dst, src) < 0)
+    return -1;
 
   for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
     if (copy_vpi_page(&vr->pages, vr->pages) < 0)
       return -1;
+  for (vr = dst->vmas; vr < &dst->vmas[dst->nvmas]; vr++)
+    if ((vr->shared ? share_vpi_page(&vr->pages, vr->pages) :
+         copy_vpi_page(&vr->pages, vr->pages)) < 0)
+      return -1;
 
   vspaceinvalidate(dst);
 
@@ -475,10 +618,16 @@ cow_vspacecopy(struct vspace *dst, struct vspace *src)
   struct vregion *vr;
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  if (vspacecopysegs(dst, src) < 0)
+    return -1;
 
   for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
     if (cow_copy_vpi_page(&vr->pages, vr->pages) < 0)
       return -1;
+  for (vr = dst->vmas; vr < &dst->vmas[dst->nvmas]; vr++)
+    if ((vr->shared ? share_vpi_page(&vr->pages, vr->pages) :
+         cow_copy_vpi_page(&vr->pages, vr->pages)) < 0)
+      return -1;
 
   vspaceinvalidate(src);
   vspaceinvalidate(dst);
@@ -502,6 +651,241 @@ vspaceinitstack(struct vspace *vs, uint64_t start)
   return 0;
 }
 
+// Reads the not yet loaded program page at va from the program file, along
+// with up to FAULTAROUND - 1 following pages of the same segment. Pages
+// another process already read come from the image cache. Returns 0 on
+// success, -1 if va is not such a page or memory or the disk failed.
+int
+vspacedemandload(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr = &vs->regions[VR_CODE];
+  struct vsegment *seg = 0;
+  struct vpage_info *vpi;
+  uint64_t a, end, ppn, pos, n;
+  char *mem;
+  int i, loaded, shared;
+
+  va = PGROUNDDOWN(va);
+  if (!vs->ip || !vregioncontains(vr, va, 0))
+    return -1;
+  for (i = 0; i < vs->nsegs; i++)
+    if (va >= vs->segs[i].va && va < vs->segs[i].va + vs->segs[i].memsz)
+      seg = &vs->segs[i];
+  if (!seg || !(vpi = va2vpage_info(vr, va)) || vpi->used)
+    return -1;
+
+  end = min(va + FAULTAROUND * PGSIZE, PGROUNDUP(seg->va + seg->memsz));
+  loaded = 0;
+  for (a = va; a < end; a += PGSIZE) {
+    if (!(vpi = va2vpage_info(vr, a)) || vpi->used)
+      break;
+
+    shared = 1;
+    if (!(ppn = imagegetpage(vs->cid, vs->ip, a))) {
+      if (!(mem = kalloc()))
+        break;
+      memset(mem, 0, PGSIZE);
+      pos = a - seg->va;
+      if (pos < seg->filesz) {
+        n = min(seg->filesz - pos, (uint64_t) PGSIZE);
+        if (readi(vs->ip, mem, seg->off + pos, n) != n) {
+          kfree(mem);
+          break;
+        }
+      }
+      ppn = PGNUM(V2P(mem));
+      shared = imageputpage(vs->cid, vs->ip, a, ppn);
+      num_demand_pages++;
+    }
+
+    // keep a cached copy intact until this process writes its own
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->ppn = ppn;
+    vpi->writable = shared ? 0 : seg->writable;
+    vpi->cow = shared ? seg->writable : 0;
+    loaded++;
+  }
+  if (loaded == 0)
+    return -1;
+
+  vspaceinvalidate(vs);
+  return 0;
+}
+
+static int
+isvma(struct vspace *vs, struct vregion *vr)
+{
+  return vr >= vs->vmas && vr < &vs->vmas[vs->nvmas];
+}
+
+// Backs the 2MB aligned block around va of anonymous region vr with one
+// zeroed 2MB run of frames, mapped by a single 2MB page, if the block lies
+// inside vr and none of its pages is populated yet. Returns 0 on success,
+// -1 if not or there is no free 2MB run.
+static int
+vregionhugefill(struct vregion *vr, uint64_t va)
+{
+  struct vpage_info *vpi;
+  uint64_t base = HPGROUNDDOWN(va);
+  char *mem;
+  uint i;
+
+  if (vr->nohuge || base < VRBOT(vr) || base + HPGSIZE > VRTOP(vr))
+    return -1;
+  for (i = 0; i < HPGPAGES; i++)
+    if (!(vpi = va2vpage_info(vr, base + i * PGSIZE)) || vpi->used)
+      return -1;
+  if (!(mem = kallochuge()))
+    return -1;
+  memset(mem, 0, HPGSIZE);
+
+  for (i = 0; i < HPGPAGES; i++) {
+    vpi = va2vpage_info(vr, base + i * PGSIZE);
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->ppn = PGNUM(V2P(mem)) + i;
+    vpi->writable = VPI_WRITABLE;
+    vpi->cow = 0;
+  }
+  num_huge_pages++;
+  return 0;
+}
+
+// Populates the heap or mmap page at va, which was handed out but nobody
+// touched: a write gets a private zeroed page, or the whole 2MB block
+// around it if that is free, a read the shared zero page mapped
+// copy-on-write. Returns 0 on success, -1 if va is not such a page,
+// the write is not allowed or there is no memory.
+int
+vspacezerofill(struct vspace *vs, uint64_t va, int write)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  char *mem;
+
+  if (!(vr = va2vregion(vs, va)) || (vr != &vs->regions[VR_HEAP] && !isvma(vs, vr)) || vr->ip)
+    return -1;
+  if (!(vpi = va2vpage_info(vr, va)) || vpi->used || (write && vr->readonly))
+    return -1;
+
+  if (write && vregionhugefill(vr, va) == 0) {
+    vspaceinvalidate(vs);
+    return 0;
+  }
+  if (write) {
+    if (!(mem = kalloc()))
+      return -1;
+    memset(mem, 0, PGSIZE);
+    vpi->ppn = PGNUM(V2P(mem));
+    vpi->writable = VPI_WRITABLE;
+    vpi->cow = 0;
+    num_lazy_pages++;
+  } else {
+    kincref(V2P(zeropage));
+    vpi->ppn = PGNUM(V2P(zeropage));
+    vpi->writable = 0;
+    vpi->cow = 1;
+    num_zero_maps++;
+  }
+  vpi->used = 1;
+  vpi->present = VPI_PRESENT;
+  vspaceinvalidate(vs);
+  return 0;
+}
+
+// Pages in the program pages and file mmap pages of [va, va + size) that
+// are not loaded yet. Returns the number of faults served.
+int
+vspaceloadrange(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a;
+  int n = 0;
+
+  for (a = PGROUNDDOWN(va); a < va + size; a += PGSIZE) {
+    if (!(vr = va2vregion(vs, a)))
+      break;
+    if (vr == &vs->regions[VR_CODE] ? !vs->ip : !(isvma(vs, vr) && vr->ip))
+      continue;
+    vpi = va2vpage_info(vr, a);
+    if (vpi && !vpi->used &&
+        (vspacedemandload(vs, a) == 0 || vspacefilefault(vs, a, 0) == 0))
+      n++;
+  }
+  return n;
+}
+
+// Maps the page at va of a file mmap area from the page cache, or makes a
+// shared page mapped by a read writable on the first write. Shared pages
+// map the cached frame and mark it dirty when written; private ones map it
+// copy-on-write. Returns 0 on success, -1 if va is not such a page, the
+// write is not allowed or the page cache or memory is full.
+int
+vspacefilefault(struct vspace *vs, uint64_t va, int write)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t ppn;
+  uint pgno;
+
+  if (!(vr = va2vregion(vs, va)) || !isvma(vs, vr) || !vr->ip || (write && vr->readonly))
+    return -1;
+  if (!(vpi = va2vpage_info(vr, va)))
+    return -1;
+  pgno = (vr->off + PGROUNDDOWN(va) - vr->va_base) / PGSIZE;
+
+  if (vpi->used) {
+    if (!write || !vr->shared || vpi->writable)
+      return -1;
+  } else {
+    if (!(ppn = pcmap(vr->ip, pgno)))
+      return -1;
+    vpi->used = 1;
+    vpi->present = VPI_PRESENT;
+    vpi->ppn = ppn;
+    vpi->writable = 0;
+    vpi->cow = !vr->shared;
+    num_file_maps++;
+  }
+  if (write && vr->shared) {
+    pcdirty(vr->ip, pgno);
+    vpi->writable = VPI_WRITABLE;
+  }
+  vspaceinvalidate(vs);
+
+  if (write && !vr->shared)
+    return vspacecowcopy(vs, va);
+  return 0;
+}
+
+// Gives vs a private, writable copy of the copy-on-write page at va.
+// Returns 0 on success, -1 if there is no such page or no memory.
+int
+vspacecowcopy(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  char *mem;
+
+  if (!(vr = va2vregion(vs, va)) || vr->readonly)
+    return -1;
+  vpi = va2vpage_info(vr, va);
+  if (!vpi || !vpi->used || vpi->writable || !vpi->cow)
+    return -1;
+  if (!(mem = kalloc()))
+    return -1;
+
+  memmove(mem, P2V(vpi->ppn << PT_SHIFT), PGSIZE);
+  kfree((char *)P2V(vpi->ppn << PT_SHIFT));
+  vpi->ppn = PGNUM(V2P(mem));
+  vpi->cow = 0;
+  vpi->writable = VPI_WRITABLE;
+  vspaceinvalidate(vs);
+  return 0;
+}
+
 int
 vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 {
@@ -510,7 +894,7 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
   struct vregion *vr;
 
   assertm(sz > 0, "sz less than or equal to 0");
-  assertm(va + sz < KERNBASE, "went over kernel vm base");
+  assertm(va + sz < USERTOP, "went over kernel vm base");
 
   end = va + sz;
   while (va < end) {
@@ -534,3 +918,213 @@ vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 
   return 0;
 }
+
+// Adds a mapping of len bytes at the lowest free address in
+// [MMAP_BASE, MMAP_TOP): of ip from the page aligned offset off on, or
+// anonymous and zero-filled on first touch if ip is 0. Anonymous areas of
+// 2MB or more start on a 2MB boundary, so they can use 2MB pages unless
+// nohuge is set. Returns its address, or 0 if there is no room.
+uint64_t
+vspacemmap(struct vspace *vs, uint64_t len, int writable, struct inode *ip, uint64_t off, int shared,
+           int nohuge)
+{
+  struct vregion *vr;
+  uint64_t va, end, align;
+  int i;
+
+  len = PGROUNDUP(len);
+  if (len == 0 || vs->nvmas == NVMAS)
+    return 0;
+  if (!vs->vmas && !(vs->vmas = (struct vregion *)kalloc()))
+    return 0;
+
+  // first fit between the areas already there
+  align = (!ip && !nohuge && len >= HPGSIZE) ? HPGSIZE : PGSIZE;
+  va = MMAP_BASE;
+  for (i = 0; i <= vs->nvmas; i++) {
+    end = i < vs->nvmas ? vs->vmas[i].va_base : MMAP_TOP;
+    if (va + len <= end)
+      break;
+    if (i < vs->nvmas)
+      va = (vs->vmas[i].va_base + vs->vmas[i].size + align - 1) & ~(align - 1);
+  }
+  if (i > vs->nvmas)
+    return 0;
+
+  memmove(&vs->vmas[i + 1], &vs->vmas[i], sizeof(struct vregion) * (vs->nvmas - i));
+  vs->nvmas++;
+  vr = &vs->vmas[i];
+  memset(vr, 0, sizeof(struct vregion));
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = len;
+  vr->readonly = !writable;
+  vr->ip = ip ? idup(ip) : 0;
+  vr->off = off;
+  vr->shared = ip ? shared : 0;
+  vr->nohuge = nohuge;
+  return va;
+}
+
+// Splits the mmap area that contains va, if va is inside of it, into one
+// area below va and one from va. Returns 0 on success, -1 if there is no
+// room for another area or no memory.
+static int
+vmasplit(struct vspace *vs, uint64_t va)
+{
+  struct vregion *lo, hi;
+  struct vpage_info *src, *dst;
+  uint64_t a, top;
+  int i;
+
+  for (i = 0; i < vs->nvmas; i++)
+    if (va > vs->vmas[i].va_base && va < vs->vmas[i].va_base + vs->vmas[i].size)
+      break;
+  if (i == vs->nvmas)
+    return 0;
+  if (vs->nvmas == NVMAS)
+    return -1;
+
+  lo = &vs->vmas[i];
+  top = lo->va_base + lo->size;
+  memset(&hi, 0, sizeof(hi));
+  hi.dir = VRDIR_UP;
+  hi.va_base = va;
+  hi.size = top - va;
+  hi.readonly = lo->readonly;
+  hi.off = lo->off + (va - lo->va_base);
+  hi.shared = lo->shared;
+  hi.nohuge = lo->nohuge;
+
+  // the last page allocates every vpi page in front of it
+  if (!va2vpage_info(&hi, top - PGSIZE)) {
+    free_page_desc_list(hi.pages);
+    return -1;
+  }
+  for (a = va; a < top; a += PGSIZE) {
+    if (!(src = va2vpage_info(lo, a)))
+      continue;
+    dst = va2vpage_info(&hi, a);
+    *dst = *src;
+    memset(src, 0, sizeof(*src));
+  }
+  lo->size = va - lo->va_base;
+  hi.ip = lo->ip ? idup(lo->ip) : 0;
+
+  memmove(&vs->vmas[i + 2], &vs->vmas[i + 1], sizeof(struct vregion) * (vs->nvmas - i - 1));
+  vs->vmas[i + 1] = hi;
+  vs->nvmas++;
+  return 0;
+}
+
+// Writes the pages of shared file mmap area vr in [from, to) that this
+// address space wrote back to the file, and write-protects them so the
+// next write marks them dirty again. Returns 1 if any page was written.
+static int
+vmasync(struct vregion *vr, uint64_t from, uint64_t to)
+{
+  struct vpage_info *vpi;
+  uint64_t a;
+  int n = 0;
+
+  for (a = max(from, vr->va_base); a < min(to, vr->va_base + vr->size); a += PGSIZE) {
+    vpi = va2vpage_info(vr, a);
+    if (vpi && vpi->used && vpi->writable) {
+      pcsync(vr->ip, (vr->off + a - vr->va_base) / PGSIZE);
+      vpi->writable = 0;
+      n = 1;
+    }
+  }
+  return n;
+}
+
+// Removes the mmap areas in [va, va + len), splitting areas that straddle
+// its ends, writes back what they wrote to shared file pages and frees
+// their pages. va must be page aligned. Returns 0 on success, -1 on
+// failure.
+int
+vspacemunmap(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a, end;
+  int i;
+
+  end = va + PGROUNDUP(len);
+  if (va % PGSIZE || end <= va)
+    return -1;
+  if (vmasplit(vs, va) < 0 || vmasplit(vs, end) < 0)
+    return -1;
+
+  for (i = 0; i < vs->nvmas; ) {
+    vr = &vs->vmas[i];
+    if (vr->va_base < va || vr->va_base + vr->size > end) {
+      i++;
+      continue;
+    }
+    if (vr->shared)
+      vmasync(vr, vr->va_base, vr->va_base + vr->size);
+    for (a = vr->va_base; a < vr->va_base + vr->size; a += PGSIZE) {
+      vpi = va2vpage_info(vr, a);
+      if (vpi && vpi->used)
+        kfree(P2V(vpi->ppn << PT_SHIFT));
+    }
+    free_page_desc_list(vr->pages);
+    if (vr->ip)
+      irelease(vr->ip);
+    memmove(vr, vr + 1, sizeof(struct vregion) * (vs->nvmas - i - 1));
+    vs->nvmas--;
+  }
+
+  vspaceinvalidate(vs);
+  return 0;
+}
+
+// Changes the protection of [va, va + len), which must be covered by mmap
+// areas. Pages still shared copy-on-write stay that way. Returns 0 on
+// success, -1 on failure.
+int
+vspacemprotect(struct vspace *vs, uint64_t va, uint64_t len, int writable)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a, end;
+
+  end = va + PGROUNDUP(len);
+  if (va % PGSIZE || end <= va)
+    return -1;
+  for (a = va; a < end; a = vr->va_base + vr->size)
+    if (!(vr = va2vregion(vs, a)) || !isvma(vs, vr))
+      return -1;
+  if (vmasplit(vs, va) < 0 || vmasplit(vs, end) < 0)
+    return -1;
+
+  for (vr = vs->vmas; vr < &vs->vmas[vs->nvmas]; vr++) {
+    if (vr->va_base < va || vr->va_base + vr->size > end)
+      continue;
+    vr->readonly = !writable;
+    for (a = vr->va_base; a < vr->va_base + vr->size; a += PGSIZE) {
+      vpi = va2vpage_info(vr, a);
+      // shared file pages become writable on the write that dirties them
+      if (vpi && vpi->used && !vpi->cow && !(writable && vr->shared))
+        vpi->writable = writable ? VPI_WRITABLE : 0;
+    }
+  }
+
+  vspaceinvalidate(vs);
+  return 0;
+}
+
+// Writes back what vs wrote to shared file mmap pages in [va, va + len).
+void
+vspacemsync(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr;
+  int n = 0;
+
+  for (vr = vs->vmas; vr < &vs->vmas[vs->nvmas]; vr++)
+    if (vr->shared && vr->va_base < va + len && vr->va_base + vr->size > va)
+      n |= vmasync(vr, va, va + len);
+  if (n)
+    vspaceinvalidate(vs);
+}
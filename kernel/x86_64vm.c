@@ -10,6 +10,8 @@
 #include <msr.h>
 #include <fs.h>
 #include <file.h>
+#include <e820.h>
+#include <cpuid.h>
 
 extern char data[];  // defined by kernel.ld
 pml4e_t *kpml4;  // for use in scheduler()
@@ -52,16 +54,14 @@ seginit(void)
 };
 
 
-// Return the address of the PTE in page table pgdir
+// Return the address of the PDPTE in page table pml4
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-pte_t *
-walkpml4(pml4e_t *pml4, const void *va, int alloc)
+static pdpte_t *
+walkpdpt(pml4e_t *pml4, const void *va, int alloc)
 {
   pml4e_t *pml4e;
-  pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pte_t *pgtab;
+  pdpte_t *pdpt;
 
   pml4e = &pml4[PML4_INDEX(va)];
 
@@ -74,7 +74,24 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
     *pml4e = V2P(pdpt) | PTE_P | PTE_W | PTE_U;
   }
 
-  pdpte = &pdpt[PDPT_INDEX(va)];
+  return &pdpt[PDPT_INDEX(va)];
+}
+
+// Return the address of the PDE in page table pml4
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages.
+static pde_t *
+walkpgdir(pml4e_t *pml4, const void *va, int alloc)
+{
+  pdpte_t *pdpte;
+  pde_t *pgdir;
+
+  if ((pdpte = walkpdpt(pml4, va, alloc)) == 0)
+    return 0;
+
+  // a 1GB page of the direct map
+  if (*pdpte & PTE_PS)
+    return 0;
 
   if (*pdpte & PTE_P) {
     pgdir = (pde_t*)P2V(PDE_ADDR(*pdpte));
@@ -85,7 +102,41 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
     *pdpte = V2P(pgdir) | PTE_P | PTE_W | PTE_U;
   }
 
-  pde = &pgdir[PD_INDEX(va)];
+  return &pgdir[PD_INDEX(va)];
+}
+
+// Replace the 2MB mapping of pde by a page table of 4KB PTEs
+// that map the same memory with the same permissions.
+static int
+splitpde(pde_t *pde)
+{
+  pte_t *pgtab;
+  uint64_t pa = HPDE_ADDR(*pde);
+  uint i;
+
+  if((pgtab = (pte_t*)kalloc()) == 0)
+    return -1;
+  for (i = 0; i < PTRS_PER_PT; i++)
+    pgtab[i] = PTE(pa + i * PGSIZE, PTE_FLAGS(*pde) & ~PTE_PS);
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  return 0;
+}
+
+// Return the address of the PTE in page table pgdir
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages.  A 2MB page
+// is split into 4KB pages first.
+pte_t *
+walkpml4(pml4e_t *pml4, const void *va, int alloc)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+
+  if ((pde = walkpgdir(pml4, va, alloc)) == 0)
+    return 0;
+
+  if ((*pde & PTE_PS) && splitpde(pde) < 0)
+    return 0;
 
   if (*pde & PTE_P) {
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
@@ -164,8 +215,86 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
   return 0;
 }
 
+// Create a 2MB PDE for the 2MB aligned virtual page virt_pn that
+// refers to the 2MB aligned physical pages starting at phy_pn.
+int
+maphugepage(pml4e_t *pml4, uint64_t virt_pn, uint64_t phy_pn, int perm)
+{
+  pde_t *pde;
+  uint i;
+
+  if((pde = walkpgdir(pml4, (char*)(virt_pn << PT_SHIFT), 1)) == 0)
+    return -1;
+  if(*pde & PTE_P)
+    panic("remap");
+
+  *pde = PTE(phy_pn << PT_SHIFT, perm | PTE_PS);
+
+  for (i = 0; i < HPGPAGES; i++)
+    mark_user_mem((phy_pn + i) << PT_SHIFT, (virt_pn + i) << PT_SHIFT);
+  return 0;
+}
+
 
-// Set up kernel part of a page table.
+// Map physical [pa, end) at P2V(pa), with 1GB pages where the cpu has
+// them and both ends allow, else 2MB pages, else 4KB pages.
+static int
+mapdirect(pml4e_t *pml4, uint64_t pa, uint64_t end, int gbpages)
+{
+  pdpte_t *pdpte;
+  pde_t *pde;
+
+  while (pa < end) {
+    if (gbpages && pa % SZ_1G == 0 && end - pa >= SZ_1G) {
+      if ((pdpte = walkpdpt(pml4, P2V(pa), 1)) == 0)
+        return -1;
+      if (*pdpte & PTE_P)
+        panic("remap");
+      *pdpte = PTE(pa, PTE_P | PTE_W | PTE_PS);
+      pa += SZ_1G;
+    } else if (pa % HPGSIZE == 0 && end - pa >= HPGSIZE) {
+      if ((pde = walkpgdir(pml4, P2V(pa), 1)) == 0)
+        return -1;
+      if (*pde & PTE_P)
+        panic("remap");
+      *pde = PTE(pa, PTE_P | PTE_W | PTE_PS);
+      pa += HPGSIZE;
+    } else {
+      if (mappages(pml4, PGNUM(P2V(pa)), 1, PGNUM(pa), PTE_P | PTE_W, 1) < 0)
+        return -1;
+      pa += PGSIZE;
+    }
+  }
+  return 0;
+}
+
+// Map the low 1MB and every e820 range in the direct map.
+static int
+setupdirectmap(pml4e_t *pml4)
+{
+  struct e820_entry *e;
+  uint64_t lo, hi, mapped = EXTMEM;
+  int gbpages = cpuid_feature(CPUID_FEATURE_PDPE1GB);
+  uint32_t i;
+
+  if (mapdirect(pml4, 0, EXTMEM, gbpages) < 0)
+    return -1;
+  // e820 ranges are sorted; skip what an earlier one mapped
+  e = e820_map.entries;
+  for (i = 0; i != e820_map.nr; ++i, ++e) {
+    lo = max(PGROUNDDOWN(e->addr), mapped);
+    hi = min(PGROUNDUP(e->addr + e->len), MAXPHYSMEM);
+    if (lo >= hi)
+      continue;
+    if (mapdirect(pml4, lo, hi, gbpages) < 0)
+      return -1;
+    mapped = hi;
+  }
+  return 0;
+}
+
+// Set up kernel part of a page table. The kernel part is built once, for
+// kpml4; every other page table shares its upper half.
 pml4e_t*
 setupkvm(void)
 {
@@ -176,6 +305,11 @@ setupkvm(void)
     return 0;
   memset(pml4, 0, PGSIZE);
 
+  if (kpml4) {
+    memmove(&pml4[PTRS_PER_PML4 / 2], &kpml4[PTRS_PER_PML4 / 2], PGSIZE / 2);
+    return pml4;
+  }
+
   struct kmap {
     void *virt;
     uint64_t phys_start;
@@ -184,7 +318,7 @@ setupkvm(void)
   } kmap[] = {
     { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
     { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
-    { (void*)data,     V2P(data),     (uint64_t) npages * PGSIZE,   PTE_W}, // kern data+memory
+    { (void*)data,     V2P(data),     V2P(_end), PTE_W}, // kern data+bss
     { (void*)DEVSPACE, 0xFE000000,    0x100000000,         PTE_W}, // more devices
   };
 
@@ -192,6 +326,8 @@ setupkvm(void)
     if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P, 1) < 0)
       return 0;
   }
+  if (setupdirectmap(pml4) < 0)
+    return 0;
   return pml4;
 }
 
@@ -233,14 +369,26 @@ find_next_possible_page(pml4e_t *pml4, uint64_t va)
 int
 deallocuvm(pml4e_t *pml4, char* start, uint64_t oldsz, uint64_t newsz)
 {
+  pde_t *pde;
   pte_t *pte;
   uint64_t a, pa;
+  uint i;
 
   if(newsz >= oldsz)
     return oldsz;
 
   a = PGROUNDUP((uint64_t)start + newsz);
   for(; a  < (uint64_t)start + oldsz; a += PGSIZE){
+    pde = walkpgdir(pml4, (char*)a, 0);
+    if(pde && (*pde & PTE_PS)){
+      // a 2MB page goes as a whole
+      pa = HPDE_ADDR(*pde);
+      for (i = 0; i < HPGPAGES; i++)
+        kfree(P2V(pa + i * PGSIZE));
+      *pde = 0;
+      a = HPGROUNDDOWN(a) + HPGSIZE - PGSIZE;
+      continue;
+    }
     pte = walkpml4(pml4, (char*)a, 0);
     if(!pte) {
       a = find_next_possible_page(pml4, a);
@@ -262,7 +410,8 @@ freevm_pgdir(pde_t *pgdir)
 {
   uint i;
   for (i = 0; i < PTRS_PER_PD; i++) {
-    if (pgdir[i] & PTE_P) {
+    // 2MB pages are not page tables
+    if ((pgdir[i] & PTE_P) && !(pgdir[i] & PTE_PS)) {
       char *v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -285,14 +434,14 @@ freevm_pdpt(pdpte_t *pdpt)
 
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part. The kernel part is shared with kpml4.
 void
 freevm(pml4e_t *pml4)
 {
   uint i;
   assertm(pml4, "freevm: no pml4");
   deallocuvm(pml4, 0, SZ_4G, 0);
-  for(i = 0; i < PTRS_PER_PML4; i++){
+  for(i = 0; i < PTRS_PER_PML4 / 2; i++){
     if(pml4[i] & PTE_P){
       pdpte_t *pdpt = P2V(PDPT_ADDR(pml4[i]));
       freevm_pdpt(pdpt);
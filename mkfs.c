@@ -23,7 +23,7 @@ typedef unsigned char  uchar;
 #define CONSOLE 1
 
 // Disk layout:
-// [ boot block | sb block | swap | free bit map | inode file start | data blocks ]
+// [ boot block | sb block | swap | free bit map | inode file start | data blocks | ... | log ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
@@ -44,6 +44,7 @@ void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iallocblocks(uint inum, int start, int numblks);
 void iappend(uint inum, void *p, int n);
+uint pgblocks(uint n);
 
 // convert to intel byte order
 ushort
@@ -74,7 +75,7 @@ main(int argc, char *argv[])
   int i, cc, fd;
   uint inodefileino, inodefileblkn;
   uint rootino, rootdir_size, rootdir_blocks;
-  uint inum, off;
+  uint inum;
   uint inum_count;
   struct dirent de;
   char buf[BSIZE];
@@ -98,7 +99,7 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
+  // 1 fs block = BSIZE / 512 disk sectors
   nmeta = 2 + nbitmap;
   nblocks = FSSIZE - nmeta;
 
@@ -106,6 +107,11 @@ main(int argc, char *argv[])
   sb.nblocks = xint(nblocks);
   sb.bmapstart = xint(2);
   sb.inodestart = xint(2+nbitmap);
+  sb.logstart = xint(FSSIZE - (LOGSIZE + 1));
+  sb.nlog = xint(LOGSIZE + 1);
+  sb.bsize = xint(BSIZE);
+  for(i = 0; i < NDISK; i++)
+    sb.cids[i] = xint(-1);
 
   printf("nmeta %d (boot, super, bitmap blocks %u) blocks %d total %d\n",
        nmeta, nbitmap, nblocks, FSSIZE);
@@ -126,11 +132,12 @@ main(int argc, char *argv[])
 
   // setup inode file data area
   rinode(inodefileino, &din);
-  din.data.startblkno = sb.inodestart;
+  din.extents[0].startblkno = sb.inodestart;
   inodefileblkn = inum_count/IPB;
   if (inodefileblkn == 0 || (inum_count * sizeof(struct dinode) % BSIZE))
     inodefileblkn++;
-  din.data.nblocks = xint(inodefileblkn);
+  inodefileblkn = pgblocks(inodefileblkn);
+  din.extents[0].nblocks = xint(inodefileblkn);
   din.size = xint(inum_count * sizeof(struct dinode));
   winode(inodefileino, &din);
 
@@ -146,6 +153,7 @@ main(int argc, char *argv[])
   rootdir_blocks = rootdir_size / BSIZE;
 	if (rootdir_size % BSIZE)
 		rootdir_blocks += 1;
+  rootdir_blocks = pgblocks(rootdir_blocks);
   iallocblocks(rootino, freeblock, rootdir_blocks);
   freeblock += rootdir_blocks;
 
@@ -197,33 +205,33 @@ main(int argc, char *argv[])
     iappend(rootino, &de, sizeof(de));
 
     rinode(inum, &din);
-    din.data.startblkno = xint(freeblock);
+    din.extents[0].startblkno = xint(freeblock);
 		winode(inum, &din);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
 
     rinode(inum, &din);
-    din.data.nblocks = xint(xint(din.size) / BSIZE + (xint(din.size) % BSIZE == 0 ? 0 : 1));
-    freeblock += xint(din.data.nblocks);
+    din.extents[0].nblocks = xint(pgblocks(xint(din.size) / BSIZE + (xint(din.size) % BSIZE == 0 ? 0 : 1)));
+    freeblock += xint(din.extents[0].nblocks);
     winode(inum, &din);
 
 		printf("inum: %d name: %s size %d start: %d nblocks: %d\n",
-        inum, name, xint(din.size), xint(din.data.startblkno), xint(din.data.nblocks));
+        inum, name, xint(din.size), xint(din.extents[0].startblkno), xint(din.extents[0].nblocks));
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
   rinode(inum, &din);
   printf("inum: %d size %d start: %d nblocks: %d\n",
-      inum,xint(din.size), xint(din.data.startblkno), xint(din.data.nblocks));
+      inum,xint(din.size), xint(din.extents[0].startblkno), xint(din.extents[0].nblocks));
 
+  // every container gets a copy of the first UDISKSIZE blocks, and the
+  // disks of all containers end before the log
+  if(freeblock > UDISKSIZE || (NDISK + 1) * UDISKSIZE > FSSIZE - (LOGSIZE + 1)){
+    fprintf(stderr, "mkfs: %u blocks of files do not fit a %d block user disk\n",
+            freeblock, UDISKSIZE);
+    exit(1);
+  }
   balloc(freeblock);
 
   exit(0);
@@ -297,6 +305,14 @@ ialloc(ushort type)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Rounds n blocks up to whole pages; the kernel maps a page of a file
+// to one extent.
+uint
+pgblocks(uint n)
+{
+  return (n + PGBLOCKS - 1) / PGBLOCKS * PGBLOCKS;
+}
+
 void
 balloc(int used)
 {
@@ -323,8 +339,8 @@ void
 iallocblocks(uint inum, int start, int numblks) {
   struct dinode din;
   rinode(inum, &din);
-  din.data.startblkno = xint(start);
-  din.data.nblocks = xint(numblks);
+  din.extents[0].startblkno = xint(start);
+  din.extents[0].nblocks = xint(numblks);
   winode(inum, &din);
 }
 
@@ -342,9 +358,9 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(xint(din.data.startblkno) + fbn, buf);
+    rsect(xint(din.extents[0].startblkno) + fbn, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(xint(din.data.startblkno) + fbn, buf);
+    wsect(xint(din.extents[0].startblkno) + fbn, buf);
     n -= n1;
     off += n1;
     p += n1;
@@ -0,0 +1,91 @@
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+#include <syscall_message.h>
+
+// File system calls for guest apps. Each one is a message to the guest os
+// that owns the app; the guest keeps the fd table and answers reads from its
+// own file cache.
+
+int aopen(char *path, int mode) {
+  struct arg args[3];
+
+  if (strlen(path) >= MAX_STRING_SIZE)
+    return -1;
+
+  // num args not including this
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 2;
+
+  args[1].arg_type = STRING_TYPE;
+  strcpy(args[1].arg_val.string, path);
+
+  args[2].arg_type = INT_TYPE;
+  args[2].arg_val.i = mode;
+
+  return app_syscall(MESSAGE_OPEN, args);
+}
+
+int aread(int fd, void *buf, int n) {
+  struct arg args[4];
+
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 3;
+
+  args[1].arg_type = INT_TYPE;
+  args[1].arg_val.i = fd;
+
+  args[2].arg_type = VOID_PTR_TYPE;
+  args[2].arg_val.void_ptr = buf;
+
+  args[3].arg_type = INT_TYPE;
+  args[3].arg_val.i = n;
+
+  return app_syscall(MESSAGE_READ, args);
+}
+
+int afstat(int fd, struct stat *st) {
+  struct arg args[3];
+
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 2;
+
+  args[1].arg_type = INT_TYPE;
+  args[1].arg_val.i = fd;
+
+  args[2].arg_type = STRUCT_STAT_PTR_TYPE;
+  args[2].arg_val.stat_ptr = st;
+
+  return app_syscall(MESSAGE_FSTAT, args);
+}
+
+int aclose(int fd) {
+  struct arg args[2];
+
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 1;
+
+  args[1].arg_type = INT_TYPE;
+  args[1].arg_val.i = fd;
+
+  return app_syscall(MESSAGE_CLOSE, args);
+}
+
+// Grows (or shrinks) the heap the guest os maps for the app. Returns the
+// old break, or (char *) -1 on failure. The guest hands out the heap from
+// the app's window above 2G, so the reply is an unsigned 32-bit address.
+// An app should grow its heap with either asbrk or sbrk, not both.
+char *asbrk(int n) {
+  struct arg args[2];
+  int ret;
+
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 1;
+
+  args[1].arg_type = INT_TYPE;
+  args[1].arg_val.i = n;
+
+  if ((ret = app_syscall(MESSAGE_SBRK, args)) == -1)
+    return (char *) -1;
+  return (char *) (uint64_t) (uint) ret;
+}
@@ -0,0 +1,24 @@
+#include <cdefs.h>
+#include <user.h>
+#include <syscall_message.h>
+
+// Process calls for guest apps, served by the guest os that owns the app.
+
+// Clones the calling app copy-on-write. Returns the child's pid in the
+// parent and 0 in the child, which is a child of the caller for wait().
+int afork(void) {
+  struct arg args[1];
+
+  // num args not including this
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 0;
+
+  return app_syscall(MESSAGE_FORK, args);
+}
+
+// Sets a to a string argument of a hypercall holding s, which must be
+// shorter than MAX_STRING_SIZE.
+void setstrarg(struct arg *a, char *s) {
+  a->arg_type = STRING_TYPE;
+  strcpy(a->arg_val.string, s);
+}
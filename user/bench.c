@@ -0,0 +1,66 @@
+#include <cdefs.h>
+#include <bench.h>
+#include <user.h>
+
+// Reporting shared by the benchmarks. Each report is one line: what was
+// measured, how much of it, the ticks it took and how far the chosen
+// sysinfo counters moved meanwhile.
+
+static struct {
+  int counter;
+  char *label;
+} labels[] = {
+  {BENCH_BLOCK_READS, "block reads"},
+  {BENCH_BLOCK_MISSES, "block misses"},
+  {BENCH_DISK_WRITES, "disk writes"},
+  {BENCH_DISK_COMMANDS, "disk commands"},
+  {BENCH_COMMITS, "commits"},
+  {BENCH_PCACHE_HITS, "page cache hits"},
+  {BENCH_DCACHE_HITS, "name cache hits"},
+};
+
+static int
+value(struct sys_info *s, int counter)
+{
+  switch (counter) {
+  case BENCH_BLOCK_READS:
+    return s->num_disk_reads;
+  case BENCH_BLOCK_MISSES:
+    return s->num_disk_reads - s->num_bcache_hits;
+  case BENCH_DISK_WRITES:
+    return s->num_disk_writes;
+  case BENCH_DISK_COMMANDS:
+    return s->num_disk_requests;
+  case BENCH_COMMITS:
+    return s->num_log_commits;
+  case BENCH_PCACHE_HITS:
+    return s->num_pcache_hits;
+  case BENCH_DCACHE_HITS:
+    return s->num_dcache_hits;
+  }
+  return 0;
+}
+
+void
+benchstart(struct bench *b)
+{
+  sysinfo(&b->before);
+  b->start = uptime();
+}
+
+// Prints "name: what, n unit, ticks" followed by the change of each
+// counter set in counters.
+void
+benchreport(struct bench *b, char *what, int n, char *unit, int counters)
+{
+  struct sys_info after;
+  int ticks = uptime() - b->start;
+
+  sysinfo(&after);
+  printf(1, "%s: %s, %d %s, %d ticks", b->name, what, n, unit, ticks);
+  for (int i = 0; i < sizeof(labels) / sizeof(labels[0]); i++)
+    if (counters & labels[i].counter)
+      printf(1, ", %d %s", value(&after, labels[i].counter) -
+             value(&b->before, labels[i].counter), labels[i].label);
+  printf(1, "\n");
+}
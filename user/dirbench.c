@@ -0,0 +1,92 @@
+// dirbench [nfiles]
+// Fills the root directory with nfiles empty files (default 1000; try
+// 10000 too), named f0, f1, ..., then times open() and close() of:
+// every one of them once, in order; the first HOTFILES of them NROUNDS
+// times over; and MISSING names that do not exist, twice over. Reports
+// the ticks, block reads (bread calls, cached or not), page cache hits
+// and name cache hits of each pass. With a hash index a cold lookup
+// reads a few pages of the directory instead of all of it, and a name
+// looked up before, present or not, comes from the name cache without
+// reading anything. Creating the files takes a while the first time.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <user.h>
+
+#define DEFAULT_NFILES 1000
+#define HOTFILES 100
+#define NROUNDS 10
+#define MISSING 100
+#define COUNTERS (BENCH_BLOCK_READS | BENCH_PCACHE_HITS | BENCH_DCACHE_HITS)
+
+static char name[16];
+
+// Sets name to c followed by i in decimal.
+static char *
+mkname(char c, int i)
+{
+  char digits[10];
+  int n = 0, k = 0;
+
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while (i > 0);
+  name[k++] = c;
+  while (n > 0)
+    name[k++] = digits[--n];
+  name[k] = 0;
+  return name;
+}
+
+int main(int argc, char *argv[]) {
+  int nfiles = argc > 1 ? atoi(argv[1]) : DEFAULT_NFILES;
+  struct bench bench = {"dirbench"};
+  int fd, i, r, found;
+
+  // O_CREATE always makes a new file, so only create the missing ones
+  for (i = 0; i < nfiles; i++) {
+    if ((fd = open(mkname('f', i), O_RDONLY)) < 0 &&
+        (fd = open(name, O_CREATE | O_RDWR)) < 0) {
+      printf(1, "dirbench: cannot create %s\n", name);
+      exit();
+    }
+    close(fd);
+  }
+
+  benchstart(&bench);
+  for (i = 0; i < nfiles; i++) {
+    if ((fd = open(mkname('f', i), O_RDONLY)) < 0) {
+      printf(1, "dirbench: cannot open %s\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  benchreport(&bench, "every file", nfiles, "opens", COUNTERS);
+
+  benchstart(&bench);
+  for (r = 0; r < NROUNDS; r++) {
+    for (i = 0; i < HOTFILES && i < nfiles; i++) {
+      if ((fd = open(mkname('f', i), O_RDONLY)) >= 0)
+        close(fd);
+    }
+  }
+  benchreport(&bench, "hot files", NROUNDS * (HOTFILES < nfiles ? HOTFILES : nfiles),
+              "opens", COUNTERS);
+
+  found = 0;
+  benchstart(&bench);
+  for (r = 0; r < 2; r++) {
+    for (i = 0; i < MISSING; i++) {
+      if ((fd = open(mkname('x', i), O_RDONLY)) >= 0) {
+        close(fd);
+        found++;
+      }
+    }
+  }
+  benchreport(&bench, "missing files", 2 * MISSING, "opens", COUNTERS);
+  if (found)
+    printf(1, "dirbench: %d missing files were found\n", found);
+  exit();
+  return 0;
+}
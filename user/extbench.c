@@ -0,0 +1,75 @@
+// extbench
+// Grows two new files side by side, a 4KB write to each in turn, until
+// each holds FILEBYTES, and syncs them. Then reads each back front to
+// back and checks it. Reports the ticks and disk commands of each pass:
+// files that grow in place, or ahead of their writes, stay in few
+// extents and read back in few merged commands, while files whose
+// blocks alternate on disk cost a command every few blocks. Run it
+// right after boot.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <stat.h>
+#include <user.h>
+
+#define FILEBYTES (256 * 1024) // both fit the container disk, UDISKSIZE blocks
+#define NFILES 2
+#define COUNTERS (BENCH_DISK_COMMANDS)
+
+static char *names[NFILES] = {"extbench.a", "extbench.b"};
+
+static char buf[4096];
+
+int main(int argc, char *argv[]) {
+  struct bench bench = {"extbench"};
+  int fds[NFILES], i, n, off, bytes;
+
+  for (i = 0; i < NFILES; i++) {
+    // O_CREATE always makes a new file, so only create it once
+    if ((fds[i] = open(names[i], O_RDWR)) < 0 &&
+        (fds[i] = open(names[i], O_CREATE | O_RDWR)) < 0) {
+      printf(1, "extbench: cannot create %s\n", names[i]);
+      exit();
+    }
+  }
+
+  sync();
+  benchstart(&bench);
+  bytes = 0;
+  for (off = 0; off < FILEBYTES; off += sizeof(buf)) {
+    for (i = 0; i < NFILES; i++) {
+      memset(buf, 'a' + i, sizeof(buf));
+      if (write(fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+        printf(1, "extbench: write to %s failed at %d\n", names[i], off);
+        exit();
+      }
+      bytes += sizeof(buf);
+    }
+  }
+  sync();
+  benchreport(&bench, "interleaved write and sync", bytes, "bytes", COUNTERS);
+  for (i = 0; i < NFILES; i++)
+    close(fds[i]);
+
+  for (i = 0; i < NFILES; i++) {
+    if ((fds[i] = open(names[i], O_RDONLY)) < 0) {
+      printf(1, "extbench: cannot open %s\n", names[i]);
+      exit();
+    }
+    benchstart(&bench);
+    bytes = 0;
+    while ((n = read(fds[i], buf, sizeof(buf))) > 0) {
+      for (int j = 0; j < n; j++) {
+        if (buf[j] != 'a' + i) {
+          printf(1, "extbench: %s corrupt at %d\n", names[i], bytes + j);
+          exit();
+        }
+      }
+      bytes += n;
+    }
+    benchreport(&bench, names[i], bytes, "bytes", COUNTERS);
+    close(fds[i]);
+  }
+  exit();
+  return 0;
+}
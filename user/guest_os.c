@@ -3,125 +3,311 @@
 #include <syscall_message.h>
 #include <guest_space.h>
 #include <memlayout.h>
+#include <mmu.h>
+#include <fs.h>
+#include <fcntl.h>
+#include <stat.h>
 
-// TODO: When app process exits fix ppn bitmap in guest OS and in xkvisor. Use unmap.
-//       When guest app exits we can send a cleanup message to guest OS to update these data
-//       structures.
-//       Also fix proc map in guest OS and xkvisor since the counts just increase.
+// Each app gets its own window of [2G, 4G) so that the guest os mirror
+// mappings of different apps never overlap. The stack grows down from the
+// midpoint of the window and the heap grows up from it. An app forked with
+// MESSAGE_FORK shares the window of its parent.
+#define APP_WINDOW_BASE SZ_2G
+#define APP_WINDOW_SIZE (SZ_2G / MAX_PROC)
+#define APP_STACK_PAGES 10
 
-// guest os copies of xkvisor bitmaps. xkvisor will upate these through system call return params
-static struct app_va_segment proc_map[MAX_PROC];
-static uint8_t page_map[MAX_PHYS_PAGES];   
+// ticks between virtual timer events
+#define GUEST_TIMER_PERIOD 10
+
+// app fds served by the guest; 0-2 are the console, see guest_write
+#define GUEST_NOFILE 16
+
+// guest file cache. A slot holds a file of up to FCACHE_FILESIZE bytes;
+// bigger files are read through a guest fd.
+#define FCACHE_NFILES 8
+#define FCACHE_FILESIZE (20 * BSIZE)
+
+struct fcache {
+  int valid;
+  int nref;                   // app fds reading this copy
+  uint lastuse;               // fcache_clock at the last open, for LRU
+  char path[MAX_STRING_SIZE];
+  struct stat st;
+  char data[FCACHE_FILESIZE];
+};
+
+struct guest_fd {
+  int used;
+  struct fcache *c; // cached copy, or 0 if read through kfd
+  int kfd;          // guest fd of an uncached file
+  uint off;
+};
+
+// guest os record of an app it is running
+struct guest_app {
+  struct app_va_segment seg; // owned/pid/base/midpoint/bound, see guest_space.h
+  int parent;                // pid of the process that asked for the app
+  int npages;                // guest frames mapped into the app
+  int nsyscalls;             // messages served for the app
+  uint brk;                  // bytes of heap mapped above the midpoint
+  int window;                // index of the va window the app runs in
+  int forked;                // 1 if it shares frames copy-on-write with other apps
+  int pooled;                // 1 while it is a ready shell in a zygote pool
+  struct guest_fd ofile[GUEST_NOFILE];
+};
+
+static struct guest_app apps[MAX_PROC];
+
+// number of apps running in each va window
+static int window_refs[MAX_PROC];
+
+// Zygote pools: per program, up to ZYGOTE_DEPTH apps that are created,
+// loaded and have their stack mapped, waiting for an INIT_APP to bind and
+// deploy them. Programs are pooled once they have been launched.
+#define ZYGOTE_NPATHS 4
+#define ZYGOTE_DEPTH 2
+
+struct zygote {
+  char path[MAX_STRING_SIZE]; // program, empty if the pool is unused
+  int n;                      // ready shells
+  struct guest_app *shells[ZYGOTE_DEPTH];
+};
+
+static struct zygote zygotes[ZYGOTE_NPATHS];
+
+// guest os copy of the frames xkvisor leases us, refreshed by sync_frames.
+// It grows with the lease, so the guest is not limited to low memory.
+static struct guest_frame *frames;
+static int nframes;   // entries in use
+static int maxframes; // entries there is room for
+static int nextidle;  // frames below it were in use when last looked at
+
+// paravirtual disk, see pvblk.h
+static struct pvblk_ring blkring;
+static int blkfree[PVBLK_RING_SIZE]; // 1 if descriptor i is not in flight
+static int blkstatus[PVBLK_RING_SIZE];
+static int blkpending;               // descriptors posted since the last notify
+
+// xkvisor ticks as of the last virtual timer event
+static uint now;
+
+static struct fcache fcache[FCACHE_NFILES];
+static uint fcache_clock;
+
+// staging buffer for reads of uncached files
+static char bounce[BSIZE];
 
 // helpers
-static int next_available_ppn(void);
+static void sync_frames(void);
+static struct guest_frame *take_frame(void);
+static void put_frame(struct guest_frame *f);
+static struct guest_app *findapp(int pid);
+static void fdclose(struct guest_fd *f);
+static void retire_app(struct guest_app *app);
+static struct guest_app *zygote_take(char *path, int parent_pid);
+static void zygote_learn(char *path);
+static void zygote_refill(void);
+static void zygote_forget(struct guest_app *app);
 
 // guest OS syscall handler
-void guest_syscall(struct syscall_message syscall);
+void guest_syscall(struct syscall_message *syscall);
 
 // guest syscalls
-int guest_write(struct syscall_message syscall);
-int guest_init_app(struct syscall_message syscall);
+int guest_write(struct syscall_message *syscall);
+int guest_init_app(struct syscall_message *syscall);
+int guest_destroy_app(struct syscall_message *syscall);
+int guest_mem_pressure(struct syscall_message *syscall);
+int guest_blk_complete(struct syscall_message *syscall);
+int guest_timer(struct syscall_message *syscall);
+int guest_open(struct syscall_message *syscall);
+int guest_read(struct syscall_message *syscall);
+int guest_fstat(struct syscall_message *syscall);
+int guest_close(struct syscall_message *syscall);
+int guest_sbrk(struct syscall_message *syscall);
+int guest_fork(struct syscall_message *syscall);
+int guest_cow_fault(struct syscall_message *syscall);
+
+// paravirtual disk driver
+int blk_submit(uint blockno, uint nblocks, char *data, int type);
+int blk_kick(void);
+int blk_rw(uint blockno, uint nblocks, char *data, int type);
 
 // guest OS syscall table
-static int (*syscalls[])(struct syscall_message syscall) = {
-    [MESSAGE_WRITE] = guest_write,       // do an xkvisor write
-    [MESSAGE_INIT_APP] = guest_init_app, // create user process in guest_init_app
+static int (*syscalls[])(struct syscall_message *syscall) = {
+    [MESSAGE_WRITE] = guest_write,             // do an xkvisor write
+    [MESSAGE_INIT_APP] = guest_init_app,       // create user process in guest_init_app
+    [MESSAGE_INIT_APP_COLD] = guest_init_app,  // same, bypassing the zygote pools
+    [MESSAGE_DESTROY_APP] = guest_destroy_app, // app exited, sent by xkvisor
+    [MESSAGE_MEM_PRESSURE] = guest_mem_pressure, // xkvisor is low on memory
+    [MESSAGE_BLK_COMPLETE] = guest_blk_complete, // disk requests finished
+    [MESSAGE_TIMER] = guest_timer,               // virtual timer fired
+    [MESSAGE_OPEN] = guest_open,                 // read-only open through the file cache
+    [MESSAGE_READ] = guest_read,
+    [MESSAGE_FSTAT] = guest_fstat,
+    [MESSAGE_CLOSE] = guest_close,
+    [MESSAGE_SBRK] = guest_sbrk,                 // grow the heap with guest frames
+    [MESSAGE_FORK] = guest_fork,                 // copy-on-write clone of an app
+    [MESSAGE_COW_FAULT] = guest_cow_fault,       // app wrote to a shared frame, sent by xkvisor
 };
 
-void guest_syscall(struct syscall_message syscall) {
-  int num = syscall.syscall_index;
-  if(num > 0 && num <= MAX_GUEST_SYSCALLS && syscalls[num]) {
-    syscalls[num](syscall);
+// Dispatches one message and answers it to the process that sent it, so
+// every app only ever waits on its own messages.
+void guest_syscall(struct syscall_message *syscall) {
+  int num = syscall->syscall_index;
+  int ret;
+  struct guest_app *app;
+
+  if ((app = findapp(syscall->pid)) != 0)
+    app->nsyscalls++;
+
+  if(num > 0 && num < sizeof(syscalls) / sizeof(syscalls[0]) && syscalls[num]) {
+    ret = syscalls[num](syscall);
   } else {
-    printf(STDOUT, "pid: %d, unknown syscall %d", syscall.pid, num);
-    kill(syscall.pid);
+    printf(STDOUT, "pid: %d, unknown syscall %d\n", syscall->pid, num);
+    kill(syscall->pid);
+    ret = -1;
   }
-}
 
-static int new_app_pid;
+  // messages queued by xkvisor itself have nobody waiting on a reply
+  if (syscall->pid != 0 && num != MESSAGE_DESTROY_APP)
+    gresume(syscall->pid, ret);
+
+  zygote_refill();
+}
 
 int main(int argc, char *argv[]) {
   printf(STDOUT, "Booting Guest OS...\n");
 
-  int available_pages = gquery_user_pages(page_map); // copies kernel proc page map to stack
-                                                    // returns number of available pages
-  printf(STDOUT, "%d pages allocated for guest ppn reserve\n", available_pages);
+  sync_frames();
+  printf(STDOUT, "%d pages allocated for guest ppn reserve\n", nframes);
 
-  struct syscall_message syscall;
+  for (int i = 0; i < PVBLK_RING_SIZE; i++)
+    blkfree[i] = 1;
+  if (gblk_setup(&blkring) < 0)
+    printf(STDOUT, "guest os: no paravirtual disk\n");
+  if (gtimer(GUEST_TIMER_PERIOD, GUEST_TIMER_PERIOD) < 0)
+    printf(STDOUT, "guest os: no virtual timer\n");
 
-  // TODO: fix new_app_id since this is hacky. We want gresume to always resume
-  // the application process even if syscall.pid is shell. new_app_pid is set
-  // whenever we allocate a new proc.
+  struct syscall_message syscall;
 
+  // dispatch loop: messages from any number of apps are served in arrival
+  // order, and a reply only wakes the app that sent the message.
   for(;;) {
-    gnext_syscall(&syscall); // will put guest OS to sleep if no syscalls ready
-    guest_syscall(syscall);
-    // don't resume shell, only resume new app process. resume shell on error
-    gresume(new_app_pid); 
+    if (gnext_syscall(&syscall) < 0) // will put guest OS to sleep if no syscalls ready
+      continue;
+    guest_syscall(&syscall);
   }
 }
 
-int guest_write(struct syscall_message syscall) {
-  int fd = (syscall.args)[0].arg_val.i;
-  char c = (syscall.args)[1].arg_val.c;
-  int n = (syscall.args)[2].arg_val.i;
+int guest_write(struct syscall_message *syscall) {
+  int fd = (syscall->args)[0].arg_val.i;
+  char c = (syscall->args)[1].arg_val.c;
+  int n = (syscall->args)[2].arg_val.i;
 
   int written;
   if ((written = write(fd, &c, n)) < 0) {
     // FIXME: move checking to user lib
     printf(STDOUT, "kill write failed...\n");
-    kill(syscall.pid);
+    kill(syscall->pid);
   }
   return written;
 }
 
-int guest_init_app(struct syscall_message syscall) {
-  // get argv and argc
-  int argc = syscall.num_args;
-  char *argv[argc + 1];
-  argv[argc] = '\0';
+// Periodic virtual timer event. Keeps the guest's notion of time and bounds
+// how long posted disk requests can wait for a kick.
+int guest_timer(struct syscall_message *syscall) {
+  now = syscall->args[0].arg_val.i;
+  blk_kick();
+  return 0;
+}
 
-  for (int i = 0; i < argc; i++) {
-    argv[i] = syscall.args[i].arg_val.string;
+// Kills an app that was handed out by xkvisor but could not be set up. It
+// is started so that it exits on its first trap; xkvisor then returns its
+// frames and sends MESSAGE_DESTROY_APP.
+static int fail_app(struct guest_app *app) {
+  kill(app->seg.pid);
+  gresume(app->seg.pid, 0);
+  return -1;
+}
+
+// Creates an app running path as a child of parent_pid: a proc with its
+// own va window, the program loaded and a zeroed stack mapped. The app is
+// left EMBRYO for launch_app. Returns 0 on failure.
+static struct guest_app *create_app(char *path, int parent_pid) {
+  // pick a free slot and an unused va window
+  struct guest_app *app = 0;
+  int window;
+  for (int slot = 0; slot < MAX_PROC; slot++) {
+    if (!apps[slot].seg.owned) {
+      app = &apps[slot];
+      break;
+    }
+  }
+  for (window = 0; window < MAX_PROC && window_refs[window]; window++)
+    ;
+  if (app == 0 || window == MAX_PROC) {
+    printf(STDOUT, "guest os: too many apps\n");
+    return 0;
   }
 
   // set bounds for guest application
-  uint64_t base = SZ_2G;
-  uint64_t midpoint = SZ_3G;
-  uint64_t bound = SZ_4G;
-  printf(STDOUT, "VA Bounds Set At: 2G, 3G, 4G\n");
-
-  // request a proc from xkvisor, set base, midpoint, bound as uint64_t in proc_map, see guest_space.h
-  // parent of new proc is set currently to shell, shell cleans up memory.
-  new_app_pid = grequest_proc(proc_map, base, midpoint, bound);
+  uint64_t base = APP_WINDOW_BASE + window * APP_WINDOW_SIZE;
+  uint64_t midpoint = base + APP_WINDOW_SIZE / 2;
+  uint64_t bound = base + APP_WINDOW_SIZE;
 
-  // TODO: when app exits we need to zero app process array in guest os and kernel proc copy.
-  printf(STDOUT, "Received New Process, PID: %d\n", new_app_pid);
+  // request a proc from xkvisor, set base, midpoint, bound as uint64_t in app->seg, see guest_space.h
+  // parent of new proc cleans up the proc when it exits.
+  int pid = grequest_proc(&app->seg, base, midpoint, bound, parent_pid);
+  if (pid < 0) {
+    printf(STDOUT, "guest os: no proc for %s\n", path);
+    return 0;
+  }
+  app->parent = parent_pid;
+  app->npages = 0;
+  app->nsyscalls = 0;
+  app->brk = 0;
+  app->window = window;
+  app->forked = 0;
+  app->pooled = 0;
+  memset(app->ofile, 0, sizeof(app->ofile));
+  window_refs[window]++;
 
   // load code of new program and set rip, sets code region to 0, sets heap start
   // and size of heap to 0. unmapped in guest os, mapped to 0 in process
-  if (gload_program(new_app_pid, argv[0]) == -1) {
-    printf(STDOUT, "exec failed on: %s\n", argv[0]);
-    // TODO: add error handling, cleanup proc mem, reset bitmap for page and proc
-    new_app_pid = SHELL_PID;
-    return -1;
+  if (gload_program(pid, path) == -1) {
+    // xkvisor already tore the proc down
+    printf(STDOUT, "exec failed on: %s\n", path);
+    retire_app(app);
+    return 0;
   }
 
-  // set 10 pages on the stack
-  for (int i = 1; i <= 10; i++) {
-    int ppn = next_available_ppn();
-    gaddmap(new_app_pid, ppn, midpoint - (i * PGSIZE), 1, 1);
-    printf(STDOUT, "Mapping ppn %d at VA: 0x%x\n", ppn, midpoint - (i * PGSIZE));
+  // set up the stack pages
+  for (int i = 1; i <= APP_STACK_PAGES; i++) {
+    struct guest_frame *f = take_frame();
+    uint64_t va = midpoint - (i * PGSIZE);
+    if (f == 0 || gaddmap(pid, f->ppn, va, 1, 1) < 0) {
+      printf(STDOUT, "guest os: out of memory for %s\n", path);
+      if (f)
+        put_frame(f);
+      fail_app(app);
+      return 0;
+    }
+    memset((void *) va, 0, PGSIZE); // through our mirror mapping
+    app->npages++;
   }
+  return app;
+}
 
-  // run program
+// Copies argv onto the stack of an app made by create_app and starts it.
+// Returns its pid, or -1 if xkvisor could not deploy it.
+static int launch_app(struct guest_app *app, int argc, char **argv) {
   struct syscall_message param;
   struct arg app_argc;
   struct arg app_argv;
+  int pid = app->seg.pid;
 
   // store arguments.
-  param.pid = new_app_pid;
+  param.pid = pid;
   param.num_args = 2;
   app_argc.arg_type = INT_TYPE;
   app_argc.arg_val.i = argc;
@@ -131,26 +317,595 @@ int guest_init_app(struct syscall_message syscall) {
   param.args[1] = app_argv;
 
   // setup program arguments and rsp etc.
-  // TODO: Fix argument setup in gdeployprogram
   if (gdeploy_program(&param) == -1) {
-    printf(STDOUT, "guest app deployment failed");
-    new_app_pid = SHELL_PID;
+    // xkvisor already tore the proc down and took back its frames
+    printf(STDOUT, "guest app deployment failed\n");
+    retire_app(app);
+    sync_frames();
     return -1;
-  } 
+  }
 
-  // only set runnable in next syscall gresume to prevent deadlock
-  return 1;
+  // start the app; the reply to the requester is the new pid
+  gresume(pid, 0);
+  return pid;
 }
 
-// retrieves next available ppn from page pool. sets to 2 marking as in use.
-// 1 is available, 0 is not owned.
-static int next_available_ppn(void) 
-{
-  for (int i = 0; i < MAX_PHYS_PAGES; i++) {
-    if (page_map[i] == 1) {
-      page_map[i] = 2; // set page as in use by app
-      return i;
+// Creates an app for the requesting process. Replies with the pid of the new
+// app, which becomes a child of the requester. A MESSAGE_INIT_APP for a
+// program with a warm pool only binds and deploys a ready shell;
+// MESSAGE_INIT_APP_COLD always builds the app from scratch.
+int guest_init_app(struct syscall_message *syscall) {
+  struct guest_app *app;
+
+  // get argv and argc
+  int argc = syscall->num_args;
+  char *argv[argc + 1];
+  argv[argc] = 0;
+
+  if (argc < 1)
+    return -1;
+  for (int i = 0; i < argc; i++) {
+    argv[i] = syscall->args[i].arg_val.string;
+    argv[i][MAX_STRING_SIZE - 1] = 0;
+  }
+
+  app = 0;
+  if (syscall->syscall_index == MESSAGE_INIT_APP)
+    app = zygote_take(argv[0], syscall->pid);
+  if (app == 0 && (app = create_app(argv[0], syscall->pid)) == 0)
+    return -1;
+  if (syscall->syscall_index == MESSAGE_INIT_APP)
+    zygote_learn(argv[0]);
+  return launch_app(app, argc, argv);
+}
+
+// Returns a pooled shell of path bound to parent_pid, or 0 on a miss.
+static struct guest_app *zygote_take(char *path, int parent_pid) {
+  struct zygote *z;
+  struct guest_app *app;
+
+  for (z = zygotes; z < &zygotes[ZYGOTE_NPATHS]; z++) {
+    if (z->n == 0 || strcmp(z->path, path) != 0)
+      continue;
+    app = z->shells[--z->n];
+    if (gbind_app(app->seg.pid, parent_pid) < 0) {
+      fail_app(app);
+      return 0;
     }
+    app->parent = parent_pid;
+    app->pooled = 0;
+    return app;
   }
+  return 0;
+}
+
+// Starts pooling path if there is room for another program.
+static void zygote_learn(char *path) {
+  struct zygote *z, *empty = 0;
+
+  for (z = zygotes; z < &zygotes[ZYGOTE_NPATHS]; z++) {
+    if (z->path[0] && strcmp(z->path, path) == 0)
+      return;
+    if (!z->path[0] && empty == 0)
+      empty = z;
+  }
+  if (empty)
+    strcpy(empty->path, path);
+}
+
+// Adds one shell to the first pool that is not full. Called after every
+// message is answered, so refills stay off the launch path. Shells are
+// children of init until gbind_app hands them to a requester, so a shell
+// that fails to build is reaped by init.
+static void zygote_refill(void) {
+  struct zygote *z;
+  struct guest_app *app;
+
+  for (z = zygotes; z < &zygotes[ZYGOTE_NPATHS]; z++) {
+    if (!z->path[0] || z->n == ZYGOTE_DEPTH)
+      continue;
+    if ((app = create_app(z->path, 1)) == 0) {
+      // program is gone or we are out of resources; stop pooling it and
+      // give back the shells it still holds
+      while (z->n > 0)
+        fail_app(z->shells[--z->n]);
+      z->path[0] = 0;
+      return;
+    }
+    app->pooled = 1;
+    z->shells[z->n++] = app;
+    return;
+  }
+}
+
+// Drops app from the pool that holds it, if any.
+static void zygote_forget(struct guest_app *app) {
+  struct zygote *z;
+
+  for (z = zygotes; z < &zygotes[ZYGOTE_NPATHS]; z++) {
+    for (int i = 0; i < z->n; i++) {
+      if (z->shells[i] == app) {
+        z->shells[i] = z->shells[--z->n];
+        return;
+      }
+    }
+  }
+}
+
+// xkvisor reclaimed the frames of an exited app; drop the app and resync
+// the page map.
+int guest_destroy_app(struct syscall_message *syscall) {
+  struct guest_app *app;
+
+  if ((app = findapp(syscall->pid)) == 0)
+    return -1;
+  if (app->pooled)
+    zygote_forget(app); // killed while it sat in a pool
+  retire_app(app);
+  sync_frames();
+  return 0;
+}
+
+// Returns the cached copy of the file open on kfd with status st, reading
+// it in if needed, or 0 if it does not fit the cache. xk files carry no
+// modification time, so a copy is reused while inode and size still match.
+static struct fcache *fcache_get(char *path, int kfd, struct stat *st) {
+  struct fcache *c, *victim = 0;
+  int n, tot;
+
+  for (c = fcache; c < &fcache[FCACHE_NFILES]; c++) {
+    if (c->valid && c->st.ino == st->ino && c->st.size == st->size &&
+        strcmp(c->path, path) == 0)
+      goto found;
+  }
+
+  if (st->type != T_FILE || st->size > FCACHE_FILESIZE)
+    return 0;
+  for (c = fcache; c < &fcache[FCACHE_NFILES]; c++) {
+    if (c->nref > 0)
+      continue;
+    if (!c->valid) {
+      victim = c;
+      break;
+    }
+    if (victim == 0 || c->lastuse < victim->lastuse)
+      victim = c;
+  }
+  if ((c = victim) == 0)
+    return 0;
+
+  c->valid = 0;
+  for (tot = 0; tot < st->size; tot += n)
+    if ((n = read(kfd, c->data + tot, st->size - tot)) <= 0)
+      return 0;
+  strcpy(c->path, path);
+  c->st = *st;
+  c->valid = 1;
+
+found:
+  c->nref++;
+  c->lastuse = ++fcache_clock;
+  return c;
+}
+
+// returns the open app fd, 0 if fd is not open
+static struct guest_fd *appfd(struct guest_app *app, int fd) {
+  if (fd < 3 || fd >= GUEST_NOFILE || !app->ofile[fd].used)
+    return 0;
+  return &app->ofile[fd];
+}
+
+static void fdclose(struct guest_fd *f) {
+  if (!f->used)
+    return;
+  if (f->c)
+    f->c->nref--;
+  else
+    close(f->kfd);
+  f->used = 0;
+}
+
+// Copies n bytes to va in the app. Stack and heap pages the guest mapped are
+// mirrored at the same va in the guest, so those are a plain memmove; other
+// app memory goes through gcopyout.
+static int copytoapp(struct guest_app *app, uint64_t va, void *src, int n) {
+  uint64_t lo = app->seg.midpoint - APP_STACK_PAGES * PGSIZE;
+  uint64_t hi = app->seg.midpoint + PGROUNDUP(app->brk);
+
+  // a forked app's window is shared, and its frames may be copy-on-write
+  if (!app->forked && va >= lo && va + n <= hi && va + n >= va) {
+    memmove((void *) va, src, n);
+    return n;
+  }
+  return gcopyout(app->seg.pid, va, src, n);
+}
+
+// Opens a file for reading on behalf of an app. Only O_RDONLY is served;
+// apps write through MESSAGE_WRITE.
+int guest_open(struct syscall_message *syscall) {
+  char *path = syscall->args[0].arg_val.string;
+  int mode = syscall->args[1].arg_val.i;
+  struct guest_app *app;
+  struct guest_fd *f;
+  struct stat st;
+  int fd, kfd;
+
+  if ((app = findapp(syscall->pid)) == 0 || mode != O_RDONLY)
+    return -1;
+  path[MAX_STRING_SIZE - 1] = 0;
+
+  for (fd = 3; fd < GUEST_NOFILE && app->ofile[fd].used; fd++)
+    ;
+  if (fd == GUEST_NOFILE)
+    return -1;
+
+  if ((kfd = open(path, O_RDONLY)) < 0)
+    return -1;
+  // reading a device would block the guest for every app
+  if (fstat(kfd, &st) < 0 || st.type == T_DEV) {
+    close(kfd);
+    return -1;
+  }
+
+  f = &app->ofile[fd];
+  f->used = 1;
+  f->off = 0;
+  f->kfd = -1;
+  if ((f->c = fcache_get(path, kfd, &st)) != 0)
+    close(kfd);
+  else
+    f->kfd = kfd;
+  return fd;
+}
+
+int guest_read(struct syscall_message *syscall) {
+  int fd = syscall->args[0].arg_val.i;
+  uint64_t va = (uint64_t) syscall->args[1].arg_val.void_ptr;
+  int n = syscall->args[2].arg_val.i;
+  struct guest_app *app;
+  struct guest_fd *f;
+  int tot, m, r = 0;
+
+  if ((app = findapp(syscall->pid)) == 0 || (f = appfd(app, fd)) == 0 || n < 0)
+    return -1;
+
+  // cached: no kernel crossing beyond the reply
+  if (f->c) {
+    if (f->off >= f->c->st.size)
+      return 0;
+    if (n > f->c->st.size - f->off)
+      n = f->c->st.size - f->off;
+    if (copytoapp(app, va, f->c->data + f->off, n) < 0)
+      return -1;
+    f->off += n;
+    return n;
+  }
+
+  for (tot = 0; tot < n; tot += r) {
+    m = n - tot < sizeof(bounce) ? n - tot : sizeof(bounce);
+    if ((r = read(f->kfd, bounce, m)) <= 0)
+      break;
+    if (copytoapp(app, va + tot, bounce, r) < 0)
+      return -1;
+    f->off += r;
+  }
+  return tot > 0 || r == 0 ? tot : -1;
+}
+
+int guest_fstat(struct syscall_message *syscall) {
+  int fd = syscall->args[0].arg_val.i;
+  uint64_t va = (uint64_t) syscall->args[1].arg_val.stat_ptr;
+  struct guest_app *app;
+  struct guest_fd *f;
+  struct stat st;
+
+  if ((app = findapp(syscall->pid)) == 0 || (f = appfd(app, fd)) == 0)
+    return -1;
+  if (f->c)
+    st = f->c->st;
+  else if (fstat(f->kfd, &st) < 0)
+    return -1;
+  return copytoapp(app, va, &st, sizeof(st)) < 0 ? -1 : 0;
+}
+
+int guest_close(struct syscall_message *syscall) {
+  struct guest_app *app;
+  struct guest_fd *f;
+
+  if ((app = findapp(syscall->pid)) == 0 || (f = appfd(app, syscall->args[0].arg_val.i)) == 0)
+    return -1;
+  fdclose(f);
+  return 0;
+}
+
+// Moves the app's break by n bytes, mapping zeroed guest frames above the
+// midpoint of its window or handing them back. Returns the old break.
+int guest_sbrk(struct syscall_message *syscall) {
+  int n = syscall->args[0].arg_val.i;
+  struct guest_app *app;
+  struct guest_frame *f;
+  uint64_t old, top, newtop, va;
+
+  if ((app = findapp(syscall->pid)) == 0)
+    return -1;
+  if (n < 0 && -n > app->brk)
+    return -1;
+  if (n > 0 && app->seg.midpoint + app->brk + n > app->seg.bound)
+    return -1;
+
+  old = app->seg.midpoint + app->brk;
+  top = app->seg.midpoint + PGROUNDUP(app->brk);
+  newtop = app->seg.midpoint + PGROUNDUP(app->brk + n);
+
+  for (va = top; va < newtop; va += PGSIZE) {
+    if ((f = take_frame()) == 0 || gaddmap(app->seg.pid, f->ppn, va, 1, 1) < 0) {
+      if (f)
+        put_frame(f);
+      // undo this call's mappings
+      while (va > top) {
+        va -= PGSIZE;
+        gremovemap(app->seg.pid, va);
+        app->npages--;
+      }
+      return -1;
+    }
+    memset((void *) va, 0, PGSIZE); // through our mirror mapping
+    app->npages++;
+  }
+
+  // unmapped frames, and frames a forked app stops sharing, are back in
+  // the pool at the next sync_frames
+  for (va = top; va > newtop; va -= PGSIZE) {
+    gremovemap(app->seg.pid, va - PGSIZE);
+    app->npages--;
+  }
+
+  app->brk += n;
+  return (int) old;
+}
+
+// xkvisor is short on memory; give back up to the requested number of idle
+// frames, keeping GUEST_RESERVE_PAGES so new apps can still start.
+int guest_mem_pressure(struct syscall_message *syscall) {
+  int want = syscall->args[0].arg_val.i;
+  int balloon[BALLOON_CHUNK]; // ppns handed back by one ginflate
+  int n = 0, sent = 0, freed = 0;
+  int idle = 0;
+
+  for (int i = 0; i < nframes; i++)
+    if (frames[i].maps == 1)
+      idle++;
+
+  for (int i = 0; i < nframes && sent + n < want && idle > GUEST_RESERVE_PAGES; i++) {
+    if (frames[i].maps != 1)
+      continue;
+    balloon[n++] = frames[i].ppn;
+    idle--;
+    if (n == BALLOON_CHUNK) {
+      freed += ginflate(balloon, n);
+      sent += n;
+      n = 0;
+    }
+  }
+  if (n > 0) {
+    freed += ginflate(balloon, n);
+    sent += n;
+  }
+  if (sent == 0)
+    return 0;
+
+  sync_frames();
+  return freed;
+}
+
+// Reaps the used ring: records the status of every finished descriptor and
+// makes it available again. Returns the number reaped.
+static int blk_reap(void) {
+  static uint used_seen;
+  int n = 0;
+
+  for (; used_seen != blkring.used_idx; used_seen++, n++) {
+    struct pvblk_used *u = &blkring.used[used_seen % PVBLK_RING_SIZE];
+    if (u->id < PVBLK_RING_SIZE) {
+      blkstatus[u->id] = u->status;
+      blkfree[u->id] = 1;
+    }
+  }
+  return n;
+}
+
+// returns a descriptor that is not in flight, -1 if there is none
+static int blk_freedesc(void) {
+  for (int id = 0; id < PVBLK_RING_SIZE; id++)
+    if (blkfree[id])
+      return id;
   return -1;
 }
+
+int guest_blk_complete(struct syscall_message *syscall) {
+  return blk_reap();
+}
+
+// Posts a request for nblocks contiguous blocks of the disk without telling
+// xkvisor; blk_kick sends the whole batch. Returns the descriptor id, or -1
+// if the ring is full.
+int blk_submit(uint blockno, uint nblocks, char *data, int type) {
+  int id;
+
+  if ((id = blk_freedesc()) < 0) {
+    // ring is full; flush it and take back whatever completed
+    blk_kick();
+    blk_reap();
+    if ((id = blk_freedesc()) < 0)
+      return -1;
+  }
+
+  blkfree[id] = 0;
+  blkring.desc[id].blockno = blockno;
+  blkring.desc[id].nblocks = nblocks;
+  blkring.desc[id].type = type;
+  blkring.desc[id].data = data;
+  blkring.avail[blkring.avail_idx % PVBLK_RING_SIZE] = id;
+  blkring.avail_idx++;
+  blkpending++;
+  return id;
+}
+
+// Notifies xkvisor of every request posted since the last kick.
+int blk_kick(void) {
+  if (blkpending == 0)
+    return 0;
+  blkpending = 0;
+  return gblk_notify();
+}
+
+// Reads or writes nblocks blocks at blockno and waits for the result,
+// splitting the transfer into as many descriptors as needed but notifying
+// xkvisor once. Returns 0 on success, -1 on failure.
+int blk_rw(uint blockno, uint nblocks, char *data, int type) {
+  int ids[PVBLK_RING_SIZE];
+  int n = 0, ret = 0;
+
+  while (nblocks > 0) {
+    uint m = nblocks < PVBLK_MAX_NBLOCKS ? nblocks : PVBLK_MAX_NBLOCKS;
+    if (n == PVBLK_RING_SIZE || (ids[n] = blk_submit(blockno, m, data, type)) < 0)
+      return -1;
+    n++;
+    blockno += m;
+    nblocks -= m;
+    data += m * BSIZE;
+  }
+
+  blk_kick();
+  blk_reap();
+  for (int i = 0; i < n; i++)
+    if (!blkfree[ids[i]] || blkstatus[ids[i]] != PVBLK_OK)
+      ret = -1;
+  return ret;
+}
+
+// drops the guest's record of an app that is gone
+static void retire_app(struct guest_app *app) {
+  for (int fd = 0; fd < GUEST_NOFILE; fd++)
+    fdclose(&app->ofile[fd]);
+  window_refs[app->window]--;
+  app->seg.owned = 0;
+}
+
+// Clones the requesting app. The child shares the parent's frames
+// copy-on-write and its va window, gets copies of its fds (each with its own
+// offset) and returns 0 from afork. Replies with the child's pid.
+int guest_fork(struct syscall_message *syscall) {
+  struct guest_app *parent, *child = 0;
+  struct guest_fd *f;
+  int pid;
+
+  if ((parent = findapp(syscall->pid)) == 0)
+    return -1;
+  for (int slot = 0; slot < MAX_PROC; slot++) {
+    if (!apps[slot].seg.owned) {
+      child = &apps[slot];
+      break;
+    }
+  }
+  if (child == 0)
+    return -1;
+
+  if ((pid = gfork_app(parent->seg.pid, &child->seg)) < 0)
+    return -1;
+  child->parent = parent->seg.pid;
+  child->npages = parent->npages;
+  child->nsyscalls = 0;
+  child->brk = parent->brk;
+  child->window = parent->window;
+  child->forked = parent->forked = 1;
+  window_refs[child->window]++;
+
+  for (int fd = 0; fd < GUEST_NOFILE; fd++) {
+    child->ofile[fd] = parent->ofile[fd];
+    f = &child->ofile[fd];
+    if (!f->used)
+      continue;
+    if (f->c)
+      f->c->nref++;
+    else if ((f->kfd = dup(f->kfd)) < 0)
+      f->used = 0;
+  }
+
+  gresume(pid, 0);
+  return pid;
+}
+
+// An app wrote to a frame it shares with other apps; give it its own copy.
+int guest_cow_fault(struct syscall_message *syscall) {
+  uint64_t va = syscall->args[0].arg_val.l;
+  struct guest_app *app;
+  struct guest_frame *f;
+
+  if ((app = findapp(syscall->pid)) == 0 || (f = take_frame()) == 0)
+    return -1;
+  if (gcowcopy(app->seg.pid, va, f->ppn) < 0) {
+    put_frame(f);
+    return -1;
+  }
+  app->npages++;
+  return 0;
+}
+
+// returns the table entry of the app with the given pid, 0 if not ours
+static struct guest_app *findapp(int pid) {
+  for (int i = 0; i < MAX_PROC; i++) {
+    if (apps[i].seg.owned && apps[i].seg.pid == pid)
+      return &apps[i];
+  }
+  return 0;
+}
+
+// Refreshes our copy of the frames xkvisor leases us, growing it when the
+// lease outgrew it. Frames that apps stopped mapping show up idle again.
+static void sync_frames(void)
+{
+  int n;
+
+  while ((n = gquery_user_pages(frames, maxframes)) > maxframes) {
+    if (frames)
+      free(frames);
+    maxframes = n + BALLOON_CHUNK;
+    if ((frames = malloc(maxframes * sizeof(struct guest_frame))) == 0) {
+      maxframes = 0;
+      n = 0;
+      break;
+    }
+  }
+  nframes = n < 0 ? 0 : n;
+  nextidle = 0;
+}
+
+// retrieves next available frame from the pool. sets it to 2 marking it as
+// in use. 1 is available, 2 and up is mapped by that many apps plus one.
+// When the pool looks empty, resyncs with xkvisor (frames free up behind
+// our back), then deflates the balloon by BALLOON_CHUNK pages. Returns 0
+// if there is no frame to be had.
+static struct guest_frame *take_frame(void)
+{
+  for (int tries = 0; tries < 3; tries++) {
+    for (; nextidle < nframes; nextidle++) {
+      if (frames[nextidle].maps == 1) {
+        frames[nextidle].maps = 2; // set page as in use by app
+        return &frames[nextidle++];
+      }
+    }
+    if (tries == 1 && gdeflate(BALLOON_CHUNK) <= 0)
+      break;
+    sync_frames();
+  }
+  return 0;
+}
+
+// Puts a frame from take_frame that ended up unused back into the pool.
+static void put_frame(struct guest_frame *f)
+{
+  f->maps = 1;
+  if (f - frames < nextidle)
+    nextidle = f - frames;
+}
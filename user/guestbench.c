@@ -0,0 +1,58 @@
+// guestbench [napps] [nprints]
+// Launches napps guest_test apps at once and reports the aggregate
+// hypercall rate while they all run. xkvisor spreads the apps across the
+// NGUESTS guest oses init starts, by load.
+#include <cdefs.h>
+#include <sysinfo.h>
+#include <user.h>
+#include <syscall_message.h>
+
+#define DEFAULT_APPS 32
+#define DEFAULT_PRINTS 10
+#define TICKS_PER_SEC 100
+
+int main(int argc, char *argv[]) {
+  int napps = argc > 1 ? atoi(argv[1]) : DEFAULT_APPS;
+  int nprints = argc > 2 ? atoi(argv[2]) : DEFAULT_PRINTS;
+  struct sys_info before, after;
+  struct arg args[MAX_ARGS + 1];
+  char nbuf[16];
+  int launched, start, ticks, hypercalls;
+
+  // guest_test <nprints> 0
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 3;
+  setstrarg(&args[1], "guest_test");
+  itoa(nprints, nbuf);
+  setstrarg(&args[2], nbuf);
+  setstrarg(&args[3], "0");
+
+  sysinfo(&before);
+  start = uptime();
+
+  // every app is our child, so all of them run concurrently
+  launched = 0;
+  for (int i = 0; i < napps; i++) {
+    if (app_syscall(MESSAGE_INIT_APP, args) < 0) {
+      printf(1, "guestbench: launch %d failed\n", i);
+      break;
+    }
+    launched++;
+  }
+
+  for (int i = 0; i < launched; i++)
+    wait();
+
+  ticks = uptime() - start;
+  sysinfo(&after);
+  hypercalls = after.num_hypercalls - before.num_hypercalls;
+  if (ticks == 0)
+    ticks = 1;
+
+  printf(1, "guestbench: %d apps, %d hypercalls in %d ticks\n",
+         launched, hypercalls, ticks);
+  printf(1, "guestbench: %d hypercalls/sec aggregate\n",
+         hypercalls * TICKS_PER_SEC / ticks);
+  exit();
+  return 0;
+}
@@ -18,26 +18,33 @@ int main(void) {
   dup(0); // stdout
   dup(0); // stderr
 
-  // startup guest OS
+  // startup guest OSes; new apps are spread across them by load
   char *argv2[] = {"guest_os", 0};
-  if (fork_guest(DEFAULT_USER_PAGES) == 0) {
-    exec("guest_os", argv2);
-  } else {
-    for (;;) {
-      printf(1, "init: starting sh\n");
-      pid = fork();
-      if (pid < 0) {
-        printf(1, "init: fork failed\n");
-        exit();
-      }
-      if (pid == 0) {
-        exec("sh", argv);
-        printf(1, "init: exec sh failed\n");
-        exit();
-      }
-      while ((wpid = wait()) >= 0 && wpid != pid)
-        printf(1, "zombie!\n");
+  for (int i = 0; i < NGUESTS; i++) {
+    pid = fork_guest(DEFAULT_USER_PAGES / NGUESTS);
+    if (pid < 0) {
+      printf(1, "init: fork_guest failed\n");
+    } else if (pid == 0) {
+      exec("guest_os", argv2);
+      printf(1, "init: exec guest_os failed\n");
+      exit();
     }
   }
+
+  for (;;) {
+    printf(1, "init: starting sh\n");
+    pid = fork();
+    if (pid < 0) {
+      printf(1, "init: fork failed\n");
+      exit();
+    }
+    if (pid == 0) {
+      exec("sh", argv);
+      printf(1, "init: exec sh failed\n");
+      exit();
+    }
+    while ((wpid = wait()) >= 0 && wpid != pid)
+      printf(1, "zombie!\n");
+  }
   return 0;
 }
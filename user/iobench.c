@@ -0,0 +1,125 @@
+// iobench [seqfile] [randfile]
+// Reads seqfile front to back with one read() per block, then touches the
+// pages of randfile in a scrambled order through a private mmap, then
+// has NPAR processes read a file each at the same time, then rewrites a
+// file of 16 blocks and syncs it. Reports the ticks, blocks and disk
+// commands of each: with merged multi-sector commands a sequential run
+// costs one command instead of one per block, and each page of the
+// random pass costs one. The parallel pass gains from a disk that takes
+// more than one request at a time (make qemu-virtio). Run it right
+// after boot, so that the files are not cached yet.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <mman.h>
+#include <stat.h>
+#include <user.h>
+
+#define DEFAULT_SEQFILE "guest_os"
+#define DEFAULT_RANDFILE "guestbench"
+#define FILEBLOCKS 16
+#define PGSIZE 4096
+#define NPAR 4
+#define COUNTERS (BENCH_BLOCK_MISSES | BENCH_DISK_WRITES | BENCH_DISK_COMMANDS)
+
+static char *parfiles[NPAR] = {"cat", "grep", "ls", "wc"};
+
+static char buf[BSIZE];
+
+// Returns the size of path in blocks, reading it all if read is set, or
+// -1 if it cannot be opened.
+static int
+blocksof(char *path, int read_it)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    return -1;
+  while (read_it && read(fd, buf, sizeof(buf)) > 0)
+    ;
+  close(fd);
+  return (st.size + BSIZE - 1) / BSIZE;
+}
+
+int main(int argc, char *argv[]) {
+  char *seqfile = argc > 1 ? argv[1] : DEFAULT_SEQFILE;
+  char *randfile = argc > 2 ? argv[2] : DEFAULT_RANDFILE;
+  struct bench bench = {"iobench"};
+  struct stat st;
+  int fd, n, npages, step, blocks;
+  uint sum = 0;
+  char *map;
+
+  if ((fd = open(seqfile, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    printf(1, "iobench: cannot open %s\n", seqfile);
+    exit();
+  }
+  benchstart(&bench);
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    sum += (uchar) buf[0];
+  benchreport(&bench, "sequential read", (st.size + BSIZE - 1) / BSIZE, "blocks",
+              COUNTERS);
+  close(fd);
+
+  if ((fd = open(randfile, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.size == 0) {
+    printf(1, "iobench: cannot open %s\n", randfile);
+    exit();
+  }
+  if ((map = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    printf(1, "iobench: mmap failed\n");
+    exit();
+  }
+  // stepping by a number coprime to npages visits every page once
+  npages = (st.size + PGSIZE - 1) / PGSIZE;
+  for (step = npages / 2 + 1; step > 1; step--) {
+    int a = npages, b = step;
+    while (b) {
+      int t = a % b;
+      a = b;
+      b = t;
+    }
+    if (a == 1)
+      break;
+  }
+  benchstart(&bench);
+  for (int i = 0, pg = 0; i < npages; i++, pg = (pg + step) % npages)
+    sum += (uchar) map[pg * PGSIZE];
+  benchreport(&bench, "random page read", (st.size + BSIZE - 1) / BSIZE, "blocks",
+              COUNTERS);
+  munmap(map, st.size);
+  close(fd);
+
+  blocks = 0;
+  for (int i = 0; i < NPAR; i++)
+    if ((n = blocksof(parfiles[i], 0)) > 0)
+      blocks += n;
+  benchstart(&bench);
+  for (int i = 0; i < NPAR; i++) {
+    if (fork() == 0) {
+      blocksof(parfiles[i], 1);
+      exit();
+    }
+  }
+  for (int i = 0; i < NPAR; i++)
+    wait();
+  benchreport(&bench, "parallel read", blocks, "blocks", COUNTERS);
+
+  // O_CREATE always makes a new file, so only create it once
+  if ((fd = open("iobench.out", O_RDWR)) < 0 &&
+      (fd = open("iobench.out", O_CREATE | O_RDWR)) < 0) {
+    printf(1, "iobench: cannot create iobench.out\n");
+    exit();
+  }
+  memset(buf, 'i' + sum % 2, sizeof(buf));
+  sync();
+  benchstart(&bench);
+  for (int b = 0; b < FILEBLOCKS; b++)
+    write(fd, buf, BSIZE);
+  sync();
+  benchreport(&bench, "sequential write and sync", FILEBLOCKS, "blocks", COUNTERS);
+  close(fd);
+  exit();
+  return 0;
+}
@@ -0,0 +1,54 @@
+// launchbench [nlaunches]
+// Launches a short guest_test app nlaunches times, one at a time, first
+// with MESSAGE_INIT_APP_COLD (the guest loads every app from scratch) and
+// then with MESSAGE_INIT_APP (the guest hands out a zygote shell), and
+// reports the ticks spent waiting for the guest to reply to each launch.
+#include <cdefs.h>
+#include <user.h>
+#include <syscall_message.h>
+
+#define DEFAULT_LAUNCHES 20
+#define REFILL_TICKS 2 // lets the guest refill its pool between launches
+
+// Returns the ticks spent in n launches of the app in args, or -1.
+static int launch(int message, struct arg *args, int n) {
+  int start, ticks = 0;
+
+  for (int i = 0; i < n; i++) {
+    start = uptime();
+    if (app_syscall(message, args) < 0) {
+      printf(1, "launchbench: launch %d failed\n", i);
+      return -1;
+    }
+    ticks += uptime() - start;
+    wait();
+    sleep(REFILL_TICKS);
+  }
+  return ticks;
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : DEFAULT_LAUNCHES;
+  struct arg args[MAX_ARGS + 1];
+  int cold, warm;
+
+  // guest_test 0 0
+  args[0].arg_type = INT_TYPE;
+  args[0].arg_val.i = 3;
+  setstrarg(&args[1], "guest_test");
+  setstrarg(&args[2], "0");
+  setstrarg(&args[3], "0");
+
+  // the first warm launch teaches the guest to pool guest_test
+  if (launch(MESSAGE_INIT_APP, args, 1) < 0)
+    exit();
+
+  if ((cold = launch(MESSAGE_INIT_APP_COLD, args, n)) < 0 ||
+      (warm = launch(MESSAGE_INIT_APP, args, n)) < 0)
+    exit();
+
+  printf(1, "launchbench: %d cold launches in %d ticks\n", n, cold);
+  printf(1, "launchbench: %d pooled launches in %d ticks\n", n, warm);
+  exit();
+  return 0;
+}
@@ -0,0 +1,67 @@
+// logbench [procs] [records]
+// procs processes each append records small records to a file of their
+// own, one write() per record. Every write is a file system transaction
+// that updates a data block and, while the file grows, the inode file.
+// Transactions of all the processes share log commits, and repeated
+// writes of a block are absorbed, so there are far fewer commits and
+// disk writes than write() calls. Reports the ticks, commits and disk
+// writes, then the same for the sync that makes it all durable.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <user.h>
+
+#define DEFAULT_PROCS 4
+#define DEFAULT_RECORDS 2048 // 64KB per file, which grows by several extents
+#define RECORD 32
+#define COUNTERS (BENCH_COMMITS | BENCH_DISK_WRITES)
+
+static void
+child(int id, int records)
+{
+  char path[] = "logbench0";
+  char rec[RECORD];
+  int fd;
+
+  path[8] += id;
+  // O_CREATE always makes a new file, so only create it once
+  if ((fd = open(path, O_RDWR)) < 0 && (fd = open(path, O_CREATE | O_RDWR)) < 0) {
+    printf(1, "logbench: cannot create %s\n", path);
+    exit();
+  }
+  memset(rec, 'a' + id, sizeof(rec));
+  for (int i = 0; i < records; i++) {
+    if (write(fd, rec, sizeof(rec)) != sizeof(rec)) {
+      printf(1, "logbench: %s is full after %d records\n", path, i);
+      break;
+    }
+  }
+  close(fd);
+  exit();
+}
+
+int main(int argc, char *argv[]) {
+  int procs = argc > 1 ? atoi(argv[1]) : DEFAULT_PROCS;
+  int records = argc > 2 ? atoi(argv[2]) : DEFAULT_RECORDS;
+  struct bench bench = {"logbench"};
+
+  if (procs <= 0 || procs > 8 || records <= 0) {
+    printf(1, "usage: logbench [procs <= 8] [records]\n");
+    exit();
+  }
+  sync();
+
+  benchstart(&bench);
+  for (int i = 0; i < procs; i++)
+    if (fork() == 0)
+      child(i, records);
+  for (int i = 0; i < procs; i++)
+    wait();
+  benchreport(&bench, "append", procs * records, "writes", COUNTERS);
+
+  benchstart(&bench);
+  sync();
+  benchreport(&bench, "sync", 0, "writes", COUNTERS);
+  exit();
+  return 0;
+}
@@ -0,0 +1,73 @@
+// mapbench [file] [rounds]
+// Scans a file rounds times with read() and then rounds times through a
+// private mmap of it, checking both see the same bytes. The first read
+// pass brings the file into the page cache; the later passes and the
+// mapped ones are served from memory. Reports the time taken and the disk
+// reads of each.
+#include <cdefs.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <stat.h>
+#include <sysinfo.h>
+#include <user.h>
+
+#define DEFAULT_FILE "guest_os"
+#define DEFAULT_ROUNDS 8
+
+static char buf[4096];
+
+int main(int argc, char *argv[]) {
+  char *path = argc > 1 ? argv[1] : DEFAULT_FILE;
+  int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+  struct sys_info before, after;
+  struct stat st;
+  uint rsum = 0, msum = 0;
+  int fd, n, start, ticks;
+  char *map;
+
+  if (rounds <= 0) {
+    printf(1, "usage: mapbench [file] [rounds]\n");
+    exit();
+  }
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.size == 0) {
+    printf(1, "mapbench: cannot open %s\n", path);
+    exit();
+  }
+
+  sysinfo(&before);
+  start = uptime();
+  for (int r = 0; r < rounds; r++) {
+    close(fd);
+    fd = open(path, O_RDONLY);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      for (int i = 0; i < n; i++)
+        rsum += (uchar) buf[i];
+  }
+  ticks = uptime() - start;
+  sysinfo(&after);
+  printf(1, "mapbench: read %d x %d bytes, %d ticks, %d disk reads, %d cache hits\n",
+         rounds, st.size, ticks, after.num_disk_reads - before.num_disk_reads,
+         after.num_pcache_hits - before.num_pcache_hits);
+
+  if ((map = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    printf(1, "mapbench: mmap failed\n");
+    exit();
+  }
+  sysinfo(&before);
+  start = uptime();
+  for (int r = 0; r < rounds; r++)
+    for (int i = 0; i < st.size; i++)
+      msum += (uchar) map[i];
+  ticks = uptime() - start;
+  sysinfo(&after);
+  printf(1, "mapbench: mmap %d x %d bytes, %d ticks, %d disk reads, %d pages mapped\n",
+         rounds, st.size, ticks, after.num_disk_reads - before.num_disk_reads,
+         after.num_file_maps - before.num_file_maps);
+
+  if (rsum != msum)
+    printf(1, "mapbench: mmap saw different bytes than read\n");
+  munmap(map, st.size);
+  close(fd);
+  exit();
+  return 0;
+}
@@ -204,11 +204,10 @@ int main(void) {
        strcpy(args[i + 1].arg_val.string, argv[i]);
     }
     // send 
-    app_syscall(MESSAGE_INIT_APP, (void *) &args);
-
-    // shell wakeups after sending init message, woken up by guest os (gresume)
-    // then shell goes back to sleep in wait while user program runs
-    // guest os sets up shell as parent of user process
+    // guest os answers with the pid of the new app (gresume) and sets up
+    // shell as parent of user process, so shell sleeps in wait while it runs
+    if (app_syscall(MESSAGE_INIT_APP, (void *) &args) < 0)
+      continue;
 
     wait();
   }
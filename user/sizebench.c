@@ -0,0 +1,78 @@
+// sizebench [bigfile]
+// Small files: opens every file of the root directory and reads its
+// first 512 bytes. Large file: reads bigfile front to back with 4KB
+// read()s, then writes a new file of FILEBYTES and syncs it. Reports the
+// ticks, the blocks missed in the buffer cache and the disk commands of
+// each, with the block size the file system was built with; build and
+// run it once with make and once with make BSIZE=4096 (after a make
+// clean) to compare. Run it right after boot, so nothing is cached yet.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <stat.h>
+#include <user.h>
+
+#define DEFAULT_BIGFILE "guest_os"
+#define FILEBYTES (64 * 1024)
+#define COUNTERS (BENCH_BLOCK_MISSES | BENCH_DISK_COMMANDS)
+
+static char buf[4096];
+
+int main(int argc, char *argv[]) {
+  char *bigfile = argc > 1 ? argv[1] : DEFAULT_BIGFILE;
+  struct bench bench = {"sizebench"};
+  struct dirent de;
+  char name[DIRSIZ + 1];
+  int dir, fd, n, files = 0, bytes = 0;
+
+  if ((dir = open(".", O_RDONLY)) < 0) {
+    printf(1, "sizebench: cannot open .\n");
+    exit();
+  }
+  benchstart(&bench);
+  while (read(dir, &de, sizeof(de)) == sizeof(de)) {
+    if (de.inum == 0 || de.name[0] == '.')
+      continue;
+    memmove(name, de.name, DIRSIZ);
+    name[DIRSIZ] = 0;
+    if ((fd = open(name, O_RDONLY)) < 0)
+      continue;
+    if ((n = read(fd, buf, 512)) > 0)
+      bytes += n;
+    close(fd);
+    files++;
+  }
+  close(dir);
+  printf(1, "sizebench: BSIZE %d, %d small files\n", BSIZE, files);
+  benchreport(&bench, "small file reads", bytes, "bytes", COUNTERS);
+
+  if ((fd = open(bigfile, O_RDONLY)) < 0) {
+    printf(1, "sizebench: cannot open %s\n", bigfile);
+    exit();
+  }
+  bytes = 0;
+  benchstart(&bench);
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    bytes += n;
+  benchreport(&bench, "large file read", bytes, "bytes", COUNTERS);
+  close(fd);
+
+  // O_CREATE always makes a new file, so only create it once
+  if ((fd = open("sizebench.out", O_RDWR)) < 0 &&
+      (fd = open("sizebench.out", O_CREATE | O_RDWR)) < 0) {
+    printf(1, "sizebench: cannot create sizebench.out\n");
+    exit();
+  }
+  memset(buf, 's', sizeof(buf));
+  sync();
+  benchstart(&bench);
+  for (bytes = 0; bytes < FILEBYTES; bytes += n)
+    if ((n = write(fd, buf, FILEBYTES - bytes < sizeof(buf) ? FILEBYTES - bytes : sizeof(buf))) <= 0)
+      break;
+  sync();
+  benchreport(&bench, "file write and sync", bytes, "bytes", COUNTERS);
+  close(fd);
+  exit();
+  return 0;
+}
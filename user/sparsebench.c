@@ -0,0 +1,53 @@
+// sparsebench [npages] [stride]
+// Grows the heap by npages with sbrk and then touches only every stride-th
+// page, half of them by writing and half by reading, the way an allocator
+// arena is used. Reports the time taken, the memory that actually got
+// allocated and how the kernel populated the touched pages.
+#include <cdefs.h>
+#include <sysinfo.h>
+#include <user.h>
+
+#define PGSIZE 4096
+#define DEFAULT_PAGES 1024
+#define DEFAULT_STRIDE 16
+
+int main(int argc, char *argv[]) {
+  int npages = argc > 1 ? atoi(argv[1]) : DEFAULT_PAGES;
+  int stride = argc > 2 ? atoi(argv[2]) : DEFAULT_STRIDE;
+  struct sys_info before, after;
+  volatile char *arena;
+  int start, ticks, sum = 0;
+
+  if (npages <= 0 || stride <= 0) {
+    printf(1, "usage: sparsebench [npages] [stride]\n");
+    exit();
+  }
+
+  sysinfo(&before);
+  start = uptime();
+
+  if ((arena = sbrk(npages * PGSIZE)) == (char *) -1) {
+    printf(1, "sparsebench: sbrk of %d pages failed\n", npages);
+    exit();
+  }
+  for (int i = 0; i < npages; i += stride) {
+    if ((i / stride) % 2 == 0)
+      arena[i * PGSIZE] = 1;
+    else
+      sum += arena[i * PGSIZE];
+  }
+
+  ticks = uptime() - start;
+  sysinfo(&after);
+
+  printf(1, "sparsebench: %d pages reserved, every %dth touched, %d ticks\n",
+         npages, stride, ticks);
+  printf(1, "sparsebench: %d pages allocated, %d zero-filled, %d zero page maps\n",
+         after.pages_in_use - before.pages_in_use,
+         after.num_lazy_pages - before.num_lazy_pages,
+         after.num_zero_maps - before.num_zero_maps);
+  if (sum != 0)
+    printf(1, "sparsebench: heap was not zeroed\n");
+  exit();
+  return 0;
+}
@@ -13,6 +13,25 @@ int main(int argc, char *argv[]) {
   printf(1, "free_pages = %d\n", info.free_pages);
   printf(1, "num_page_faults = %d\n", info.num_page_faults);
   printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  printf(1, "num_bcache_hits = %d\n", info.num_bcache_hits);
+  printf(1, "num_disk_writes = %d\n", info.num_disk_writes);
+  printf(1, "num_log_commits = %d\n", info.num_log_commits);
+  printf(1, "num_readahead_blocks = %d\n", info.num_readahead_blocks);
+  printf(1, "num_readahead_hits = %d\n", info.num_readahead_hits);
+  printf(1, "num_disk_requests = %d\n", info.num_disk_requests);
+  printf(1, "num_hypercalls = %d\n", info.num_hypercalls);
+  printf(1, "guest_pages = %d\n", info.guest_pages);
+  printf(1, "balloon_inflated = %d\n", info.balloon_inflated);
+  printf(1, "balloon_deflated = %d\n", info.balloon_deflated);
+  printf(1, "num_mem_pressure = %d\n", info.num_mem_pressure);
+  printf(1, "num_image_hits = %d\n", info.num_image_hits);
+  printf(1, "num_demand_pages = %d\n", info.num_demand_pages);
+  printf(1, "num_lazy_pages = %d\n", info.num_lazy_pages);
+  printf(1, "num_zero_maps = %d\n", info.num_zero_maps);
+  printf(1, "num_file_maps = %d\n", info.num_file_maps);
+  printf(1, "num_pcache_hits = %d\n", info.num_pcache_hits);
+  printf(1, "num_huge_pages = %d\n", info.num_huge_pages);
+  printf(1, "num_dcache_hits = %d\n", info.num_dcache_hits);
 
   exit();
 }
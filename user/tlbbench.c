@@ -0,0 +1,80 @@
+// tlbbench [mb] [accesses]
+// Touches every page of an mb sized anonymous mapping and then reads
+// random words all over it, once with 4KB pages (MAP_NOHUGE) and once with
+// 2MB pages. Random access over more memory than the TLB covers misses on
+// nearly every access with 4KB pages; one 2MB entry covers 512 of them.
+// The default size fits the 16MB machine; pass a larger mb on a larger
+// one.
+#include <cdefs.h>
+#include <mman.h>
+#include <sysinfo.h>
+#include <user.h>
+
+#define DEFAULT_MB 4
+#define DEFAULT_ACCESSES 4000000
+#define PGSIZE 4096
+
+static uint seed = 1;
+static uint64_t sink;
+
+static uint
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed;
+}
+
+// Returns the ticks taken by the random reads, or -1 if mmap failed.
+static int
+run(int len, int accesses, int flags, int *huge)
+{
+  struct sys_info before, after;
+  volatile uint64_t *map;
+  uint64_t sum = 0;
+  int start, ticks, nwords = len / sizeof(uint64_t);
+
+  sysinfo(&before);
+  map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  for (int i = 0; i < len; i += PGSIZE)
+    map[i / sizeof(uint64_t)] = i;
+  sysinfo(&after);
+  *huge = after.num_huge_pages - before.num_huge_pages;
+
+  seed = 1;
+  start = uptime();
+  for (int i = 0; i < accesses; i++)
+    sum += map[rnd() % nwords];
+  ticks = uptime() - start;
+
+  sink = sum;
+  munmap((void *) map, len);
+  return ticks;
+}
+
+int main(int argc, char *argv[]) {
+  int mb = argc > 1 ? atoi(argv[1]) : DEFAULT_MB;
+  int accesses = argc > 2 ? atoi(argv[2]) : DEFAULT_ACCESSES;
+  int small, large, huge;
+
+  if (mb <= 0 || accesses <= 0) {
+    printf(1, "usage: tlbbench [mb] [accesses]\n");
+    exit();
+  }
+
+  if ((small = run(mb << 20, accesses, MAP_NOHUGE, &huge)) < 0) {
+    printf(1, "tlbbench: mmap of %dMB failed\n", mb);
+    exit();
+  }
+  printf(1, "tlbbench: 4KB pages, %dMB, %d reads, %d ticks\n", mb, accesses, small);
+
+  if ((large = run(mb << 20, accesses, 0, &huge)) < 0) {
+    printf(1, "tlbbench: mmap of %dMB failed\n", mb);
+    exit();
+  }
+  printf(1, "tlbbench: 2MB pages, %dMB, %d reads, %d ticks, %d of %d blocks huge\n",
+         mb, accesses, large, huge, mb / 2);
+  exit();
+  return 0;
+}
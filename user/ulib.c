@@ -75,6 +75,22 @@ int atoi(const char *s) {
   return n;
 }
 
+// Writes n in decimal to buf, which must have room for 12 chars.
+void itoa(int n, char *buf) {
+  char tmp[16];
+  uint x = n < 0 ? -(uint) n : n;
+  int i = 0;
+
+  do {
+    tmp[i++] = '0' + x % 10;
+  } while ((x /= 10) != 0);
+  if (n < 0)
+    *buf++ = '-';
+  while (i > 0)
+    *buf++ = tmp[--i];
+  *buf = 0;
+}
+
 void *memmove(void *vdst, void *vsrc, int n) {
   char *dst, *src;
 
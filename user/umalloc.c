@@ -1,4 +1,5 @@
 #include <cdefs.h>
+#include <mman.h>
 #include <param.h>
 #include <stat.h>
 #include <user.h>
@@ -18,6 +19,12 @@ union header {
 
 typedef union header Header;
 
+// Requests of at least this many units get an mmap area of their own, which
+// free hands straight back to the kernel instead of keeping it in the heap.
+// No heap, ours or a guest os app's, lies in [MMAP_BASE, MMAP_TOP), so the
+// block's address tells the two apart.
+#define MMAP_UNITS 4096
+
 static Header base;
 static Header *freep;
 
@@ -25,6 +32,10 @@ void free(void *ap) {
   Header *bp, *p;
 
   bp = (Header *)ap - 1;
+  if ((uint64_t)bp >= MMAP_BASE && (uint64_t)bp < MMAP_TOP) {
+    munmap(bp, bp->s.size * sizeof(Header));
+    return;
+  }
   for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -51,6 +62,7 @@ static Header *morecore(uint nu) {
   if (p == (char *)-1)
     return 0;
   hp = (Header *)p;
+  hp->s.ptr = 0;
   hp->s.size = nu;
   free((void *)(hp + 1));
   return freep;
@@ -61,6 +73,13 @@ void *malloc(uint nbytes) {
   uint nunits;
 
   nunits = (nbytes + sizeof(Header) - 1) / sizeof(Header) + 1;
+  if (nunits >= MMAP_UNITS &&
+      (p = mmap(0, nunits * sizeof(Header), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED) {
+    p->s.ptr = 0;
+    p->s.size = nunits;
+    return (void *)(p + 1);
+  }
   if ((prevp = freep) == 0) {
     base.s.ptr = freep = prevp = &base;
     base.s.size = 0;
@@ -72,6 +91,7 @@ void *malloc(uint nbytes) {
       else {
         p->s.size -= nunits;
         p += p->s.size;
+        p->s.ptr = 0;
         p->s.size = nunits;
       }
       freep = prevp;
@@ -0,0 +1,64 @@
+// writebench [rounds]
+// Rewrites one block rounds times, as stressfs does, and then
+// writes a whole file rounds times, and reports the ticks and disk writes
+// of each. With a write-through cache every write() waits for the disk;
+// with delayed writes the rewrites cost one disk write at the next flush.
+// The time of the sync that puts everything on the disk is reported too.
+#include <cdefs.h>
+#include <bench.h>
+#include <fcntl.h>
+#include <fs.h>
+#include <stat.h>
+#include <user.h>
+
+#define DEFAULT_ROUNDS 200
+#define FILEBYTES (64 * 1024) // files grow by extents, so any size will do
+#define FILEBLOCKS (FILEBYTES / BSIZE)
+#define COUNTERS (BENCH_DISK_WRITES)
+
+static char data[BSIZE];
+
+int main(int argc, char *argv[]) {
+  int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+  struct bench bench = {"writebench"};
+  int fd;
+
+  if (rounds <= 0) {
+    printf(1, "usage: writebench [rounds]\n");
+    exit();
+  }
+  // O_CREATE always makes a new file, so only create it once
+  if ((fd = open("writebench.out", O_RDWR)) < 0 &&
+      (fd = open("writebench.out", O_CREATE | O_RDWR)) < 0) {
+    printf(1, "writebench: cannot create writebench.out\n");
+    exit();
+  }
+  memset(data, 'w', sizeof(data));
+  sync();
+
+  benchstart(&bench);
+  for (int r = 0; r < rounds; r++) {
+    close(fd);
+    fd = open("writebench.out", O_RDWR);
+    write(fd, data, BSIZE);
+  }
+  benchreport(&bench, "rewrite one block", rounds, "rounds", COUNTERS);
+
+  benchstart(&bench);
+  for (int r = 0; r < rounds; r++) {
+    close(fd);
+    fd = open("writebench.out", O_RDWR);
+    for (int b = 0; b < FILEBLOCKS; b++)
+      write(fd, data, BSIZE);
+  }
+  benchreport(&bench, "write 64KB file", rounds, "rounds", COUNTERS);
+
+  benchstart(&bench);
+  fsync(fd);
+  sync();
+  benchreport(&bench, "sync", 1, "rounds", COUNTERS);
+
+  close(fd);
+  exit();
+  return 0;
+}